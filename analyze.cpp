@@ -0,0 +1,231 @@
+/* Offline analysis of a `stream --record=PATH` file: what went out, when,
+ * and with which timestamps.
+ *
+ *     ./analyze capture.rec
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "recorder.h"
+
+// Sends further apart than this start a new transmission (stop/start over
+// the control socket), the gap between two isn't a stutter.
+#define SEGMENT_GAP_NSEC 1000000000LL
+
+static const long long e9 = 1000000000LL;
+
+struct Summary {
+    std::vector<double> v;
+
+    void add(double x) { v.push_back(x); }
+
+    double percentile(double p) {
+        if (v.empty())
+            return 0;
+        std::sort(v.begin(), v.end());
+        size_t i = (size_t) (p * (v.size() - 1) + 0.5);
+        return v[i];
+    }
+
+    double mean() const {
+        double sum = 0;
+        for (double x : v)
+            sum += x;
+        return v.empty() ? 0 : sum / v.size();
+    }
+
+    double stddev() const {
+        double m = mean(), sum = 0;
+        for (double x : v)
+            sum += (x - m) * (x - m);
+        return v.empty() ? 0 : sqrt(sum / v.size());
+    }
+};
+
+// Least squares slope of y over x.
+struct Fit {
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double x0 = 0, y0 = 0;  // origin, to keep the sums small
+
+    void add(double x, double y) {
+        if (n == 0) {
+            x0 = x;
+            y0 = y;
+        }
+        x -= x0;
+        y -= y0;
+        n++;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    bool valid() const { return n > 2 && n * sxx - sx * sx > 0; }
+    double slope() const { return (n * sxy - sx * sy) / (n * sxx - sx * sx); }
+};
+
+static long long timestamp_of(const PacketRecord &r) {
+    return r.sec * e9 + r.usec * 1000LL;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s FILE\n  Analyze a file written by stream --record=FILE\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    RecordFileHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic))) {
+        printf("%s is not a stream recording\n", argv[1]);
+        return 1;
+    }
+    std::vector<PacketRecord> recs;
+    PacketRecord r;
+    while (fread(&r, sizeof(r), 1, f) == 1)
+        recs.push_back(r);
+    fclose(f);
+
+    if (recs.size() < 2) {
+        printf("%zu packets recorded, nothing to analyze\n", recs.size());
+        return 0;
+    }
+
+    double period = (double) h.payload_len * e9 / (h.sample_rate * h.frame_size);
+    printf("%zu packets of %u bytes (%.2f ms), %.0f ms playout offset, %.1f s of sending\n",
+           recs.size(), h.payload_len, period / 1e6, h.playout_offset_nsec / 1e6,
+           (recs.back().send_nsec - recs.front().send_nsec) / 1e9);
+
+    unsigned segments = 1, counter_gaps = 0, counter_back = 0, missing_records = 0;
+    unsigned ts_back = 0, byte_jumps = 0, incomplete = 0, late = 0;
+    long long ts_back_max = 0, missing_bytes = 0;
+    Summary lead, send_interval, ts_error;
+    unsigned batched = 0;
+
+    // Fits over the longest run without discontinuities, so restarts don't
+    // show up as drift.
+    Fit audio_fit, lead_fit, best_audio_fit, best_lead_fit;
+    long long position = 0;
+
+    for (size_t i = 0; i < recs.size(); i++) {
+        const PacketRecord &c = recs[i];
+        long long ts = timestamp_of(c);
+        lead.add((ts - c.send_nsec) / 1000.0);
+        if (ts < c.send_nsec)
+            late++;
+        if (c.sent < c.destinations)
+            incomplete++;
+
+        bool continuous = true;
+        if (i > 0) {
+            const PacketRecord &p = recs[i - 1];
+            int counter_step = (int) (c.packet_counter - p.packet_counter);
+            int byte_step = (int) (c.byte_counter - p.byte_counter);
+            long long ts_step = ts - timestamp_of(p);
+            long long send_step = c.send_nsec - p.send_nsec;
+
+            if (send_step > SEGMENT_GAP_NSEC) {
+                segments++;
+                continuous = false;
+            } else {
+                send_interval.add(send_step / 1000.0);
+                if (send_step < period / 10)
+                    batched++;
+            }
+
+            if (counter_step <= 0) {
+                counter_back++;
+                continuous = false;
+            } else if (counter_step > 1) {
+                // Counters are consecutive on the wire, so these are
+                // packets the recorder couldn't keep up with.
+                counter_gaps++;
+                missing_records += counter_step - 1;
+                continuous = false;
+            }
+
+            if (ts_step <= 0) {
+                ts_back++;
+                ts_back_max = std::max(ts_back_max, -ts_step);
+                continuous = false;
+            }
+
+            if (byte_step != counter_step * (int) h.payload_len && counter_step > 0) {
+                // Audio that was never sent: overruns or a restarted
+                // transmission.
+                byte_jumps++;
+                missing_bytes += byte_step - counter_step * (long long) h.payload_len;
+                continuous = false;
+            }
+
+            if (continuous)
+                ts_error.add((ts_step - period * counter_step) / 1000.0);
+            position += byte_step;
+        }
+
+        if (!continuous) {
+            if (audio_fit.n > best_audio_fit.n) {
+                best_audio_fit = audio_fit;
+                best_lead_fit = lead_fit;
+            }
+            audio_fit = Fit();
+            lead_fit = Fit();
+        }
+        audio_fit.add(position, ts);
+        lead_fit.add(c.send_nsec, ts - c.send_nsec);
+    }
+    if (audio_fit.n > best_audio_fit.n) {
+        best_audio_fit = audio_fit;
+        best_lead_fit = lead_fit;
+    }
+
+    printf("\nContinuity\n");
+    printf("  %u transmission%s\n", segments, segments == 1 ? "" : "s");
+    printf("  packet_counter: %u gaps (%u packets the recorder dropped), %u steps backwards\n",
+           counter_gaps, missing_records, counter_back);
+    printf("  timestamps: %u steps backwards or repeated", ts_back);
+    if (ts_back)
+        printf(" (worst %.3f ms)", ts_back_max / 1e6);
+    printf(", spacing off nominal by %.1f us stddev, %.1f..%.1f us\n",
+           ts_error.stddev(), ts_error.percentile(0), ts_error.percentile(1));
+    printf("  byte_counter: %u jumps, %.1f ms of audio never sent\n",
+           byte_jumps, missing_bytes * 1e3 / (h.sample_rate * h.frame_size));
+    printf("  %u packets didn't reach every session\n", incomplete);
+
+    printf("\nTimestamp lead (playout time - send time)\n");
+    printf("  min %.2f ms, p1 %.2f ms, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           lead.percentile(0) / 1e3, lead.percentile(0.01) / 1e3, lead.percentile(0.5) / 1e3,
+           lead.percentile(0.99) / 1e3, lead.percentile(1) / 1e3);
+    printf("  %u packets sent after their playout time\n", late);
+
+    printf("\nSend timing\n");
+    printf("  interval %.1f us mean, %.1f us stddev (jitter), p99 %.0f us, max %.0f us (nominal %.1f us)\n",
+           send_interval.mean(), send_interval.stddev(), send_interval.percentile(0.99),
+           send_interval.percentile(1), period / 1e3);
+    printf("  %u packets sent right after the previous one (batched)\n", batched);
+
+    printf("\nDrift, over the longest continuous run (%.0f packets)\n", best_audio_fit.n);
+    if (best_audio_fit.valid()) {
+        // Timestamps advance by the audio clock. Against the nominal
+        // rate, that's how far the sound card is off CLOCK_MONOTONIC;
+        // positive when it's slow, like stream's own drift estimate.
+        double nominal = (double) e9 / (h.sample_rate * h.frame_size);
+        printf("  audio clock: %+.2f ppm against the monotonic clock\n",
+               (best_audio_fit.slope() / nominal - 1) * 1e6);
+        // Lead should hold still. If it creeps, timestamps and wall time
+        // run apart and latency grows or shrinks over time.
+        printf("  timestamps vs send time: %+.2f ppm (lead changing %+.1f us per minute)\n",
+               best_lead_fit.slope() * 1e6, best_lead_fit.slope() * 60e6);
+    } else
+        printf("  not enough packets\n");
+    return 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pulse/pulseaudio.h>
+
+#include "convert.h"
+#include "resample.h"
+
+/* Where the PCM comes from.
+ *
+ * Every backend hooks itself into the mainloop and hands whatever it
+ * captured to capture_push(), which cuts it into packets for the sender.
+ * The stream is always S16LE stereo at 44.1 kHz by the time it gets there. */
+
+// Feed captured PCM to the packetizer. Must be called from the mainloop.
+// captured_at is the CLOCK_MONOTONIC time in nanoseconds at which the last
+// byte was captured, if the backend knows; 0 means "just now".
+void capture_push(const void *data, size_t length, long long captured_at = 0);
+
+// Tell the packetizer that captured audio was lost before whatever is
+// pushed next: a hole in the record stream, an overflow or an xrun. The
+// timeline stays continuous, `length` bytes (in the sent format) are
+// filled with silence, or skipped over if they're too late to be played
+// anyway. 0 means the backend doesn't know how much is gone, it's then
+// measured against the capture clock on the next push.
+void capture_gap(size_t length);
+
+// The backend's buffer got so full that audio may have been lost without
+// anyone saying so. Measured against the capture clock on the next push
+// like capture_gap(0), but only counted if something is actually missing.
+void capture_suspect_gap();
+
+// Lost audio and buffer trouble reported by the backends, counted by the
+// mainloop.
+struct CaptureStats {
+    unsigned overflows;    // capture_gap() calls, and suspected gaps that were real
+    unsigned underflows;   // the backend's buffer ran dry
+    unsigned gaps;         // gaps actually found and filled in
+    unsigned long long silence_bytes;  // filled with silence
+    unsigned long long skipped_bytes;  // jumped over
+};
+
+extern CaptureStats capture_stats;
+
+// Mainloop time events take wall clock deadlines. Convert one given on
+// pa_rtclock_now()'s clock.
+static inline struct timeval *rtclock_timeval(struct timeval *tv, pa_usec_t deadline) {
+    pa_usec_t now = pa_rtclock_now();
+    pa_gettimeofday(tv);
+    if (deadline > now)
+        pa_timeval_add(tv, deadline - now);
+    return tv;
+}
+
+class CaptureBackend {
+public:
+    virtual ~CaptureBackend() {}
+
+    // Hook into the mainloop and start delivering PCM.
+    virtual void start(pa_mainloop_api *api) = 0;
+
+    // Nudge the capture rate to follow clock drift. Returns the rate
+    // actually in effect afterwards, which may be rounded, or 0 if the
+    // backend can't.
+    virtual double set_rate(double rate) { return 0; }
+
+    // Pause or resume capture without tearing anything down, so a resume
+    // costs no more than the device needs to deliver its first fragment.
+    // Backends start out active; this may be called before start().
+    virtual void set_active(bool active) = 0;
+};
+
+// Parameters of what the PulseAudio source is recorded as. Anything other
+// than S16 stereo at SAMPLE_RATE is converted here rather than by the server.
+struct PulseFormat {
+    SampleFormat format;
+    int channels;
+    bool dither;
+    int rate;
+    ResampleQuality quality;
+};
+
+// Record from the default PulseAudio source, `fragsize` bytes at a time,
+// with a server side buffer of `maxlength` bytes. Both are in the sent
+// format.
+CaptureBackend *pulse_capture_new(int fragsize, int maxlength, bool variable_rate, const PulseFormat &format);
+
+// Capture from an ALSA device through its mmap area. NULL if the device
+// can't be set up, or if built without ALSA support.
+CaptureBackend *alsa_capture_new(const char *device, int fragsize);
+
+// Take PCM from local producers through a shared memory ring handed out on
+// a Unix socket at `path` (shm_ring.h), in blocks of `fragsize` bytes. NULL
+// if it can't be set up.
+CaptureBackend *shm_capture_new(const char *path, int fragsize);
+
+// Generate audio instead of capturing it. `spec` is one of sine, noise,
+// silence, file:PATH (WAV or raw S16LE stereo, looped). In realtime mode
+// audio is produced at the nominal rate, `fragsize` bytes at a time;
+// otherwise as fast as the sender drains it. Returns NULL for a bad spec.
+CaptureBackend *synth_capture_new(const char *spec, int fragsize, bool realtime);
@@ -0,0 +1,265 @@
+#ifdef HAVE_ALSA
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+#include <pulse/pulseaudio.h>
+
+#include "capture.h"
+#include "sender.h"
+
+// Periods in the ALSA ring buffer. Gives the mainloop some room before an
+// overrun.
+#define ALSA_PERIODS 8
+
+#define MAX_POLL_FDS 4
+
+/* Captures straight from an ALSA device through its mmap area, without a
+ * PulseAudio server in between. Works with the snd-aloop loopback and
+ * snd-dummy modules when there's no sound card. */
+class AlsaCapture : public CaptureBackend {
+public:
+    AlsaCapture(int fragsize) : pcm(NULL), fragsize(fragsize), nfds(0), xruns(0), api(NULL), active(true) {}
+    ~AlsaCapture() {
+        if (api)
+            for (int i = 0; i < nfds; i++)
+                api->io_free(events[i]);
+        if (pcm)
+            snd_pcm_close(pcm);
+    }
+
+    bool open(const char *device);
+    void start(pa_mainloop_api *api);
+    void set_active(bool active);
+
+private:
+    static void io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata);
+    void read_available();
+    bool recover(int err);
+
+    snd_pcm_t *pcm;
+    int fragsize;
+
+    struct pollfd fds[MAX_POLL_FDS];
+    pa_io_event *events[MAX_POLL_FDS];
+    int nfds;
+
+    unsigned xruns;
+
+    pa_mainloop_api *api;
+    bool active;
+};
+
+static long long timespec_nsec(const snd_htimestamp_t &tm) {
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+bool AlsaCapture::open(const char *device) {
+    int err;
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+
+    if ((err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) < 0) {
+        printf("snd_pcm_open(%s) failed: %s\n", device, snd_strerror(err));
+        pcm = NULL;
+        return false;
+    }
+
+    snd_pcm_uframes_t period = fragsize / FRAME_SIZE;
+    snd_pcm_uframes_t buffer = period * ALSA_PERIODS;
+    unsigned rate = SAMPLE_RATE;
+
+    snd_pcm_hw_params_alloca(&hw);
+    snd_pcm_hw_params_any(pcm, hw);
+    if ((err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16_LE)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hw, 2)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size_near(pcm, hw, &buffer)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+        printf("Can't set up %s for mmap S16LE stereo at %u Hz: %s\n", device, rate, snd_strerror(err));
+        return false;
+    }
+
+    // Have status timestamps on the same clock the speakers sync to.
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(pcm, sw);
+    if ((err = snd_pcm_sw_params_set_avail_min(pcm, sw, period)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_type(pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0 ||
+        (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+        printf("Can't set up timestamps on %s: %s\n", device, snd_strerror(err));
+        return false;
+    }
+
+    nfds = snd_pcm_poll_descriptors(pcm, fds, MAX_POLL_FDS);
+    if (nfds <= 0) {
+        printf("snd_pcm_poll_descriptors() failed\n");
+        return false;
+    }
+
+    printf("ALSA capture from %s, period %lu frames, buffer %lu frames\n", device, period, buffer);
+    return true;
+}
+
+bool AlsaCapture::recover(int err) {
+    xruns++;
+    printf("ALSA capture overrun (%u so far): %s\n", xruns, snd_strerror(err));
+    if ((err = snd_pcm_recover(pcm, err, 1)) < 0 || (err = snd_pcm_start(pcm)) < 0) {
+        printf("Can't recover ALSA capture: %s\n", snd_strerror(err));
+        return false;
+    }
+    // Whatever the device captured while it was stopped is gone.
+    capture_gap(0);
+    return true;
+}
+
+/* Packetize whatever the device has captured, straight out of its mmap
+ * area. */
+void AlsaCapture::read_available() {
+    snd_pcm_status_t *status;
+    snd_pcm_status_alloca(&status);
+
+    int err = snd_pcm_status(pcm, status);
+    if (err < 0) {
+        printf("snd_pcm_status() failed: %s\n", snd_strerror(err));
+        exit(1);
+    }
+    if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN) {
+        if (!recover(-EPIPE))
+            exit(1);
+        return;
+    }
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+    if (avail < 0) {
+        if (!recover(avail))
+            exit(1);
+        return;
+    }
+
+    // The status timestamp tells when `status_avail` frames were ready,
+    // which dates every frame we're about to read.
+    snd_htimestamp_t htstamp;
+    snd_pcm_status_get_htstamp(status, &htstamp);
+    long long status_time = timespec_nsec(htstamp);
+    snd_pcm_sframes_t status_avail = snd_pcm_status_get_avail(status);
+    snd_pcm_sframes_t done = 0;
+
+    while (done < avail) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset, frames = avail - done;
+
+        if ((err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames)) < 0) {
+            if (!recover(err))
+                exit(1);
+            return;
+        }
+
+        const char *data = (const char*) areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+        done += frames;
+        capture_push(data, frames * FRAME_SIZE,
+                     status_time - (status_avail - done) * 1000000000LL / SAMPLE_RATE);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t) committed != frames) {
+            if (!recover(committed < 0 ? committed : -EPIPE))
+                exit(1);
+            return;
+        }
+    }
+}
+
+void AlsaCapture::io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    AlsaCapture *self = (AlsaCapture*) userdata;
+
+    for (int i = 0; i < self->nfds; i++) {
+        self->fds[i].revents = 0;
+        if (self->fds[i].fd == fd)
+            self->fds[i].revents = (events & PA_IO_EVENT_INPUT ? POLLIN : 0) |
+                                   (events & PA_IO_EVENT_ERROR ? POLLERR : 0) |
+                                   (events & PA_IO_EVENT_HANGUP ? POLLHUP : 0);
+    }
+
+    unsigned short revents;
+    snd_pcm_poll_descriptors_revents(self->pcm, self->fds, self->nfds, &revents);
+    if (revents & (POLLERR | POLLHUP)) {
+        if (!self->recover(-EPIPE))
+            exit(1);
+        return;
+    }
+    if (revents & POLLIN)
+        self->read_available();
+}
+
+void AlsaCapture::start(pa_mainloop_api *a) {
+    api = a;
+    for (int i = 0; i < nfds; i++) {
+        int flags = 0;
+        if (fds[i].events & POLLIN)
+            flags |= PA_IO_EVENT_INPUT;
+        if (fds[i].events & POLLOUT)
+            flags |= PA_IO_EVENT_OUTPUT;
+        events[i] = api->io_new(api, fds[i].fd, (pa_io_event_flags_t) flags, io_cb, this);
+    }
+
+    if (active) {
+        int err = snd_pcm_start(pcm);
+        if (err < 0) {
+            printf("snd_pcm_start() failed: %s\n", snd_strerror(err));
+            exit(1);
+        }
+    } else
+        set_active(false);
+}
+
+/* Stopping drops the captured frames and leaves the device prepared, so
+ * resuming is just a snd_pcm_start(). */
+void AlsaCapture::set_active(bool a) {
+    active = a;
+    if (!api)
+        return;
+
+    for (int i = 0; i < nfds; i++) {
+        int flags = 0;
+        if (active && (fds[i].events & POLLIN))
+            flags |= PA_IO_EVENT_INPUT;
+        if (active && (fds[i].events & POLLOUT))
+            flags |= PA_IO_EVENT_OUTPUT;
+        api->io_enable(events[i], (pa_io_event_flags_t) flags);
+    }
+
+    int err;
+    if (active)
+        err = snd_pcm_start(pcm);
+    else if ((err = snd_pcm_drop(pcm)) >= 0)
+        err = snd_pcm_prepare(pcm);
+    if (err < 0) {
+        printf("Can't %s ALSA capture: %s\n", active ? "resume" : "pause", snd_strerror(err));
+        exit(1);
+    }
+}
+
+CaptureBackend *alsa_capture_new(const char *device, int fragsize) {
+    AlsaCapture *alsa = new AlsaCapture(fragsize);
+    if (!alsa->open(device)) {
+        delete alsa;
+        return NULL;
+    }
+    return alsa;
+}
+
+#else
+
+#include <stdio.h>
+
+#include "capture.h"
+
+CaptureBackend *alsa_capture_new(const char *device, int fragsize) {
+    printf("This stream binary was built without ALSA support (make ALSA=1)\n");
+    return NULL;
+}
+
+#endif
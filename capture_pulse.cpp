@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pulse/pulseaudio.h>
+
+#include "capture.h"
+#include "sender.h"
+
+#define CLEAR_LINE "\n"
+
+// From pulsecore/macro.h
+#define pa_memzero(x,l) (memset((x), 0, (l)))
+#define pa_zero(x) (pa_memzero(&(x), sizeof(x)))
+
+extern int verbose;
+extern long long getnsec();
+
+static pa_sample_format_t pa_formats[] = {
+    PA_SAMPLE_S16LE,      // SAMPLE_S16
+    PA_SAMPLE_S24LE,      // SAMPLE_S24
+    PA_SAMPLE_S24_32LE,   // SAMPLE_S24_32
+    PA_SAMPLE_S32LE,      // SAMPLE_S32
+    PA_SAMPLE_FLOAT32LE,  // SAMPLE_FLOAT
+};
+
+class PulseCapture : public CaptureBackend {
+public:
+    PulseCapture(int fragsize, int maxlength, bool variable_rate, const PulseFormat &f)
+        : context(NULL), stream(NULL), fragsize(fragsize), maxlength(maxlength), variable_rate(variable_rate), active(true),
+          converter(f.format, f.channels, f.dither), resampler(NULL) {
+        sample_spec.format = pa_formats[f.format];
+        sample_spec.rate = f.rate;
+        sample_spec.channels = f.channels;
+        if (f.rate != SAMPLE_RATE)
+            resampler = new Resampler(f.rate, SAMPLE_RATE, f.quality);
+        size_buffers(source_bytes(fragsize));
+    }
+
+    void start(pa_mainloop_api *api);
+    double set_rate(double rate);
+    void set_active(bool active);
+
+private:
+    static void state_cb(pa_context *c, void *userdata);
+    static void stream_state_callback(pa_stream *s, void *userdata);
+    static void stream_read_callback(pa_stream *s, size_t length, void *userdata);
+    static void stream_overflow_callback(pa_stream *s, void *userdata);
+    static void stream_underflow_callback(pa_stream *s, void *userdata);
+    void apply_cork();
+    void size_buffers(size_t fragment);
+    uint32_t source_bytes(int sent_bytes) const {
+        return (uint64_t) sent_bytes / FRAME_SIZE * sample_spec.rate / SAMPLE_RATE * pa_frame_size(&sample_spec);
+    }
+    size_t sent_bytes(size_t source_bytes) const {
+        return (uint64_t) source_bytes / pa_frame_size(&sample_spec) * SAMPLE_RATE / sample_spec.rate * FRAME_SIZE;
+    }
+
+    pa_context *context;
+    pa_stream *stream;
+    int fragsize, maxlength;
+    bool variable_rate;
+    bool active;
+
+    pa_sample_spec sample_spec;
+    FormatConverter converter;
+    Resampler *resampler;
+    size_t chunk;  // source bytes converted at a time, what the buffers are sized for
+};
+
+// Size the conversion buffers for fragments of `fragment` source bytes, so
+// the read callback never allocates. Bigger peeks are taken in pieces.
+void PulseCapture::size_buffers(size_t fragment) {
+    size_t frames = fragment / pa_frame_size(&sample_spec);
+    if (frames < 1)
+        frames = 1;
+    converter.reserve(frames);
+    if (resampler)
+        resampler->reserve(frames);
+    chunk = frames * pa_frame_size(&sample_spec);
+}
+
+void PulseCapture::stream_state_callback(pa_stream *s, void *userdata) {
+    PulseCapture *self = (PulseCapture*) userdata;
+    assert(s);
+    switch (pa_stream_get_state(s)) {
+        case PA_STREAM_CREATING:
+            // The stream has been created, so
+            // let's open a file to record to
+            printf("Creating stream\n");
+            //TODO FIXOR
+            //fdout = creat(fname,  0711);
+            break;
+        case PA_STREAM_TERMINATED:
+            //TODO FIXOR
+            //close(fdout);
+            break;
+        case PA_STREAM_READY:
+            // Just for info: no functionality in this branch
+            if (verbose) {
+                const pa_buffer_attr *a;
+
+                printf("Stream successfully created.\n");
+
+                if (!(a = pa_stream_get_buffer_attr(s)))
+                    printf("pa_stream_get_buffer_attr() failed: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+                else {
+                    printf("Buffer metrics: maxlength=%u, fragsize=%u\n", a->maxlength, a->fragsize);
+
+                }
+
+                printf("Connected to device %s (%u, %ssuspended).\n",
+                       pa_stream_get_device_name(s),
+                       pa_stream_get_device_index(s),
+                       pa_stream_is_suspended(s) ? "" : "not ");
+            }
+            // The server may have settled on a different fragment size.
+            if (const pa_buffer_attr *a = pa_stream_get_buffer_attr(s))
+                self->size_buffers(a->fragsize);
+            // Catch up with set_active() calls made while connecting.
+            self->apply_cork();
+            break;
+        case PA_STREAM_FAILED:
+        default:
+            printf("Stream error: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+            exit(1);
+    }
+}
+
+/* This is called whenever new data is available */
+void PulseCapture::stream_read_callback(pa_stream *s, size_t length, void *userdata) {
+    PulseCapture *self = (PulseCapture*) userdata;
+    assert(s);
+    assert(length > 0);
+
+    // The server doesn't tell record streams when it had to drop data, but
+    // a full buffer means it may have. Whether it did shows on the capture
+    // clock.
+    const pa_buffer_attr *a = pa_stream_get_buffer_attr(s);
+    if (a && pa_stream_readable_size(s) + a->fragsize >= a->maxlength)
+        capture_suspect_gap();
+
+    while (pa_stream_readable_size(s) > 0) {
+        const void *data;
+        size_t length;
+
+        // peek actually creates and fills the data vbl
+        if (pa_stream_peek(s, &data, &length) < 0) {
+            fprintf(stderr, "Read failed\n");
+            exit(1);
+            return;
+        }
+
+        // A hole: this much audio is missing from the stream.
+        if (!data) {
+            if (length) {
+                capture_gap(self->sent_bytes(length));
+                pa_stream_drop(s);
+            }
+            continue;
+        }
+
+        if (self->converter.passthrough() && !self->resampler) {
+            capture_push(data, length);
+        } else {
+            // Pieces of a peek bigger than a fragment end before the rest
+            // of it was captured.
+            long long now = getnsec();
+            for (size_t off = 0; off < length; off += self->chunk) {
+                const void *piece = (const char*) data + off;
+                size_t bytes = length - off < self->chunk ? length - off : self->chunk;
+                size_t after = self->sent_bytes(length - off - bytes);
+                long long captured_at = now - (long long) after * 1000000000LL / (SAMPLE_RATE * FRAME_SIZE);
+                if (!self->converter.passthrough())
+                    piece = self->converter.convert(piece, bytes, &bytes);
+                if (self->resampler) {
+                    size_t frames;
+                    piece = self->resampler->process((const int16_t*) piece, bytes / FRAME_SIZE, &frames);
+                    bytes = frames * FRAME_SIZE;
+                }
+                capture_push(piece, bytes, captured_at);
+            }
+        }
+
+        // swallow the data peeked at before
+        pa_stream_drop(s);
+    }
+}
+
+void PulseCapture::stream_overflow_callback(pa_stream *s, void *userdata) {
+    capture_gap(0);
+}
+
+void PulseCapture::stream_underflow_callback(pa_stream *s, void *userdata) {
+    capture_stats.underflows++;
+}
+
+// This callback gets called when our context changes state.  We really only
+// care about when it's ready or if it has failed
+void PulseCapture::state_cb(pa_context *c, void *userdata) {
+    PulseCapture *self = (PulseCapture*) userdata;
+    pa_context_state_t state;
+
+    printf("State changed\n");
+    state = pa_context_get_state(c);
+    switch  (state) {
+        // There are just here for reference
+        case PA_CONTEXT_UNCONNECTED:
+        case PA_CONTEXT_CONNECTING:
+        case PA_CONTEXT_AUTHORIZING:
+        case PA_CONTEXT_SETTING_NAME:
+        default:
+            break;
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            printf("Connection to PulseAudio failed: %s\n", pa_strerror(pa_context_errno(c)));
+            exit(1);
+        case PA_CONTEXT_READY: {
+            pa_buffer_attr buffer_attr;
+
+            if (verbose)
+                printf("Connection established.%s\n", CLEAR_LINE);
+
+            if (!(self->stream = pa_stream_new(c, "SonosCast", &self->sample_spec, NULL))) {
+                printf("pa_stream_new() failed: %s", pa_strerror(pa_context_errno(c)));
+                exit(1);
+            }
+
+            // Watch for changes in the stream state to create the output file
+            pa_stream_set_state_callback(self->stream, stream_state_callback, self);
+
+            // Watch for changes in the stream's read state to write to the output file
+            pa_stream_set_read_callback(self->stream, stream_read_callback, self);
+            pa_stream_set_overflow_callback(self->stream, stream_overflow_callback, self);
+            pa_stream_set_underflow_callback(self->stream, stream_underflow_callback, self);
+
+            // timing info
+            //pa_stream_update_timing_info(stream, stream_update_timing_callback, NULL);
+
+            // Set properties of the record buffer
+            // Sizes are in sent bytes, scale them to what the source
+            // delivers for the same duration.
+            pa_zero(buffer_attr);
+            buffer_attr.maxlength = self->source_bytes(self->maxlength);
+            buffer_attr.fragsize = self->source_bytes(self->fragsize);
+
+            int flags = 0;
+            flags |= PA_STREAM_AUTO_TIMING_UPDATE;
+            flags |= PA_STREAM_ADJUST_LATENCY;
+            flags |= PA_STREAM_INTERPOLATE_TIMING;
+            if (self->variable_rate && !self->resampler)
+                flags |= PA_STREAM_VARIABLE_RATE;
+            if (!self->active)
+                flags |= PA_STREAM_START_CORKED;
+
+            const char* device = NULL;
+
+            // and start recording
+            if (pa_stream_connect_record(self->stream, device, &buffer_attr, (pa_stream_flags_t)flags) < 0) {
+                printf("pa_stream_connect_record() failed: %s", pa_strerror(pa_context_errno(c)));
+                exit(1);
+            }
+            break;
+        }
+    }
+}
+
+void PulseCapture::start(pa_mainloop_api *api) {
+    context = pa_context_new(api, "SonosCast");
+
+    // This function connects to the pulse server
+    pa_context_connect(context, NULL, (pa_context_flags_t)0, NULL);
+
+    // This function defines a callback so the server will tell us its state.
+    pa_context_set_state_callback(context, state_cb, this);
+}
+
+double PulseCapture::set_rate(double rate) {
+    // Our own resampler takes any ratio within its trim range.
+    if (resampler) {
+        resampler->set_output_rate(rate);
+        return resampler->output_rate();
+    }
+
+    // Pulse only takes whole Hz, about 23 ppm at 44.1 kHz.
+    if (!variable_rate || !stream || pa_stream_get_state(stream) != PA_STREAM_READY)
+        return 0;
+
+    uint32_t hz = lrint(rate);
+    if (hz == sample_spec.rate)
+        return hz;
+    pa_operation *o = pa_stream_update_sample_rate(stream, hz, NULL, NULL);
+    if (!o)
+        return 0;
+    pa_operation_unref(o);
+    sample_spec.rate = hz;
+    return hz;
+}
+
+void PulseCapture::apply_cork() {
+    if (!stream || pa_stream_get_state(stream) != PA_STREAM_READY)
+        return;
+    if (pa_stream_is_corked(stream) == !active)
+        return;
+
+    pa_operation *o;
+    // Whatever was left in the record buffer when we corked is stale by
+    // now.
+    if (active && (o = pa_stream_flush(stream, NULL, NULL)))
+        pa_operation_unref(o);
+    if ((o = pa_stream_cork(stream, !active, NULL, NULL)))
+        pa_operation_unref(o);
+}
+
+void PulseCapture::set_active(bool a) {
+    active = a;
+    apply_cork();
+}
+
+CaptureBackend *pulse_capture_new(int fragsize, int maxlength, bool variable_rate, const PulseFormat &f) {
+    if (f.format != SAMPLE_S16 || f.channels != 2)
+        printf("Converting %d channel %s capture in-process with %s kernels\n",
+               f.channels, pa_sample_format_to_string(pa_formats[f.format]), convert_kernel_name());
+    if (f.rate != SAMPLE_RATE)
+        printf("Resampling %d Hz capture in-process with %s kernels\n", f.rate, resample_kernel_name());
+    return new PulseCapture(fragsize, maxlength, variable_rate, f);
+}
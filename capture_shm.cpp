@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <pulse/pulseaudio.h>
+
+#include "capture.h"
+#include "sender.h"
+#include "shm_ring.h"
+
+// Blocks in the ring, a fragment each.
+#define SHM_BLOCKS 32
+
+static_assert(sizeof(shm_ring_header) == 192, "shm_ring_header layout");
+static_assert(sizeof(shm_block) == 16, "shm_block layout");
+
+/* Reads PCM that local producers write straight into a shared memory ring,
+ * see shm_ring.h. The mainloop sleeps on the ring's eventfd and packetizes
+ * the blocks in place, without copying them out first.
+ *
+ * The producer can write all of the ring, header included, so the layout
+ * is only ever taken from the copy made here. */
+class ShmCapture : public CaptureBackend {
+public:
+    ShmCapture(int fragsize)
+        : fragsize(fragsize), memfd(-1), wakefd(-1), listenfd(-1), producerfd(-1), producer_event(NULL),
+          ring(NULL), size(0), block_frames(0), block_count(0), block_size(0), read_index(0), api(NULL),
+          active(true) {}
+
+    bool create(const char *path);
+    void start(pa_mainloop_api *api);
+    void set_active(bool a) { active = a; }
+
+private:
+    static void accept_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata);
+    static void producer_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata);
+    static void wake_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata);
+    shm_block *block(uint32_t index);
+    void drain();
+
+    int fragsize;
+    int memfd, wakefd, listenfd;
+    // The attached producer's connection, held open until it goes away.
+    int producerfd;
+    pa_io_event *producer_event;
+    shm_ring_header *ring;
+    size_t size;
+    uint32_t block_frames, block_count, block_size;
+    uint32_t read_index;
+    pa_mainloop_api *api;
+    bool active;
+};
+
+bool ShmCapture::create(const char *path) {
+    block_frames = fragsize / FRAME_SIZE;
+    block_count = SHM_BLOCKS;
+    block_size = (sizeof(shm_block) + block_frames * FRAME_SIZE + 63) & ~63u;
+    size = sizeof(shm_ring_header) + (size_t) block_count * block_size;
+
+    memfd = memfd_create("sonoscast-pcm", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, size) < 0) {
+        perror("memfd");
+        return false;
+    }
+    ring = (shm_ring_header*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    ring->sample_rate = SAMPLE_RATE;
+    ring->channels = 2;
+    ring->format = SHM_FORMAT_S16LE;
+    ring->block_frames = block_frames;
+    ring->block_count = block_count;
+    ring->block_size = block_size;
+    ring->data_offset = sizeof(shm_ring_header);
+    ring->version = SHM_RING_VERSION;
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0) {
+        perror("eventfd");
+        return false;
+    }
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+        perror("socket shm");
+        return false;
+    }
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        printf("Shared memory socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if (bind(listenfd, (struct sockaddr*) &sun, sizeof(sun)) < 0 || listen(listenfd, 4) < 0) {
+        perror("bind shm");
+        return false;
+    }
+
+    printf("Shared memory ring of %d blocks of %u frames, producers connect to %s\n", SHM_BLOCKS, block_frames, path);
+    return true;
+}
+
+// Hand the ring and the eventfd to whoever connects, unless a producer is
+// attached already.
+void ShmCapture::accept_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    ShmCapture *self = (ShmCapture*) userdata;
+    int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd < 0) {
+        perror("accept shm");
+        return;
+    }
+    if (self->producerfd >= 0) {
+        printf("Refusing a second shared memory producer\n");
+        close(cfd);
+        return;
+    }
+
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = {self->memfd, self->wakefd};
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    if (sendmsg(cfd, &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg shm");
+        close(cfd);
+        return;
+    }
+    printf("Shared memory producer connected\n");
+    self->producerfd = cfd;
+    self->producer_event = a->io_new(a, cfd, PA_IO_EVENT_INPUT, producer_cb, self);
+}
+
+// The producer has nothing to say, so this is it going away.
+void ShmCapture::producer_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    ShmCapture *self = (ShmCapture*) userdata;
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0 || (n < 0 && errno == EAGAIN))
+        return;
+    a->io_free(e);
+    close(fd);
+    self->producerfd = -1;
+    self->producer_event = NULL;
+    printf("Shared memory producer disconnected\n");
+}
+
+void ShmCapture::wake_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    ShmCapture *self = (ShmCapture*) userdata;
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("read eventfd");
+    self->drain();
+}
+
+/* Packetize every published block. While no session is running they're
+ * consumed all the same, so producers never stall on an idle stream. */
+shm_block *ShmCapture::block(uint32_t index) {
+    return (shm_block*) ((char*) ring + sizeof(shm_ring_header) + (size_t) (index & (block_count - 1)) * block_size);
+}
+
+void ShmCapture::drain() {
+    uint32_t &r = read_index;
+    bool consumed = false;
+
+    for (;;) {
+        // Read after storing read_index, see shm_ring.h.
+        uint32_t w = __atomic_load_n(&ring->write_index, __ATOMIC_SEQ_CST);
+        if (w == r)
+            break;
+        if (w - r > block_count) {
+            printf("Shared memory producer is %u blocks ahead of a %u block ring, skipping them\n", w - r, block_count);
+            capture_gap(0);
+            r = w;
+            __atomic_store_n(&ring->read_index, r, __ATOMIC_SEQ_CST);
+            consumed = true;
+            break;
+        }
+
+        shm_block *b = block(r);
+        uint32_t frames = __atomic_load_n(&b->frames, __ATOMIC_RELAXED);
+        if (frames > block_frames)
+            frames = block_frames;
+        if (active && frames)
+            capture_push(shm_block_pcm(b), frames * FRAME_SIZE, b->captured_at);
+        __atomic_store_n(&ring->read_index, ++r, __ATOMIC_SEQ_CST);
+        consumed = true;
+    }
+
+    if (consumed && __atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->read_index, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void ShmCapture::start(pa_mainloop_api *a) {
+    api = a;
+    api->io_new(api, listenfd, PA_IO_EVENT_INPUT, accept_cb, this);
+    api->io_new(api, wakefd, PA_IO_EVENT_INPUT, wake_cb, this);
+    drain();
+}
+
+CaptureBackend *shm_capture_new(const char *path, int fragsize) {
+    ShmCapture *shm = new ShmCapture(fragsize);
+    if (!shm->create(path)) {
+        delete shm;
+        return NULL;
+    }
+    return shm;
+}
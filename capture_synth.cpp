@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <pulse/pulseaudio.h>
+
+#include "capture.h"
+#include "sender.h"
+
+#define SINE_FREQ 440.0
+#define SINE_AMPLITUDE 16384.0
+#define NOISE_AMPLITUDE 8192
+
+// Chunks generated per mainloop iteration when running flat out.
+#define FAST_CHUNKS 16
+
+// How far behind the realtime generator may fall before audio is lost, as
+// with a sound card's buffer.
+#define BUFFER_USEC 100000
+
+class SynthCapture : public CaptureBackend {
+public:
+    enum Kind { SINE, NOISE, SILENCE, FILE_DATA };
+
+    SynthCapture(Kind kind, int fragsize, bool realtime)
+        : kind(kind), fragsize(fragsize), realtime(realtime),
+          phase(0), noise_state(0x12345678), file_buf(NULL), file_data(NULL), file_len(0), file_pos(0),
+          start_usec(0), generated(0), api(NULL), tick_event(NULL), fast_event(NULL), active(true) {
+        chunk = (int16_t*) malloc(fragsize);
+    }
+    ~SynthCapture() {
+        free(chunk);
+        free(file_buf);
+    }
+
+    bool load_file(const char *path);
+    void start(pa_mainloop_api *api);
+    void set_active(bool active);
+
+private:
+    void generate(int16_t *out, int bytes);
+    void produce_chunk(long long captured_at = 0);
+    void schedule_next(pa_time_event *e);
+
+    static void tick_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata);
+    static void fast_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata);
+
+    Kind kind;
+    int fragsize;
+    bool realtime;
+
+    double phase;
+    uint32_t noise_state;
+    char *file_buf;   // the whole file, file_data points into it
+    char *file_data;
+    size_t file_len, file_pos;
+
+    int16_t *chunk;
+    pa_usec_t start_usec;
+    long long generated;
+    pa_mainloop_api *api;
+    pa_time_event *tick_event;
+    pa_defer_event *fast_event;
+    bool active;
+};
+
+static uint32_t read_le32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint16_t read_le16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+/* Load the whole file up front. A WAV file must already be in the wire
+ * format, anything else is taken as raw S16LE stereo. */
+bool SynthCapture::load_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *data = (char*) malloc(len > 0 ? len : 1);
+    if (fread(data, 1, len, f) != (size_t) len) {
+        perror(path);
+        fclose(f);
+        free(data);
+        return false;
+    }
+    fclose(f);
+
+    // Where the audio is in it, set only once it's known to be usable.
+    char *audio = data;
+    size_t audio_len = len;
+
+    const unsigned char *p = (const unsigned char*) data;
+    if (len >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p+8, "WAVE", 4)) {
+        size_t off = 12;
+        bool have_fmt = false;
+        audio_len = 0;
+        while (off + 8 <= (size_t) len) {
+            uint32_t size = read_le32(p+off+4);
+            // A fmt chunk cut short by the end of the file doesn't count.
+            if (!memcmp(p+off, "fmt ", 4) && size >= 16 && size <= len - off - 8) {
+                if (read_le16(p+off+8) != 1 || read_le16(p+off+10) != 2 ||
+                    read_le32(p+off+12) != SAMPLE_RATE || read_le16(p+off+22) != 16) {
+                    printf("%s: only 16-bit PCM stereo at %d Hz is supported\n", path, SAMPLE_RATE);
+                    free(data);
+                    return false;
+                }
+                have_fmt = true;
+            } else if (!memcmp(p+off, "data", 4)) {
+                audio = data + off + 8;
+                audio_len = size < len - off - 8 ? size : len - off - 8;
+                break;
+            }
+            off += 8 + size + (size & 1);
+        }
+        if (!have_fmt || audio_len == 0) {
+            printf("%s: no usable audio in WAV file\n", path);
+            free(data);
+            return false;
+        }
+    }
+
+    audio_len -= audio_len % FRAME_SIZE;
+    if (audio_len == 0) {
+        printf("%s: file is empty\n", path);
+        free(data);
+        return false;
+    }
+    file_buf = data;
+    file_data = audio;
+    file_len = audio_len;
+    return true;
+}
+
+void SynthCapture::generate(int16_t *out, int bytes) {
+    int frames = bytes / FRAME_SIZE;
+
+    switch (kind) {
+        case SINE: {
+            double step = 2 * M_PI * SINE_FREQ / SAMPLE_RATE;
+            for (int i = 0; i < frames; i++) {
+                int16_t v = lrint(SINE_AMPLITUDE * sin(phase));
+                out[2*i] = out[2*i+1] = v;
+                phase += step;
+                if (phase > 2 * M_PI)
+                    phase -= 2 * M_PI;
+            }
+            break;
+        }
+        case NOISE:
+            for (int i = 0; i < frames * 2; i++) {
+                // xorshift32
+                noise_state ^= noise_state << 13;
+                noise_state ^= noise_state >> 17;
+                noise_state ^= noise_state << 5;
+                out[i] = (int16_t) (noise_state % (2 * NOISE_AMPLITUDE)) - NOISE_AMPLITUDE;
+            }
+            break;
+        case SILENCE:
+            memset(out, 0, bytes);
+            break;
+        case FILE_DATA: {
+            char *dst = (char*) out;
+            while (bytes > 0) {
+                size_t n = file_len - file_pos;
+                if (n > (size_t) bytes)
+                    n = bytes;
+                memcpy(dst, file_data + file_pos, n);
+                dst += n;
+                bytes -= n;
+                file_pos = (file_pos + n) % file_len;
+            }
+            break;
+        }
+    }
+}
+
+void SynthCapture::produce_chunk(long long captured_at) {
+    generate(chunk, fragsize);
+    capture_push(chunk, fragsize, captured_at);
+    generated += fragsize;
+}
+
+// Next chunk is due once the nominal rate says it's been captured.
+void SynthCapture::schedule_next(pa_time_event *e) {
+    struct timeval tv;
+    pa_usec_t due = start_usec + (generated + fragsize) * PA_USEC_PER_SEC / (SAMPLE_RATE * FRAME_SIZE);
+    rtclock_timeval(&tv, due);
+    api->time_restart(e, &tv);
+}
+
+void SynthCapture::tick_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    SynthCapture *self = (SynthCapture*) userdata;
+    pa_usec_t now = pa_rtclock_now();
+
+    // Catch up on whatever we slept through, like a sound card would,
+    // losing what no longer fits in its buffer.
+    long long behind = (long long) (now - self->start_usec) * (SAMPLE_RATE * FRAME_SIZE) / PA_USEC_PER_SEC
+        - self->generated - (long long) BUFFER_USEC * (SAMPLE_RATE * FRAME_SIZE) / PA_USEC_PER_SEC;
+    if (behind > 0) {
+        self->generated += (behind + self->fragsize - 1) / self->fragsize * self->fragsize;
+        capture_gap(0);
+    }
+
+    pa_usec_t due;
+    while ((due = self->start_usec + (self->generated + self->fragsize) * PA_USEC_PER_SEC / (SAMPLE_RATE * FRAME_SIZE)) <= now)
+        self->produce_chunk(due * 1000);
+
+    self->schedule_next(e);
+}
+
+void SynthCapture::fast_cb(pa_mainloop_api *a, pa_defer_event *e, void *userdata) {
+    SynthCapture *self = (SynthCapture*) userdata;
+
+    // Only produce what the ring can take, so nothing is dropped.
+    int produced = 0;
+    while (produced < FAST_CHUNKS && block_ring.room() > 2) {
+        self->produce_chunk();
+        produced++;
+    }
+    if (produced == 0)
+        sched_yield();
+}
+
+void SynthCapture::start(pa_mainloop_api *a) {
+    api = a;
+    start_usec = pa_rtclock_now();
+
+    if (realtime) {
+        struct timeval tv;
+        rtclock_timeval(&tv, start_usec);
+        tick_event = api->time_new(api, &tv, tick_cb, this);
+        schedule_next(tick_event);
+    } else {
+        fast_event = api->defer_new(api, fast_cb, this);
+    }
+    set_active(active);
+}
+
+void SynthCapture::set_active(bool a) {
+    active = a;
+    if (!api)
+        return;
+
+    if (fast_event)
+        api->defer_enable(fast_event, active);
+    if (tick_event) {
+        if (active) {
+            // Pick the nominal clock up from now, not from where it stopped.
+            start_usec = pa_rtclock_now();
+            generated = 0;
+            schedule_next(tick_event);
+        } else
+            api->time_restart(tick_event, NULL);
+    }
+}
+
+CaptureBackend *synth_capture_new(const char *spec, int fragsize, bool realtime) {
+    SynthCapture *synth;
+
+    if (!strcmp(spec, "sine"))
+        synth = new SynthCapture(SynthCapture::SINE, fragsize, realtime);
+    else if (!strcmp(spec, "noise"))
+        synth = new SynthCapture(SynthCapture::NOISE, fragsize, realtime);
+    else if (!strcmp(spec, "silence"))
+        synth = new SynthCapture(SynthCapture::SILENCE, fragsize, realtime);
+    else if (!strncmp(spec, "file:", 5)) {
+        synth = new SynthCapture(SynthCapture::FILE_DATA, fragsize, realtime);
+        if (!synth->load_file(spec + 5)) {
+            delete synth;
+            return NULL;
+        }
+    } else
+        return NULL;
+
+    return synth;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pulse/pulseaudio.h>
+
+#include "control.h"
+
+#define MAX_LINE 512
+#define MAX_REPLY 8192  // fits the metrics reply
+#define MAX_QUEUED (2 * MAX_REPLY)
+
+/* Clients are non-blocking, so one that's slow to read its replies can't
+ * hold up capture. What the socket doesn't take right away waits in `out`,
+ * and a client that lets that fill up is dropped. */
+struct ControlClient {
+    int fd;
+    pa_io_event *event;
+    char buf[MAX_LINE];
+    int fill;
+    char out[MAX_QUEUED];
+    int out_len;
+};
+
+static pa_mainloop_api *api;
+static control_handler_t handler;
+
+static void client_close(ControlClient *c) {
+    api->io_free(c->event);
+    close(c->fd);
+    delete c;
+}
+
+// Write out what's queued, as far as the socket takes it, and wait for it
+// to take more if needed. Returns false if the client is gone.
+static bool flush(ControlClient *c) {
+    int done = 0;
+    while (done < c->out_len) {
+        ssize_t r = write(c->fd, c->out + done, c->out_len - done);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return false;
+        }
+        done += r;
+    }
+    c->out_len -= done;
+    memmove(c->out, c->out + done, c->out_len);
+    api->io_enable(c->event, (pa_io_event_flags_t) (PA_IO_EVENT_INPUT | (c->out_len ? PA_IO_EVENT_OUTPUT : 0)));
+    return true;
+}
+
+static void client_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    ControlClient *c = (ControlClient*) userdata;
+
+    if (events & PA_IO_EVENT_OUTPUT) {
+        if (!flush(c)) {
+            client_close(c);
+            return;
+        }
+    }
+    if (!(events & (PA_IO_EVENT_INPUT | PA_IO_EVENT_HANGUP | PA_IO_EVENT_ERROR)))
+        return;
+
+    ssize_t r = read(fd, c->buf + c->fill, sizeof(c->buf) - c->fill);
+    if (r <= 0) {
+        if (r < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        client_close(c);
+        return;
+    }
+    c->fill += r;
+
+    char *line = c->buf;
+    char *nl;
+    while ((nl = (char*) memchr(line, '\n', c->buf + c->fill - line))) {
+        *nl = 0;
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = 0;
+
+        char reply[MAX_REPLY];
+        reply[0] = 0;
+        handler(line, reply, sizeof(reply) - 1);
+        strcat(reply, "\n");
+        int len = strlen(reply);
+        if (c->out_len + len > MAX_QUEUED) {
+            printf("Control client isn't reading its replies, dropping it\n");
+            client_close(c);
+            return;
+        }
+        memcpy(c->out + c->out_len, reply, len);
+        c->out_len += len;
+        line = nl + 1;
+    }
+    if (c->out_len && !flush(c)) {
+        client_close(c);
+        return;
+    }
+
+    c->fill -= line - c->buf;
+    memmove(c->buf, line, c->fill);
+    if (c->fill == sizeof(c->buf)) {
+        printf("Control command too long, dropping client\n");
+        client_close(c);
+    }
+}
+
+static void accept_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (cfd < 0) {
+        perror("accept control");
+        return;
+    }
+
+    ControlClient *c = new ControlClient;
+    c->fd = cfd;
+    c->fill = 0;
+    c->out_len = 0;
+    c->event = api->io_new(api, cfd, PA_IO_EVENT_INPUT, client_cb, c);
+}
+
+void control_start(pa_mainloop_api *a, const char *path, control_handler_t h) {
+    api = a;
+    handler = h;
+
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        perror("socket control");
+        exit(1);
+    }
+
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        printf("Control socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(sun.sun_path, path);
+
+    // A previous daemon may have left its socket behind.
+    unlink(path);
+    if (bind(s, (struct sockaddr*) &sun, sizeof(sun)) < 0 || listen(s, 4) < 0) {
+        perror("bind control");
+        exit(1);
+    }
+
+    api->io_new(api, s, PA_IO_EVENT_INPUT, accept_cb, NULL);
+    printf("Listening for commands on %s\n", path);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <pulse/pulseaudio.h>
+
+/* Line based command interface on a Unix domain socket, so server.py can
+ * drive a long-lived stream process instead of spawning one per
+ * transmission. Every command line gets exactly one reply line. */
+
+// Handle one command (without the newline) and write the reply into
+// `reply`, also without the newline.
+typedef void (*control_handler_t)(const char *line, char *reply, size_t reply_len);
+
+// Listen on `path` and serve commands from the mainloop.
+void control_start(pa_mainloop_api *api, const char *path, control_handler_t handler);
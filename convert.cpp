@@ -0,0 +1,544 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#include "convert.h"
+
+// Converts `n` samples. `state` is the dither generator, one xorshift32 per
+// SIMD lane.
+typedef void (*convert_fn)(const void *in, int16_t *out, size_t n, uint32_t *state);
+
+struct ConvertKernels {
+    const char *name;
+    bool (*supported)();
+    convert_fn convert[5];  // indexed by SampleFormat
+    convert_fn float_dither;
+};
+
+// Float samples are scaled by this and clamped to the S16 range.
+#define FLOAT_SCALE 32768.f
+// Turns a signed 32 bit random number into +-0.5 LSB.
+#define DITHER_SCALE (1.f / 4294967296.f)
+
+bool sample_format_parse(const char *name, SampleFormat *format) {
+    if (!strcmp(name, "s16"))
+        *format = SAMPLE_S16;
+    else if (!strcmp(name, "s24"))
+        *format = SAMPLE_S24;
+    else if (!strcmp(name, "s24-32"))
+        *format = SAMPLE_S24_32;
+    else if (!strcmp(name, "s32"))
+        *format = SAMPLE_S32;
+    else if (!strcmp(name, "float"))
+        *format = SAMPLE_FLOAT;
+    else
+        return false;
+    return true;
+}
+
+int sample_format_bytes(SampleFormat format) {
+    switch (format) {
+        case SAMPLE_S16:
+            return 2;
+        case SAMPLE_S24:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+/*********** Scalar reference **************/
+static inline uint32_t xorshift32(uint32_t &s) {
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+static inline int16_t float_to_s16(float v) {
+    // Written so NaN ends up at the bottom, like SSE maxps does.
+    v = v > -32768.f ? v : -32768.f;
+    v = v < 32767.f ? v : 32767.f;
+    return lrintf(v);
+}
+
+static void s16_copy(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    memcpy(out, in, n * 2);
+}
+
+static void s24_scalar(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const uint8_t *p = (const uint8_t*) in;
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int16_t) (p[3*i+1] | (p[3*i+2] << 8));
+}
+
+static void s24_32_scalar(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    for (size_t i = 0; i < n; i++)
+        out[i] = (int32_t) ((uint32_t) p[i] << 8) >> 16;
+}
+
+static void s32_scalar(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    for (size_t i = 0; i < n; i++)
+        out[i] = p[i] >> 16;
+}
+
+static void float_scalar(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    for (size_t i = 0; i < n; i++)
+        out[i] = float_to_s16(p[i] * FLOAT_SCALE);
+}
+
+// Triangular PDF dither: the sum of two uniform +-0.5 LSB variables.
+static void float_dither_scalar(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    for (size_t i = 0; i < n; i++) {
+        float a = (int32_t) xorshift32(state[0]);
+        float b = (int32_t) xorshift32(state[0]);
+        out[i] = float_to_s16(p[i] * FLOAT_SCALE + (a + b) * DITHER_SCALE);
+    }
+}
+
+static bool always() {
+    return true;
+}
+
+/*********** SSE2 / AVX2 **************/
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static inline __m128i xorshift32_sse2(__m128i &s) {
+    s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+    s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+    s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+    return s;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i float_pack_sse2(__m128 a, __m128 b) {
+    const __m128 lo = _mm_set1_ps(-32768.f), hi = _mm_set1_ps(32767.f);
+    a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+    b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+    return _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+}
+
+__attribute__((target("sse2")))
+static void s24_32_sse2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (p + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (p + i + 4));
+        a = _mm_srai_epi32(_mm_slli_epi32(a, 8), 16);
+        b = _mm_srai_epi32(_mm_slli_epi32(b, 8), 16);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(a, b));
+    }
+    s24_32_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("sse2")))
+static void s32_sse2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*) (p + i)), 16);
+        __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*) (p + i + 4)), 16);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(a, b));
+    }
+    s32_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("sse2")))
+static void float_sse2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    const __m128 scale = _mm_set1_ps(FLOAT_SCALE);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(p + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(p + i + 4), scale);
+        _mm_storeu_si128((__m128i*) (out + i), float_pack_sse2(a, b));
+    }
+    float_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("sse2")))
+static void float_dither_sse2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    const __m128 scale = _mm_set1_ps(FLOAT_SCALE), dscale = _mm_set1_ps(DITHER_SCALE);
+    __m128i s = _mm_loadu_si128((const __m128i*) state);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 da = _mm_add_ps(_mm_cvtepi32_ps(xorshift32_sse2(s)), _mm_cvtepi32_ps(xorshift32_sse2(s)));
+        __m128 db = _mm_add_ps(_mm_cvtepi32_ps(xorshift32_sse2(s)), _mm_cvtepi32_ps(xorshift32_sse2(s)));
+        __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p + i), scale), _mm_mul_ps(da, dscale));
+        __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p + i + 4), scale), _mm_mul_ps(db, dscale));
+        _mm_storeu_si128((__m128i*) (out + i), float_pack_sse2(a, b));
+    }
+    _mm_storeu_si128((__m128i*) state, s);
+    float_dither_scalar(p + i, out + i, n - i, state);
+}
+
+// Eight samples from 24 bytes: two overlapping loads, each shuffled down to
+// the top two bytes of the samples it fully covers.
+__attribute__((target("ssse3")))
+static void s24_ssse3(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const uint8_t *p = (const uint8_t*) in;
+    const __m128i lo = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14, -1, -1, -1, -1, -1, -1);
+    const __m128i hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 8, 9, 11, 12, 14, 15);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 3*i)), lo);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (p + 3*i + 8)), hi);
+        _mm_storeu_si128((__m128i*) (out + i), _mm_or_si128(a, b));
+    }
+    s24_scalar(p + 3*i, out + i, n - i, state);
+}
+
+static bool have_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool have_avx2() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("ssse3");
+}
+
+// packs works within 128 bit lanes, this puts the quadwords back in order.
+__attribute__((target("avx2")))
+static inline __m256i pack_avx2(__m256i a, __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i float_pack_avx2(__m256 a, __m256 b) {
+    const __m256 lo = _mm256_set1_ps(-32768.f), hi = _mm256_set1_ps(32767.f);
+    a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+    b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+    return pack_avx2(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i xorshift32_avx2(__m256i &s) {
+    s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 13));
+    s = _mm256_xor_si256(s, _mm256_srli_epi32(s, 17));
+    s = _mm256_xor_si256(s, _mm256_slli_epi32(s, 5));
+    return s;
+}
+
+__attribute__((target("avx2")))
+static void s24_32_avx2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (p + i + 8));
+        a = _mm256_srai_epi32(_mm256_slli_epi32(a, 8), 16);
+        b = _mm256_srai_epi32(_mm256_slli_epi32(b, 8), 16);
+        _mm256_storeu_si256((__m256i*) (out + i), pack_avx2(a, b));
+    }
+    s24_32_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("avx2")))
+static void s32_avx2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*) (p + i)), 16);
+        __m256i b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*) (p + i + 8)), 16);
+        _mm256_storeu_si256((__m256i*) (out + i), pack_avx2(a, b));
+    }
+    s32_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("avx2")))
+static void float_avx2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    const __m256 scale = _mm256_set1_ps(FLOAT_SCALE);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(p + i), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(p + i + 8), scale);
+        _mm256_storeu_si256((__m256i*) (out + i), float_pack_avx2(a, b));
+    }
+    float_scalar(p + i, out + i, n - i, state);
+}
+
+__attribute__((target("avx2")))
+static void float_dither_avx2(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    const __m256 scale = _mm256_set1_ps(FLOAT_SCALE), dscale = _mm256_set1_ps(DITHER_SCALE);
+    __m256i s = _mm256_loadu_si256((const __m256i*) state);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 da = _mm256_add_ps(_mm256_cvtepi32_ps(xorshift32_avx2(s)), _mm256_cvtepi32_ps(xorshift32_avx2(s)));
+        __m256 db = _mm256_add_ps(_mm256_cvtepi32_ps(xorshift32_avx2(s)), _mm256_cvtepi32_ps(xorshift32_avx2(s)));
+        __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p + i), scale), _mm256_mul_ps(da, dscale));
+        __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p + i + 8), scale), _mm256_mul_ps(db, dscale));
+        _mm256_storeu_si256((__m256i*) (out + i), float_pack_avx2(a, b));
+    }
+    _mm256_storeu_si256((__m256i*) state, s);
+    float_dither_scalar(p + i, out + i, n - i, state);
+}
+#endif
+
+/*********** NEON **************/
+#ifdef HAVE_NEON_KERNELS
+static inline uint32x4_t xorshift32_neon(uint32x4_t &s) {
+    s = veorq_u32(s, vshlq_n_u32(s, 13));
+    s = veorq_u32(s, vshrq_n_u32(s, 17));
+    s = veorq_u32(s, vshlq_n_u32(s, 5));
+    return s;
+}
+
+// maxnm/minnm pick the number over a NaN, so NaN ends up at the bottom as
+// in the scalar version.
+static inline int16x8_t float_pack_neon(float32x4_t a, float32x4_t b) {
+    const float32x4_t lo = vdupq_n_f32(-32768.f), hi = vdupq_n_f32(32767.f);
+    a = vminnmq_f32(vmaxnmq_f32(a, lo), hi);
+    b = vminnmq_f32(vmaxnmq_f32(b, lo), hi);
+    return vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)), vqmovn_s32(vcvtnq_s32_f32(b)));
+}
+
+static void s24_neon(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const uint8_t *p = (const uint8_t*) in;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // Deinterleave the three bytes of 16 samples, keep the top two.
+        uint8x16x3_t v = vld3q_u8(p + 3*i);
+        uint8x16x2_t z = vzipq_u8(v.val[1], v.val[2]);
+        vst1q_u8((uint8_t*) (out + i), z.val[0]);
+        vst1q_u8((uint8_t*) (out + i + 8), z.val[1]);
+    }
+    s24_scalar(p + 3*i, out + i, n - i, state);
+}
+
+static void s24_32_neon(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t a = vshrq_n_s32(vshlq_n_s32(vld1q_s32(p + i), 8), 16);
+        int32x4_t b = vshrq_n_s32(vshlq_n_s32(vld1q_s32(p + i + 4), 8), 16);
+        vst1q_s16(out + i, vcombine_s16(vmovn_s32(a), vmovn_s32(b)));
+    }
+    s24_32_scalar(p + i, out + i, n - i, state);
+}
+
+static void s32_neon(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const int32_t *p = (const int32_t*) in;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int32x4_t a = vshrq_n_s32(vld1q_s32(p + i), 16);
+        int32x4_t b = vshrq_n_s32(vld1q_s32(p + i + 4), 16);
+        vst1q_s16(out + i, vcombine_s16(vmovn_s32(a), vmovn_s32(b)));
+    }
+    s32_scalar(p + i, out + i, n - i, state);
+}
+
+static void float_neon(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(p + i), FLOAT_SCALE);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(p + i + 4), FLOAT_SCALE);
+        vst1q_s16(out + i, float_pack_neon(a, b));
+    }
+    float_scalar(p + i, out + i, n - i, state);
+}
+
+static void float_dither_neon(const void *in, int16_t *out, size_t n, uint32_t *state) {
+    const float *p = (const float*) in;
+    uint32x4_t s = vld1q_u32(state);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t da = vaddq_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(xorshift32_neon(s))),
+                                   vcvtq_f32_s32(vreinterpretq_s32_u32(xorshift32_neon(s))));
+        float32x4_t db = vaddq_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(xorshift32_neon(s))),
+                                   vcvtq_f32_s32(vreinterpretq_s32_u32(xorshift32_neon(s))));
+        float32x4_t a = vmlaq_n_f32(vmulq_n_f32(vld1q_f32(p + i), FLOAT_SCALE), da, DITHER_SCALE);
+        float32x4_t b = vmlaq_n_f32(vmulq_n_f32(vld1q_f32(p + i + 4), FLOAT_SCALE), db, DITHER_SCALE);
+        vst1q_s16(out + i, float_pack_neon(a, b));
+    }
+    vst1q_u32(state, s);
+    float_dither_scalar(p + i, out + i, n - i, state);
+}
+#endif
+
+/*********** Dispatch **************/
+// Best last.
+static const ConvertKernels kernel_sets[] = {
+    {"scalar", always, {s16_copy, s24_scalar, s24_32_scalar, s32_scalar, float_scalar}, float_dither_scalar},
+#ifdef HAVE_X86_KERNELS
+    {"sse2", have_sse2, {s16_copy, s24_scalar, s24_32_sse2, s32_sse2, float_sse2}, float_dither_sse2},
+    {"avx2", have_avx2, {s16_copy, s24_ssse3, s24_32_avx2, s32_avx2, float_avx2}, float_dither_avx2},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", always, {s16_copy, s24_neon, s24_32_neon, s32_neon, float_neon}, float_dither_neon},
+#endif
+};
+#define KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+static const ConvertKernels *pick_kernels() {
+    static const ConvertKernels *picked = NULL;
+    if (!picked) {
+        for (unsigned i = 0; i < KERNEL_SETS; i++)
+            if (kernel_sets[i].supported())
+                picked = &kernel_sets[i];
+    }
+    return picked;
+}
+
+const char *convert_kernel_name() {
+    return pick_kernels()->name;
+}
+
+FormatConverter::FormatConverter(SampleFormat format, int channels, bool dither)
+    : format(format), channels(channels), dither(dither), buf(NULL), buf_samples(0) {
+    for (int i = 0; i < 8; i++)
+        dither_state[i] = 0x9e3779b9 * (i + 1);
+}
+
+FormatConverter::~FormatConverter() {
+    free(buf);
+}
+
+void FormatConverter::reserve(size_t frames) {
+    size_t need = frames * (channels > 2 ? channels : 2);
+    if (need > buf_samples) {
+        free(buf);
+        buf = (int16_t*) malloc(need * sizeof(int16_t));
+        buf_samples = need;
+    }
+}
+
+const int16_t *FormatConverter::convert(const void *data, size_t bytes, size_t *out_bytes) {
+    const ConvertKernels *k = pick_kernels();
+    size_t frames = bytes / (sample_format_bytes(format) * channels);
+    size_t samples = frames * channels;
+
+    assert(frames * (channels > 2 ? channels : 2) <= buf_samples);
+
+    if (format == SAMPLE_FLOAT && dither)
+        k->float_dither(data, buf, samples, dither_state);
+    else
+        k->convert[format](data, buf, samples, dither_state);
+
+    if (channels == 1) {
+        // Spread out from the end so nothing is overwritten before it's read.
+        for (size_t f = frames; f-- > 0; ) {
+            int16_t v = buf[f];
+            buf[2*f] = buf[2*f+1] = v;
+        }
+    } else if (channels > 2) {
+        for (size_t f = 0; f < frames; f++) {
+            int16_t l = buf[channels*f], r = buf[channels*f+1];
+            buf[2*f] = l;
+            buf[2*f+1] = r;
+        }
+    }
+
+    *out_bytes = frames * 2 * sizeof(int16_t);
+    return buf;
+}
+
+/*********** Benchmark **************/
+#define BENCH_SAMPLES 4096
+#define BENCH_NSEC 200000000LL
+
+static long long bench_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+// Samples per second through `fn`, over about BENCH_NSEC.
+static double bench_kernel(convert_fn fn, const void *in, int16_t *out) {
+    uint32_t state[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    long long start = bench_nsec(), now;
+    long long calls = 0;
+    do {
+        for (int i = 0; i < 64; i++)
+            fn(in, out, BENCH_SAMPLES, state);
+        calls += 64;
+        now = bench_nsec();
+    } while (now - start < BENCH_NSEC);
+    return calls * BENCH_SAMPLES * 1e9 / (now - start);
+}
+
+int convert_benchmark() {
+    static const char *format_names[] = {"s16", "s24", "s24-32", "s32", "float", "float+dither"};
+
+    // One extra sample so kernels are also run on an odd tail.
+    int n = BENCH_SAMPLES + 1;
+    char *in = (char*) malloc(n * 4);
+    int16_t *ref = (int16_t*) malloc(n * 2);
+    int16_t *out = (int16_t*) malloc(n * 2);
+    uint32_t rnd = 0x12345678;
+    int mismatches = 0;
+
+    printf("Format conversion, %d samples per call, using %s\n", BENCH_SAMPLES, convert_kernel_name());
+    for (int f = SAMPLE_S24; f <= SAMPLE_FLOAT + 1; f++) {
+        SampleFormat format = f > SAMPLE_FLOAT ? SAMPLE_FLOAT : (SampleFormat) f;
+        bool dither = f > SAMPLE_FLOAT;
+
+        // Random data, plus the extremes and, for float, out of range
+        // values and NaN.
+        for (int i = 0; i < n * 4; i++)
+            in[i] = xorshift32(rnd);
+        if (format == SAMPLE_FLOAT) {
+            float *p = (float*) in;
+            for (int i = 0; i < n; i++)
+                p[i] = (int32_t) xorshift32(rnd) / 2147483648.f * 1.25f;
+            p[0] = 1.f;
+            p[1] = -1.f;
+            p[2] = NAN;
+            p[3] = 0.5f / FLOAT_SCALE;
+        }
+
+        double base = 0;
+        for (unsigned k = 0; k < KERNEL_SETS; k++) {
+            const ConvertKernels &ks = kernel_sets[k];
+            if (!ks.supported())
+                continue;
+            convert_fn fn = dither ? ks.float_dither : ks.convert[format];
+
+            // Against the scalar kernel without dither: exact, or within
+            // the dither's +-1 LSB.
+            uint32_t state[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+            kernel_sets[0].convert[format](in, ref, n, state);
+            fn(in, out, n, state);
+            int bad = 0;
+            for (int i = 0; i < n; i++) {
+                int diff = abs(out[i] - ref[i]);
+                if (diff > (dither ? 1 : 0))
+                    bad++;
+            }
+
+            double rate = bench_kernel(fn, in, out);
+            if (k == 0)
+                base = rate;
+            printf("  %-12s %-6s %8.1f Msamples/s  %5.2fx  %s\n", format_names[f], ks.name,
+                   rate / 1e6, rate / base, bad ? "MISMATCH" : "ok");
+            if (bad) {
+                printf("    %d of %d samples differ from the scalar reference\n", bad, n);
+                mismatches++;
+            }
+        }
+    }
+
+    free(in);
+    free(ref);
+    free(out);
+    return mismatches;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Conversion of whatever the capture side produces into the S16LE stereo the
+ * packetizer sends, so the sound server doesn't have to do it for us.
+ *
+ * Kernels exist as a scalar reference plus SSE2/AVX2 (x86) and NEON
+ * (aarch64) versions, picked once at startup by what the CPU supports. */
+
+enum SampleFormat {
+    SAMPLE_S16,     // signed 16 bit
+    SAMPLE_S24,     // signed 24 bit, packed in 3 bytes
+    SAMPLE_S24_32,  // signed 24 bit in the low bits of 32 bit words
+    SAMPLE_S32,     // signed 32 bit
+    SAMPLE_FLOAT,   // float32, full scale at +-1.0
+};
+
+// Parse s16, s24, s24-32, s32 or float. Returns false for anything else.
+bool sample_format_parse(const char *name, SampleFormat *format);
+int sample_format_bytes(SampleFormat format);
+
+class FormatConverter {
+public:
+    // Integer formats are truncated to 16 bits. Float is rounded, or with
+    // `dither` gets TPDF dither of +-1 LSB first.
+    FormatConverter(SampleFormat format, int channels, bool dither);
+    ~FormatConverter();
+
+    // Size the output buffer for up to `frames` frames per call. Done once
+    // at setup, convert() itself never allocates.
+    void reserve(size_t frames);
+
+    // Convert whole frames of interleaved input into S16 stereo: mono is
+    // duplicated, channels past the second are dropped. At most as many
+    // frames as reserved. The result lives in an internal buffer that's
+    // reused by the next call.
+    const int16_t *convert(const void *data, size_t bytes, size_t *out_bytes);
+
+    // Nothing to do, input is already what we send.
+    bool passthrough() const { return format == SAMPLE_S16 && channels == 2; }
+
+private:
+    SampleFormat format;
+    int channels;
+    bool dither;
+
+    int16_t *buf;
+    size_t buf_samples;
+    uint32_t dither_state[8];
+};
+
+// Name of the kernel set picked for this CPU.
+const char *convert_kernel_name();
+
+// Time every kernel set this CPU supports against the scalar reference,
+// check they agree with it, and print the results. Returns how many
+// kernels disagreed.
+int convert_benchmark();
@@ -0,0 +1,69 @@
+#include <math.h>
+
+#include "drift.h"
+
+// Phase errors above this are treated as a discontinuity (suspend, stall,
+// lost data) and restart the loop instead of being tracked.
+#define MAX_ERROR_NS 50000000.0
+
+// Single observations are clamped to this before feeding the loop, so a
+// late wakeup doesn't yank the estimate.
+#define CLAMP_ERROR_NS 2000000.0
+
+DriftEstimator::DriftEstimator(double bytes_per_sec, double interval_ns, double bandwidth_hz)
+    : base_position(0), base_time(0), drift(0), observations(0), jumps(0) {
+    ns_per_byte = 1e9 / bytes_per_sec;
+
+    // Slightly underdamped (zeta = 0.7) second order loop with natural
+    // frequency wn, discretized at the observation interval T:
+    // kp = 2 zeta wn T, ki = (wn T)^2.
+    double wn = 2 * M_PI * bandwidth_hz;
+    double t = interval_ns / 1e9;
+    kp = 2 * 0.7 * wn * t;
+    ki = (wn * t) * (wn * t);
+}
+
+void DriftEstimator::update(long long position, long long time) {
+    if (observations == 0) {
+        base_position = position;
+        base_time = time;
+        drift = 0;
+        observations = 1;
+        return;
+    }
+
+    double elapsed = (position - base_position) * ns_per_byte;
+    if (elapsed <= 0)
+        return;
+
+    double predicted = base_time + elapsed * (1 + drift);
+    double error = time - predicted;
+
+    if (fabs(error) > MAX_ERROR_NS) {
+        jumps++;
+        base_position = position;
+        base_time = time;
+        observations = 1;
+        return;
+    }
+
+    if (error > CLAMP_ERROR_NS)
+        error = CLAMP_ERROR_NS;
+    if (error < -CLAMP_ERROR_NS)
+        error = -CLAMP_ERROR_NS;
+
+    // Converge faster while the loop hasn't settled yet.
+    double gain = observations < LOCK_OBSERVATIONS ? 1.0 / observations : 0;
+    base_position = position;
+    base_time = predicted + (kp + gain) * error;
+    drift += ki * error / elapsed;
+    observations++;
+}
+
+long long DriftEstimator::time_at(long long position) const {
+    return base_time + (position - base_position) * ns_per_byte * (1 + drift);
+}
+
+void DriftEstimator::rebase_drift(double ppm) {
+    drift -= ppm / 1e6;
+}
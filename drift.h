@@ -0,0 +1,53 @@
+#pragma once
+
+/* Tracks the capture clock against CLOCK_MONOTONIC.
+ *
+ * The sound card produces bytes at its own rate, which is never exactly the
+ * nominal one as measured by CLOCK_MONOTONIC, the clock the SNTP server
+ * hands out to the speakers. This fits
+ *
+ *     time(position) = base_time + (position - base_position) * ns_per_byte * (1 + drift)
+ *
+ * to (capture position, monotonic time) observations with a second order PI
+ * loop, so packet timestamps can be derived from the byte position and stay
+ * locked to the monotonic clock without inheriting the scheduling jitter of
+ * each observation. */
+class DriftEstimator {
+public:
+    // bytes_per_sec is the nominal capture rate, interval_ns the expected
+    // time between observations. bandwidth_hz sets how fast the loop
+    // follows, lower is smoother.
+    DriftEstimator(double bytes_per_sec, double interval_ns, double bandwidth_hz = 0.03);
+
+    // Feed one observation: `position` bytes had been captured at `time`.
+    void update(long long position, long long time);
+
+    // Estimated monotonic time at which `position` was captured.
+    long long time_at(long long position) const;
+
+    // Capture clock relative to the nominal rate in parts per million.
+    // Positive means the card is slow: bytes arrive later than nominal.
+    double drift_ppm() const { return drift * 1e6; }
+
+    // Forget about the current drift, e.g. after the capture rate itself
+    // was corrected by that amount.
+    void rebase_drift(double ppm);
+
+    bool locked() const { return observations > LOCK_OBSERVATIONS; }
+
+    // Times the estimate was thrown away because the capture clock jumped.
+    unsigned discontinuities() const { return jumps; }
+    void reset() { observations = 0; }
+
+private:
+    static const int LOCK_OBSERVATIONS = 100;
+
+    double ns_per_byte;
+    double kp, ki;
+
+    long long base_position;
+    double base_time;
+    double drift;
+    long long observations;
+    unsigned jumps;
+};
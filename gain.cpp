@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#include "gain.h"
+
+// Attenuation at volume 1, the quietest before silence.
+#define VOLUME_RANGE_DB 50.0
+
+// Multiplies `frames` stereo frames by a gain that starts at `gain` and
+// grows by `step` every frame: frame f gets gain + f * step. The metering
+// versions also add the input to `levels`, the others ignore it.
+typedef void (*gain_fn)(const int16_t *in, int16_t *out, size_t frames, float gain, float step, Levels *levels);
+
+// Meters `frames` stereo frames into `levels`, copying them to `out` on
+// the way unless it's NULL.
+typedef void (*meter_fn)(const int16_t *in, int16_t *out, size_t frames, Levels *levels);
+
+struct GainKernels {
+    const char *name;
+    bool (*supported)();
+    gain_fn gain;
+    gain_fn gain_meter;
+    meter_fn copy;   // copy and meter
+    meter_fn meter;  // meter only
+};
+
+double gain_from_volume(int volume) {
+    if (volume <= 0)
+        return 0;
+    if (volume >= 100)
+        return 1;
+    return pow(10, (volume - 100) * VOLUME_RANGE_DB / 100 / 20);
+}
+
+/*********** Levels **************/
+void Levels::clear() {
+    peak[0] = peak[1] = 0;
+    squares[0] = squares[1] = 0;
+    frames = 0;
+}
+
+static double level_db(double level) {
+    double db = level > 0 ? 20 * log10(level / 32768) : LEVEL_FLOOR_DB;
+    return db > LEVEL_FLOOR_DB ? db : LEVEL_FLOOR_DB;
+}
+
+double Levels::peak_db(int channel) const {
+    return level_db(frames ? peak[channel] : 0);
+}
+
+double Levels::rms_db(int channel) const {
+    return level_db(frames ? sqrt(squares[channel] / frames) : 0);
+}
+
+static inline void meter_frame(Levels *levels, int l, int r) {
+    int al = l < 0 ? -l : l, ar = r < 0 ? -r : r;
+    if (al > levels->peak[0])
+        levels->peak[0] = al;
+    if (ar > levels->peak[1])
+        levels->peak[1] = ar;
+    levels->squares[0] += l * l;
+    levels->squares[1] += r * r;
+}
+
+// Fold what the SIMD kernels kept per lane into `levels`. Lanes alternate
+// left and right, peaks are magnitudes.
+static void meter_lanes(Levels *levels, const float *peak, const float *squares, int lanes) {
+    for (int i = 0; i < lanes; i++) {
+        if (peak[i] > levels->peak[i & 1])
+            levels->peak[i & 1] = peak[i];
+        levels->squares[i & 1] += squares[i];
+    }
+}
+
+// The same from the integer kernels, which keep the largest and smallest
+// sample per lane.
+static void meter_lanes_s16(Levels *levels, const int16_t *hi, const int16_t *lo, int lanes) {
+    for (int i = 0; i < lanes; i++) {
+        int p = hi[i] > -lo[i] ? hi[i] : -lo[i];
+        if (p > levels->peak[i & 1])
+            levels->peak[i & 1] = p;
+    }
+}
+
+/*********** Scalar reference **************/
+static inline int16_t gain_to_s16(float v) {
+    v = v > -32768.f ? v : -32768.f;
+    v = v < 32767.f ? v : 32767.f;
+    return lrintf(v);
+}
+
+// From frame `first` on, so the SIMD kernels can finish with it and get
+// the very same gains.
+template <bool meter>
+static void gain_tail(const int16_t *in, int16_t *out, size_t first, size_t frames, float gain, float step, Levels *levels) {
+    for (size_t f = first; f < frames; f++) {
+        float g = gain + (float) f * step;
+        int l = in[2*f], r = in[2*f+1];
+        if (meter)
+            meter_frame(levels, l, r);
+        out[2*f] = gain_to_s16(l * g);
+        out[2*f+1] = gain_to_s16(r * g);
+    }
+}
+
+template <bool meter>
+static void gain_scalar(const int16_t *in, int16_t *out, size_t frames, float gain, float step, Levels *levels) {
+    gain_tail<meter>(in, out, 0, frames, gain, step, levels);
+}
+
+static void meter_tail(const int16_t *in, int16_t *out, size_t first, size_t frames, Levels *levels) {
+    for (size_t f = first; f < frames; f++) {
+        int l = in[2*f], r = in[2*f+1];
+        meter_frame(levels, l, r);
+        if (out) {
+            out[2*f] = l;
+            out[2*f+1] = r;
+        }
+    }
+}
+
+static void meter_scalar(const int16_t *in, int16_t *out, size_t frames, Levels *levels) {
+    meter_tail(in, out, 0, frames, levels);
+}
+
+static bool always() {
+    return true;
+}
+
+/*********** SSE2 / AVX2 **************/
+#ifdef HAVE_X86_KERNELS
+static bool have_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool have_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static inline __m128i gain_pack_sse2(__m128 a, __m128 b) {
+    const __m128 lo = _mm_set1_ps(-32768.f), hi = _mm_set1_ps(32767.f);
+    a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+    b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+    return _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+}
+
+// Four frames at a time. The frame index of every sample is kept as a
+// float, so the gains come out exactly as in the scalar version. Metering
+// works on the samples already converted for the multiply.
+template <bool meter>
+__attribute__((target("sse2")))
+static void gain_sse2(const int16_t *in, int16_t *out, size_t frames, float gain, float step, Levels *levels) {
+    const __m128 g = _mm_set1_ps(gain), s = _mm_set1_ps(step), four = _mm_set1_ps(4.f);
+    const __m128 sign = _mm_set1_ps(-0.f);
+    __m128 fa = _mm_setr_ps(0, 0, 1, 1), fb = _mm_setr_ps(2, 2, 3, 3);
+    __m128 peak = _mm_setzero_ps(), squares = _mm_setzero_ps();
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (in + 2*f));
+        __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+        __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+        if (meter) {
+            peak = _mm_max_ps(peak, _mm_max_ps(_mm_andnot_ps(sign, a), _mm_andnot_ps(sign, b)));
+            squares = _mm_add_ps(squares, _mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)));
+        }
+        a = _mm_mul_ps(a, _mm_add_ps(g, _mm_mul_ps(fa, s)));
+        b = _mm_mul_ps(b, _mm_add_ps(g, _mm_mul_ps(fb, s)));
+        _mm_storeu_si128((__m128i*) (out + 2*f), gain_pack_sse2(a, b));
+        fa = _mm_add_ps(fa, four);
+        fb = _mm_add_ps(fb, four);
+    }
+    if (meter) {
+        float p[4], sq[4];
+        _mm_storeu_ps(p, peak);
+        _mm_storeu_ps(sq, squares);
+        meter_lanes(levels, p, sq, 4);
+    }
+    gain_tail<meter>(in, out, f, frames, gain, step, levels);
+}
+
+// Squares are taken with madd on each channel masked out of the frame,
+// which leaves one exact 32 bit square per lane.
+template <bool store>
+__attribute__((target("sse2")))
+static void meter_sse2(const int16_t *in, int16_t *out, size_t frames, Levels *levels) {
+    const __m128i left = _mm_set1_epi32(0xffff);
+    __m128i hi = _mm_setzero_si128(), lo = _mm_setzero_si128();
+    __m128 sl = _mm_setzero_ps(), sr = _mm_setzero_ps();
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (in + 2*f));
+        if (store)
+            _mm_storeu_si128((__m128i*) (out + 2*f), x);
+        hi = _mm_max_epi16(hi, x);
+        lo = _mm_min_epi16(lo, x);
+        __m128i l = _mm_and_si128(x, left), r = _mm_srli_epi32(x, 16);
+        sl = _mm_add_ps(sl, _mm_cvtepi32_ps(_mm_madd_epi16(l, l)));
+        sr = _mm_add_ps(sr, _mm_cvtepi32_ps(_mm_madd_epi16(r, r)));
+    }
+    int16_t h[8], m[8];
+    float ssl[4], ssr[4];
+    _mm_storeu_si128((__m128i*) h, hi);
+    _mm_storeu_si128((__m128i*) m, lo);
+    _mm_storeu_ps(ssl, sl);
+    _mm_storeu_ps(ssr, sr);
+    meter_lanes_s16(levels, h, m, 8);
+    levels->squares[0] += (double) ssl[0] + ssl[1] + ssl[2] + ssl[3];
+    levels->squares[1] += (double) ssr[0] + ssr[1] + ssr[2] + ssr[3];
+    meter_tail(in, out, f, frames, levels);
+}
+
+template <bool meter>
+__attribute__((target("avx2")))
+static void gain_avx2(const int16_t *in, int16_t *out, size_t frames, float gain, float step, Levels *levels) {
+    const __m256 g = _mm256_set1_ps(gain), s = _mm256_set1_ps(step), eight = _mm256_set1_ps(8.f);
+    const __m256 lo = _mm256_set1_ps(-32768.f), hi = _mm256_set1_ps(32767.f);
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    __m256 fa = _mm256_setr_ps(0, 0, 1, 1, 2, 2, 3, 3), fb = _mm256_setr_ps(4, 4, 5, 5, 6, 6, 7, 7);
+    __m256 peak = _mm256_setzero_ps(), squares = _mm256_setzero_ps();
+    size_t f = 0;
+    for (; f + 8 <= frames; f += 8) {
+        __m256 a = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (in + 2*f))));
+        __m256 b = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (in + 2*f + 8))));
+        if (meter) {
+            peak = _mm256_max_ps(peak, _mm256_max_ps(_mm256_andnot_ps(sign, a), _mm256_andnot_ps(sign, b)));
+            squares = _mm256_add_ps(squares, _mm256_add_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b)));
+        }
+        a = _mm256_mul_ps(a, _mm256_add_ps(g, _mm256_mul_ps(fa, s)));
+        b = _mm256_mul_ps(b, _mm256_add_ps(g, _mm256_mul_ps(fb, s)));
+        a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+        b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+        // packs works within 128 bit lanes, put the quadwords back in order.
+        __m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i*) (out + 2*f), _mm256_permute4x64_epi64(p, 0xd8));
+        fa = _mm256_add_ps(fa, eight);
+        fb = _mm256_add_ps(fb, eight);
+    }
+    if (meter) {
+        float p[8], sq[8];
+        _mm256_storeu_ps(p, peak);
+        _mm256_storeu_ps(sq, squares);
+        meter_lanes(levels, p, sq, 8);
+    }
+    gain_tail<meter>(in, out, f, frames, gain, step, levels);
+}
+
+template <bool store>
+__attribute__((target("avx2")))
+static void meter_avx2(const int16_t *in, int16_t *out, size_t frames, Levels *levels) {
+    const __m256i left = _mm256_set1_epi32(0xffff);
+    __m256i hi = _mm256_setzero_si256(), lo = _mm256_setzero_si256();
+    __m256 sl = _mm256_setzero_ps(), sr = _mm256_setzero_ps();
+    size_t f = 0;
+    for (; f + 8 <= frames; f += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (in + 2*f));
+        if (store)
+            _mm256_storeu_si256((__m256i*) (out + 2*f), x);
+        hi = _mm256_max_epi16(hi, x);
+        lo = _mm256_min_epi16(lo, x);
+        __m256i l = _mm256_and_si256(x, left), r = _mm256_srli_epi32(x, 16);
+        sl = _mm256_add_ps(sl, _mm256_cvtepi32_ps(_mm256_madd_epi16(l, l)));
+        sr = _mm256_add_ps(sr, _mm256_cvtepi32_ps(_mm256_madd_epi16(r, r)));
+    }
+    // Fold the halves together and finish as in the SSE2 version.
+    __m128i h2 = _mm_max_epi16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+    __m128i m2 = _mm_min_epi16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+    __m128 sl2 = _mm_add_ps(_mm256_castps256_ps128(sl), _mm256_extractf128_ps(sl, 1));
+    __m128 sr2 = _mm_add_ps(_mm256_castps256_ps128(sr), _mm256_extractf128_ps(sr, 1));
+    int16_t h[8], m[8];
+    float ssl[4], ssr[4];
+    _mm_storeu_si128((__m128i*) h, h2);
+    _mm_storeu_si128((__m128i*) m, m2);
+    _mm_storeu_ps(ssl, sl2);
+    _mm_storeu_ps(ssr, sr2);
+    meter_lanes_s16(levels, h, m, 8);
+    levels->squares[0] += (double) ssl[0] + ssl[1] + ssl[2] + ssl[3];
+    levels->squares[1] += (double) ssr[0] + ssr[1] + ssr[2] + ssr[3];
+    // GCC leaves the upper halves dirty here, which makes the SSE code in
+    // the tail crawl.
+    _mm256_zeroupper();
+    meter_tail(in, out, f, frames, levels);
+}
+#endif
+
+/*********** NEON **************/
+#ifdef HAVE_NEON_KERNELS
+template <bool meter>
+static void gain_neon(const int16_t *in, int16_t *out, size_t frames, float gain, float step, Levels *levels) {
+    const float32x4_t lo = vdupq_n_f32(-32768.f), hi = vdupq_n_f32(32767.f), four = vdupq_n_f32(4.f);
+    const float fa_init[4] = {0, 0, 1, 1}, fb_init[4] = {2, 2, 3, 3};
+    float32x4_t fa = vld1q_f32(fa_init), fb = vld1q_f32(fb_init);
+    float32x4_t peak = vdupq_n_f32(0), squares = vdupq_n_f32(0);
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        int16x8_t x = vld1q_s16(in + 2*f);
+        float32x4_t a = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+        float32x4_t b = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+        if (meter) {
+            peak = vmaxq_f32(peak, vmaxq_f32(vabsq_f32(a), vabsq_f32(b)));
+            squares = vaddq_f32(squares, vaddq_f32(vmulq_f32(a, a), vmulq_f32(b, b)));
+        }
+        a = vmulq_f32(a, vaddq_f32(vdupq_n_f32(gain), vmulq_n_f32(fa, step)));
+        b = vmulq_f32(b, vaddq_f32(vdupq_n_f32(gain), vmulq_n_f32(fb, step)));
+        a = vminnmq_f32(vmaxnmq_f32(a, lo), hi);
+        b = vminnmq_f32(vmaxnmq_f32(b, lo), hi);
+        vst1q_s16(out + 2*f, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)), vqmovn_s32(vcvtnq_s32_f32(b))));
+        fa = vaddq_f32(fa, four);
+        fb = vaddq_f32(fb, four);
+    }
+    if (meter) {
+        float p[4], sq[4];
+        vst1q_f32(p, peak);
+        vst1q_f32(sq, squares);
+        meter_lanes(levels, p, sq, 4);
+    }
+    gain_tail<meter>(in, out, f, frames, gain, step, levels);
+}
+
+// vmull squares every sample exactly into 32 bits, still left, right, left,
+// right.
+template <bool store>
+static void meter_neon(const int16_t *in, int16_t *out, size_t frames, Levels *levels) {
+    int16x8_t hi = vdupq_n_s16(0), lo = vdupq_n_s16(0);
+    float32x4_t squares = vdupq_n_f32(0);
+    size_t f = 0;
+    for (; f + 4 <= frames; f += 4) {
+        int16x8_t x = vld1q_s16(in + 2*f);
+        if (store)
+            vst1q_s16(out + 2*f, x);
+        hi = vmaxq_s16(hi, x);
+        lo = vminq_s16(lo, x);
+        int32x4_t a = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+        int32x4_t b = vmull_high_s16(x, x);
+        squares = vaddq_f32(squares, vaddq_f32(vcvtq_f32_s32(a), vcvtq_f32_s32(b)));
+    }
+    int16_t h[8], m[8];
+    float p[4] = {0, 0, 0, 0}, sq[4];
+    vst1q_s16(h, hi);
+    vst1q_s16(m, lo);
+    vst1q_f32(sq, squares);
+    meter_lanes_s16(levels, h, m, 8);
+    meter_lanes(levels, p, sq, 4);
+    meter_tail(in, out, f, frames, levels);
+}
+#endif
+
+/*********** Dispatch **************/
+// Best last.
+static const GainKernels kernel_sets[] = {
+    {"scalar", always, gain_scalar<false>, gain_scalar<true>, meter_scalar, meter_scalar},
+#ifdef HAVE_X86_KERNELS
+    {"sse2", have_sse2, gain_sse2<false>, gain_sse2<true>, meter_sse2<true>, meter_sse2<false>},
+    {"avx2", have_avx2, gain_avx2<false>, gain_avx2<true>, meter_avx2<true>, meter_avx2<false>},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", always, gain_neon<false>, gain_neon<true>, meter_neon<true>, meter_neon<false>},
+#endif
+};
+#define KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+static const GainKernels *pick_kernels() {
+    static const GainKernels *picked = NULL;
+    if (!picked) {
+        for (unsigned i = 0; i < KERNEL_SETS; i++)
+            if (kernel_sets[i].supported())
+                picked = &kernel_sets[i];
+    }
+    return picked;
+}
+
+const char *gain_kernel_name() {
+    return pick_kernels()->name;
+}
+
+void meter_levels(const int16_t *in, size_t frames, Levels *levels) {
+    pick_kernels()->meter(in, NULL, frames, levels);
+    levels->frames += frames;
+}
+
+/*********** Gain **************/
+Gain::Gain()
+    : current(1), step(0), remaining(0), target(1), level(1), mute(false), faded(false) {}
+
+void Gain::ramp_to(long long frames) {
+    target = mute || faded ? 0 : level;
+    if (frames <= 0) {
+        current = target;
+        step = 0;
+        remaining = 0;
+        return;
+    }
+    step = (target - current) / frames;
+    remaining = frames;
+}
+
+void Gain::set_gain(double gain, long long frames) {
+    level = gain;
+    ramp_to(frames);
+}
+
+void Gain::set_mute(bool m, long long frames) {
+    mute = m;
+    ramp_to(frames);
+}
+
+void Gain::fade_in(long long frames) {
+    faded = false;
+    current = 0;
+    ramp_to(frames);
+}
+
+void Gain::fade_out(long long frames) {
+    faded = true;
+    ramp_to(frames);
+}
+
+void Gain::apply(const int16_t *in, int16_t *out, size_t frames, Levels *levels) {
+    const GainKernels *k = pick_kernels();
+    gain_fn fn = levels ? k->gain_meter : k->gain;
+    if (levels)
+        levels->frames += frames;
+
+    if (remaining) {
+        size_t n = frames < (size_t) remaining ? frames : remaining;
+        fn(in, out, n, current, step, levels);
+        skip(n);
+        in += 2*n;
+        out += 2*n;
+        frames -= n;
+    }
+    if (!frames)
+        return;
+
+    if (current == 1.f) {
+        if (levels && in != out)
+            k->copy(in, out, frames, levels);
+        else if (levels)
+            k->meter(in, NULL, frames, levels);
+        else if (in != out)
+            memcpy(out, in, frames * 2 * sizeof(int16_t));
+    } else if (current == 0.f) {
+        // Muted, but the line in is still there.
+        if (levels)
+            k->meter(in, NULL, frames, levels);
+        memset(out, 0, frames * 2 * sizeof(int16_t));
+    } else
+        fn(in, out, frames, current, 0, levels);
+}
+
+void Gain::skip(size_t frames) {
+    if (!remaining)
+        return;
+    if (frames >= (size_t) remaining) {
+        // Land exactly on the target, whatever rounding did on the way.
+        current = target;
+        step = 0;
+        remaining = 0;
+        return;
+    }
+    current += frames * step;
+    remaining -= frames;
+}
+
+/*********** Benchmark **************/
+#define BENCH_FRAMES 2048
+#define BENCH_NSEC 200000000LL
+#define BENCH_PACKET_FRAMES 251  // the default packet size
+
+static long long bench_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+// Frames per second through `fn`, over about BENCH_NSEC.
+static double bench_kernel(gain_fn fn, const int16_t *in, int16_t *out, float gain, float step) {
+    long long start = bench_nsec(), now;
+    long long calls = 0;
+    do {
+        for (int i = 0; i < 64; i++)
+            fn(in, out, BENCH_FRAMES, gain, step, NULL);
+        calls += 64;
+        now = bench_nsec();
+    } while (now - start < BENCH_NSEC);
+    return calls * BENCH_FRAMES * 1e9 / (now - start);
+}
+
+// Nanoseconds to get a packet's worth of PCM into place through `gain`,
+// through `meter`, or with memcpy() if both are NULL.
+static double bench_packet(gain_fn gain, meter_fn meter, const int16_t *in, int16_t *out) {
+    Levels levels;
+    long long start = bench_nsec(), now;
+    long long calls = 0;
+    do {
+        for (int i = 0; i < 64; i++) {
+            if (gain)
+                gain(in, out, BENCH_PACKET_FRAMES, 0.5f, 0, &levels);
+            else if (meter)
+                meter(in, out, BENCH_PACKET_FRAMES, &levels);
+            else
+                memcpy(out, in, BENCH_PACKET_FRAMES * 4);
+        }
+        calls += 64;
+        now = bench_nsec();
+    } while (now - start < BENCH_NSEC);
+    return (double) (now - start) / calls;
+}
+
+static bool same_levels(const Levels &a, const Levels &b) {
+    for (int c = 0; c < 2; c++) {
+        if (a.peak[c] != b.peak[c])
+            return false;
+        // The SIMD kernels sum in floats.
+        if (fabs(a.squares[c] - b.squares[c]) > 1e-5 * b.squares[c])
+            return false;
+    }
+    return true;
+}
+
+// Metering rides along with the pass the packetizer makes over the PCM
+// anyway, so what counts is how much longer that pass gets for a packet.
+// Returns how many kernel sets got the levels wrong.
+static int meter_benchmark(const int16_t *in, int16_t *out, int n) {
+    int mismatches = 0;
+    Levels ref;
+    meter_scalar(in, NULL, n, &ref);
+
+    printf("Metering, %d frame packets\n", BENCH_PACKET_FRAMES);
+    for (unsigned k = 0; k < KERNEL_SETS; k++) {
+        const GainKernels &ks = kernel_sets[k];
+        if (!ks.supported())
+            continue;
+
+        Levels gained, copied, metered;
+        ks.gain_meter(in, out, n, 0.5f, 0, &gained);
+        ks.copy(in, out, n, &copied);
+        ks.meter(in, NULL, n, &metered);
+        bool ok = same_levels(gained, ref) && same_levels(copied, ref) && same_levels(metered, ref);
+
+        double gain = bench_packet(ks.gain, NULL, in, out);
+        double gain_meter = bench_packet(ks.gain_meter, NULL, in, out);
+        double copy = bench_packet(NULL, NULL, in, out);
+        double copy_meter = bench_packet(NULL, ks.copy, in, out);
+        double meter = bench_packet(NULL, ks.meter, in, out);
+        printf("  %-6s gain %6.0f ns, metered %6.0f ns (%+4.0f ns)  copy %6.0f ns, metered %6.0f ns (%+4.0f ns)  meter alone %6.0f ns  %s\n",
+               ks.name, gain, gain_meter, gain_meter - gain, copy, copy_meter, copy_meter - copy, meter,
+               ok ? "ok" : "MISMATCH");
+        if (!ok)
+            mismatches++;
+    }
+    return mismatches;
+}
+
+int gain_benchmark() {
+    // A steady gain, and a ramp up past unity so the saturation is
+    // exercised too.
+    static const struct {
+        const char *name;
+        float gain, step;
+    } cases[] = {
+        {"gain", 0.5f, 0},
+        {"ramp", 0.25f, 1.75f / BENCH_FRAMES},
+    };
+
+    // One extra frame so kernels are also run on an odd tail.
+    int n = BENCH_FRAMES + 1;
+    int16_t *in = (int16_t*) malloc(n * 4);
+    int16_t *ref = (int16_t*) malloc(n * 4);
+    int16_t *out = (int16_t*) malloc(n * 4);
+    uint32_t rnd = 0x12345678;
+    for (int i = 0; i < 2 * n; i++) {
+        rnd ^= rnd << 13;
+        rnd ^= rnd >> 17;
+        rnd ^= rnd << 5;
+        in[i] = rnd;
+    }
+    in[0] = 32767;
+    in[1] = -32768;
+    int mismatches = 0;
+
+    printf("Gain, %d stereo frames per call, using %s\n", BENCH_FRAMES, gain_kernel_name());
+    for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        double base = 0;
+        gain_scalar<false>(in, ref, n, cases[c].gain, cases[c].step, NULL);
+        for (unsigned k = 0; k < KERNEL_SETS; k++) {
+            const GainKernels &ks = kernel_sets[k];
+            if (!ks.supported())
+                continue;
+
+            // Exact, but for a compiler fusing the scalar gain computation
+            // into a multiply-add.
+            ks.gain(in, out, n, cases[c].gain, cases[c].step, NULL);
+            int bad = 0;
+            for (int i = 0; i < 2 * n; i++)
+                if (abs(out[i] - ref[i]) > 1)
+                    bad++;
+
+            double rate = bench_kernel(ks.gain, in, out, cases[c].gain, cases[c].step);
+            if (k == 0)
+                base = rate;
+            printf("  %-6s %-6s %8.1f Mframes/s  %5.2fx  %s\n", cases[c].name, ks.name,
+                   rate / 1e6, rate / base, bad ? "MISMATCH" : "ok");
+            if (bad) {
+                printf("    %d of %d samples differ from the scalar reference\n", bad, 2 * n);
+                mismatches++;
+            }
+        }
+    }
+
+    mismatches += meter_benchmark(in, out, n);
+
+    free(in);
+    free(ref);
+    free(out);
+    return mismatches;
+}
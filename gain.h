@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Volume, mute and fades for the S16LE stereo stream, applied while the
+ * packetizer copies PCM into packets so they cost no extra pass over it.
+ * The input levels are metered in the same pass.
+ *
+ * Every change of gain is a linear ramp, never a step, so nothing clicks.
+ * Kernels exist as a scalar reference plus SSE2/AVX2 (x86) and NEON
+ * (aarch64) versions, picked once at startup, and saturate to 16 bits. */
+
+// Linear gain for a 0-100 volume like RenderingControl's: 0 is silence,
+// 1-100 spread evenly over VOLUME_RANGE_DB below unity.
+double gain_from_volume(int volume);
+
+// What silence reads as, in dBFS: a bit below one LSB of 16 bits.
+#define LEVEL_FLOOR_DB -96.0
+
+// Per channel peak and sum of squares of the samples metered since the
+// last clear(), in S16 units and before any gain: the line in's level.
+struct Levels {
+    int peak[2];
+    double squares[2];
+    long long frames;
+
+    Levels() { clear(); }
+    void clear();
+
+    // Relative to full scale, LEVEL_FLOOR_DB for silence or no frames.
+    double peak_db(int channel) const;
+    double rms_db(int channel) const;
+};
+
+// Meter `frames` frames that go out as they are.
+void meter_levels(const int16_t *in, size_t frames, Levels *levels);
+
+class Gain {
+public:
+    Gain();
+
+    // Ramp to `gain` over `frames`. While muted or faded out, it's only
+    // remembered for later.
+    void set_gain(double gain, long long frames);
+    void set_mute(bool mute, long long frames);
+
+    // Ramp up from silence, or down to it. A faded out stream stays silent
+    // until the next fade_in().
+    void fade_in(long long frames);
+    void fade_out(long long frames);
+
+    // Copy `frames` frames from `in` to `out` through the gain. They may be
+    // the same buffer. If `levels` is given, the input is metered into it
+    // on the way.
+    void apply(const int16_t *in, int16_t *out, size_t frames, Levels *levels = NULL);
+
+    // Move along as if `frames` frames had been through apply().
+    void skip(size_t frames);
+
+    // apply() would copy the samples unchanged.
+    bool unity() const { return current == 1.f && remaining == 0; }
+
+    double gain() const { return level; }
+    bool muted() const { return mute; }
+
+private:
+    void ramp_to(long long frames);
+
+    float current;        // gain of the next frame
+    float step;           // added every frame while ramping
+    long long remaining;  // frames left to ramp
+    float target;         // where the ramp ends
+
+    double level;
+    bool mute, faded;
+};
+
+// Name of the kernel set picked for this CPU.
+const char *gain_kernel_name();
+
+// Time every kernel set this CPU supports against the scalar reference,
+// check they agree with it, and print the results, along with what
+// metering adds to a packet. Returns how many kernels disagreed.
+int gain_benchmark();
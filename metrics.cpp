@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "metrics.h"
+
+Metrics metrics;
+
+void Histogram::observe(long long value) {
+    unsigned long long v = value > 0 ? value : 0;
+    int bucket = 0;
+    while (v && bucket < HISTOGRAM_BUCKETS - 1) {
+        v >>= 1;
+        bucket++;
+    }
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value > 0 ? value : 0, std::memory_order_relaxed);
+}
+
+unsigned long long Histogram::count() const {
+    unsigned long long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += buckets[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+unsigned long long Histogram::percentile(double p) const {
+    unsigned long long counts[HISTOGRAM_BUCKETS], total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += counts[i] = buckets[i].load(std::memory_order_relaxed);
+
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > 0 && seen >= p * total)
+            return 1ull << i;
+    }
+    return 0;
+}
+
+MetricsWriter::MetricsWriter(char *buf, size_t len) : buf(buf), len(len), used(0), overflow(false) {
+    if (len)
+        buf[0] = 0;
+}
+
+void MetricsWriter::append(const char *fmt, ...) {
+    if (overflow)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + used, len - used, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n >= len - used) {
+        // Don't leave half a pair behind.
+        buf[used] = 0;
+        overflow = true;
+        return;
+    }
+    used += n;
+}
+
+void MetricsWriter::value(const char *name, double value) {
+    append("%s%s=%.17g", used ? " " : "", name, value);
+}
+
+void MetricsWriter::histogram(const char *name, const Histogram &h) {
+    // Buckets are cumulative, and as the values are integers, "below 2^i"
+    // is "at most 2^i - 1".
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h.buckets[i].load(std::memory_order_relaxed);
+        append("%s%s_bucket{le=\"%llu\"}=%llu", used ? " " : "", name, (1ull << i) - 1, seen);
+    }
+    seen += h.buckets[HISTOGRAM_BUCKETS - 1].load(std::memory_order_relaxed);
+    append(" %s_bucket{le=\"+Inf\"}=%llu", name, seen);
+    append(" %s_sum=%llu", name, h.sum.load(std::memory_order_relaxed));
+    append(" %s_count=%llu", name, seen);
+}
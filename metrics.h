@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+/* Lock-free counters and histograms kept by the hot paths, for the
+ * `metrics` control command. Updating one is a relaxed atomic add, reading
+ * never blocks the writers. */
+
+#define HISTOGRAM_BUCKETS 20
+
+// Log2 histogram of non-negative integers: bucket i counts values in
+// [2^(i-1), 2^i), bucket 0 counts zeros and the last one takes everything
+// larger. Any thread may update it.
+struct Histogram {
+    std::atomic<unsigned long long> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<unsigned long long> sum;
+
+    void observe(long long value);
+    unsigned long long count() const;
+
+    // Value below which the given fraction of observations fell.
+    unsigned long long percentile(double p) const;
+};
+
+struct Metrics {
+    Histogram capture_callback_us;  // time spent in capture_push()
+    Histogram fragment_bytes;       // what the capture backend pushed at once
+    Histogram timestamp_lead_us;    // packet timestamp minus time sent, 0 if late
+};
+
+extern Metrics metrics;
+
+/* Formats metrics as space separated name=value pairs, with Prometheus
+ * names: counters end in _total, histograms come as name_bucket{le="N"},
+ * name_sum and name_count. */
+class MetricsWriter {
+public:
+    MetricsWriter(char *buf, size_t len);
+
+    void value(const char *name, double value);
+    void histogram(const char *name, const Histogram &h);
+
+    // False if something didn't fit.
+    bool ok() const { return !overflow; }
+
+private:
+    void append(const char *fmt, ...);
+
+    char *buf;
+    size_t len, used;
+    bool overflow;
+};
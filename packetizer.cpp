@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sender.h"
+
+/*********** Benchmark **************/
+#define BENCH_NSEC 200000000LL
+
+static long long bench_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+// Headers as the stream has always sent them, byte for byte.
+static const struct {
+    const char *name;
+    uint32_t counter;
+    long long timestamp;
+    long long position;
+    unsigned char header[HEADER_LEN];
+} golden[] = {
+    {"header", 1234, 12345678901234LL, 3 * 1004, {
+        0x00, 0x00, 0x04, 0xd2,  0x00, 0x00, 0x00, 0x00,  0x01, 0x00, 0x03, 0xf0,
+        0x00, 0x00, 0x30, 0x39,  0x00, 0x0a, 0x5b, 0xf5,  0x00, 0x00, 0x10, 0x96,
+        0x02, 0x10, 0xac, 0x44}},
+    // Everything past 32 bits: counters, seconds and positions wrap.
+    {"wrap", 0xffffffffu, (0x100000005LL) * 1000000000LL + 999999999, 0x1fffffb2eLL, {
+        0xff, 0xff, 0xff, 0xff,  0x00, 0x00, 0x00, 0x00,  0x01, 0x00, 0x03, 0xf0,
+        0x00, 0x00, 0x00, 0x05,  0x00, 0x0f, 0x42, 0x3f,  0x00, 0x00, 0x00, 0x00,
+        0x02, 0x10, 0xac, 0x44}},
+};
+
+// Fragments of these sizes must come out as whole packets in order, with
+// the rest left in the one being assembled.
+static bool check_assembly(int frames) {
+    static const int fragments[] = {4 * 441, 4 * 1, 4 * 1000, 4 * 251, 4 * 250, 4 * 4000};
+    StreamPacketizer p(frames);
+    long long total = 0, packets = 0;
+    for (unsigned i = 0; i < sizeof(fragments) / sizeof(fragments[0]); i++) {
+        int length = fragments[i];
+        total += length;
+        while (length > 0) {
+            int n = length < p.room() ? length : p.room();
+            long long start = p.position();
+            if (p.add(n)) {
+                if (start != packets * p.payload_bytes())
+                    return false;
+                packets++;
+            }
+            length -= n;
+        }
+    }
+    return packets == total / p.payload_bytes() && p.end() == total && p.fill() == total % p.payload_bytes();
+}
+
+int packetizer_benchmark() {
+    char buf[HEADER_LEN];
+    int mismatches = 0;
+
+    printf("Packetizer, %d byte header, %d channels of %d bits at %d Hz\n", StreamPacketizer::HEADER_BYTES,
+           StreamPacketizer::CHANNELS, StreamPacketizer::SAMPLE_BITS, StreamPacketizer::RATE);
+    for (unsigned i = 0; i < sizeof(golden) / sizeof(golden[0]); i++) {
+        StreamPacketizer::write_header(buf, golden[i].counter, golden[i].timestamp, golden[i].position);
+        bool ok = !memcmp(buf, golden[i].header, HEADER_LEN);
+        printf("  golden %-6s %s\n", golden[i].name, ok ? "ok" : "MISMATCH");
+        if (!ok) {
+            mismatches++;
+            printf("    got     ");
+            for (int b = 0; b < HEADER_LEN; b++)
+                printf(" %02x", (unsigned char) buf[b]);
+            printf("\n    expected");
+            for (int b = 0; b < HEADER_LEN; b++)
+                printf(" %02x", golden[i].header[b]);
+            printf("\n");
+        }
+    }
+
+    static const int sizes[] = {32, 251, 1017};
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bool ok = check_assembly(sizes[i]);
+        printf("  assembly %4d frames  %s\n", sizes[i], ok ? "ok" : "MISMATCH");
+        if (!ok)
+            mismatches++;
+    }
+
+    // Headers for consecutive packets, as the sender builds them.
+    long long start = bench_nsec(), now;
+    long long calls = 0;
+    uint32_t counter = 0;
+    long long timestamp = 5000000000LL;
+    // Keeps the compiler from dropping the work.
+    volatile unsigned sink = 0;
+    do {
+        for (int i = 0; i < 1024; i++) {
+            StreamPacketizer::write_header(buf, counter++, timestamp, calls * 1004);
+            timestamp += 5691609;
+            sink += buf[19];
+        }
+        calls += 1024;
+        now = bench_nsec();
+    } while (now - start < BENCH_NSEC);
+    printf("  write_header  %6.1f ns per packet\n", (double) (now - start) / calls);
+
+    // The bookkeeping for a packet assembled from two fragments.
+    StreamPacketizer p(251);
+    start = bench_nsec();
+    calls = 0;
+    do {
+        for (int i = 0; i < 1024; i++) {
+            int n = p.room() / 2;
+            p.add(n);
+            sink += p.add(p.room());
+        }
+        calls += 1024;
+        now = bench_nsec();
+    } while (now - start < BENCH_NSEC);
+    printf("  assembly      %6.1f ns per packet\n", (double) (now - start) / calls);
+    return mismatches;
+}
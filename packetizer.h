@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cuts a PCM stream into packets and writes their headers.
+ *
+ * The header is 28 bytes:
+ *
+ *    0  packet counter, big endian, one per packet
+ *    4  zero
+ *    8  01 00 03 f0
+ *   12  playout time, seconds, big endian
+ *   16  playout time, microseconds within the second, big endian
+ *   20  byte counter: stream position of the payload, big endian
+ *   24  channels, bits per sample
+ *   26  sample rate, big endian
+ *
+ * Everything is stored byte by byte, so the wire format doesn't depend on
+ * the host and nothing is written through unaligned pointers. The counters
+ * and the seconds wrap around modulo 2^32.
+ *
+ * The object tracks the packet being assembled. It doesn't touch the PCM,
+ * whoever fills the payload tells it how many bytes went in, and it never
+ * allocates. */
+
+static inline void store_be16(char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void store_be32(char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint32_t load_be32(const char *p) {
+    const unsigned char *u = (const unsigned char*) p;
+    return (uint32_t) u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+template <typename Sample, int Channels, int Rate>
+class Packetizer {
+public:
+    // Where every field lives.
+    enum {
+        COUNTER_OFFSET = 0,
+        MAGIC_OFFSET = 8,
+        SEC_OFFSET = 12,
+        USEC_OFFSET = 16,
+        POSITION_OFFSET = 20,
+        FORMAT_OFFSET = 24,
+        RATE_OFFSET = 26,
+        HEADER_BYTES = 28,
+    };
+
+    enum {
+        CHANNELS = Channels,
+        SAMPLE_BITS = sizeof(Sample) * 8,
+        FRAME_BYTES = sizeof(Sample) * Channels,
+        RATE = Rate,
+    };
+
+    static_assert(Channels > 0 && Channels < 256, "channel count must fit a byte");
+    static_assert(Rate > 0 && Rate < 65536, "sample rate must fit 16 bits");
+
+    // Byte counters start here rather than at 0, as they always have.
+    static const uint32_t POSITION_BASE = 1234;
+
+    explicit Packetizer(int frames_per_packet) : bytes(frames_per_packet * FRAME_BYTES), fill_(0), position_(0) {}
+
+    // Packet length can change until the first byte is added.
+    void set_frames(int frames_per_packet) { bytes = frames_per_packet * FRAME_BYTES; }
+    int frames() const { return bytes / FRAME_BYTES; }
+    int payload_bytes() const { return bytes; }
+
+    // Payload of the packet being assembled so far, and what it still takes.
+    int fill() const { return fill_; }
+    int room() const { return bytes - fill_; }
+
+    // Stream position of the packet being assembled, and of the next byte.
+    long long position() const { return position_; }
+    long long end() const { return position_ + fill_; }
+
+    // `n` more bytes went into the packet being assembled, at most room().
+    // True if that completed it, position() has then moved on to the next.
+    bool add(int n) {
+        fill_ += n;
+        if (fill_ < bytes)
+            return false;
+        fill_ = 0;
+        position_ += bytes;
+        return true;
+    }
+
+    // `n` bytes of the stream will never be sent. Only between packets.
+    void skip(long long n) { position_ += n; }
+
+    // Drop the packet being assembled, the next one starts where it did.
+    void discard() { fill_ = 0; }
+
+    // Header of a packet to be played at `timestamp` (ns, any clock that
+    // starts near 0) that starts at stream position `position`.
+    static void write_header(char *buf, uint32_t counter, long long timestamp, long long position) {
+        long long sec = timestamp / 1000000000LL;
+        long long usec = timestamp % 1000000000LL / 1000;
+        store_be32(buf + COUNTER_OFFSET, counter);
+        store_be32(buf + COUNTER_OFFSET + 4, 0);
+        buf[MAGIC_OFFSET] = 0x01;
+        buf[MAGIC_OFFSET + 1] = 0x00;
+        buf[MAGIC_OFFSET + 2] = 0x03;
+        buf[MAGIC_OFFSET + 3] = (char) 0xf0;
+        store_be32(buf + SEC_OFFSET, (uint32_t) sec);
+        store_be32(buf + USEC_OFFSET, (uint32_t) usec);
+        store_be32(buf + POSITION_OFFSET, (uint32_t) (POSITION_BASE + position));
+        buf[FORMAT_OFFSET] = CHANNELS;
+        buf[FORMAT_OFFSET + 1] = SAMPLE_BITS;
+        store_be16(buf + RATE_OFFSET, RATE);
+    }
+
+private:
+    int bytes;
+    int fill_;
+    long long position_;
+};
+
+// Time write_header() and the assembly bookkeeping, after checking the
+// header of the stream's format against a packet as it has always been
+// sent, and print the results. Returns how many checks failed.
+int packetizer_benchmark();
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <mutex>
+#include <thread>
+
+#include "probe.h"
+#include "sender.h"
+
+static const long long e9 = 1000000000LL;
+
+static int sock = -1;
+static long long launch_lead;
+
+static std::mutex lock;
+static struct {
+    unsigned long long packets;
+    long long last_arrival;
+
+    // Time between consecutive arrivals.
+    unsigned long long intervals;
+    double interval_sum, interval_sq_sum, interval_max;
+
+    // Arrival minus launch time.
+    double error_sum, error_sq_sum, error_min, error_max;
+} stats;
+
+static long long clock_nsec(clockid_t clock) {
+    timespec tm;
+    clock_gettime(clock, &tm);
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
+
+static void probe_thread_main() {
+    char buf[HEADER_LEN + PAYLOAD_MAX];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+
+    // Kernel timestamps are on CLOCK_REALTIME, packet timestamps on
+    // CLOCK_MONOTONIC. A bench is short enough for the offset to hold.
+    long long realtime_offset = clock_nsec(CLOCK_REALTIME) - clock_nsec(CLOCK_MONOTONIC);
+
+    while (1) {
+        struct iovec iov = {buf, sizeof(buf)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        int n = recvmsg(sock, &msg, 0);
+        if (n < HEADER_LEN)
+            continue;
+
+        long long arrival = 0;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                arrival = ts.tv_sec * e9 + ts.tv_nsec - realtime_offset;
+            }
+        if (!arrival)
+            arrival = clock_nsec(CLOCK_MONOTONIC);
+
+        long long sec = ntohl(*(unsigned int*) (buf+12));
+        long long usec = ntohl(*(unsigned int*) (buf+16));
+        double error = (arrival - (sec * e9 + usec * 1000 - launch_lead)) / 1000.0;
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (stats.packets++) {
+            double interval = (arrival - stats.last_arrival) / 1000.0;
+            stats.intervals++;
+            stats.interval_sum += interval;
+            stats.interval_sq_sum += interval * interval;
+            if (interval > stats.interval_max)
+                stats.interval_max = interval;
+            if (error < stats.error_min)
+                stats.error_min = error;
+            if (error > stats.error_max)
+                stats.error_max = error;
+        } else
+            stats.error_min = stats.error_max = error;
+        stats.error_sum += error;
+        stats.error_sq_sum += error * error;
+        stats.last_arrival = arrival;
+    }
+}
+
+bool wire_probe_start(const struct sockaddr_in &dest, long long lead) {
+    bool multicast = IN_MULTICAST(ntohl(dest.sin_addr.s_addr));
+    bool loopback = (ntohl(dest.sin_addr.s_addr) >> 24) == 127;
+    if (!multicast && !loopback)
+        return false;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+    struct sockaddr_in local = dest;
+    if (multicast)
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*) &local, sizeof(local)) < 0) {
+        perror("bind probe");
+        close(sock);
+        return false;
+    }
+    if (multicast) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = dest.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            perror("probe IP_ADD_MEMBERSHIP");
+            close(sock);
+            return false;
+        }
+    }
+
+    launch_lead = lead;
+    std::thread t(probe_thread_main);
+    t.detach();
+    return true;
+}
+
+void wire_probe_report(double nominal_interval_us) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (stats.intervals == 0) {
+        printf("  nothing received back on the wire\n");
+        return;
+    }
+
+    double n = stats.intervals;
+    double mean = stats.interval_sum / n;
+    double var = stats.interval_sq_sum / n - mean * mean;
+    printf("  %llu packets received back, interval %.1f us mean, %.1f us jitter (stddev), %.0f us max (nominal %.1f us)\n",
+           stats.packets, mean, var > 0 ? sqrt(var) : 0, stats.interval_max, nominal_interval_us);
+
+    n = stats.packets;
+    mean = stats.error_sum / n;
+    var = stats.error_sq_sum / n - mean * mean;
+    printf("  arrival vs launch time: %.1f us mean, %.1f us stddev, %.0f..%.0f us\n",
+           mean, var > 0 ? sqrt(var) : 0, stats.error_min, stats.error_max);
+}
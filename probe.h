@@ -0,0 +1,16 @@
+#pragma once
+
+#include <netinet/in.h>
+
+/* Receives our own packets during --bench when they're sent somewhere
+ * local (loopback, or multicast looped back), to measure what the pacing
+ * achieves on the wire rather than in the sender: the spacing of arrivals,
+ * and how far each one is from its launch time. Arrival times are the
+ * kernel's (SO_TIMESTAMPNS). */
+
+// Start receiving on `dest`. Launch times are `launch_lead` ns before the
+// packets' playout time. False if `dest` can't be received here.
+bool wire_probe_start(const struct sockaddr_in &dest, long long launch_lead);
+
+// Print what was measured so far.
+void wire_probe_report(double nominal_interval_us);
@@ -1,10 +1,20 @@
+#ifdef HAVE_DBUS
 #include "rtkit.h"
+#endif
 #include <string.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #ifdef HAVE_SCHED_H
 #include <sched.h>
@@ -14,105 +24,260 @@
 #endif
 #endif
 
-static int set_scheduler(int rtprio) {
+#include "realtime.h"
+
+// How much of every realtime thread's stack is faulted in up front.
+#define PREFAULT_STACK_BYTES (256 * 1024)
+
+static const char *thread_names[RT_THREADS] = {"capture", "sender", "SNTP"};
+
 #ifdef HAVE_SCHED_H
-    struct sched_param sp;
-#ifdef HAVE_DBUS
-    int r;
-    long long rttime;
-#ifdef RLIMIT_RTTIME
-    struct rlimit rl;
+// CPUs each kind of thread is pinned to, if it is. Unpinned threads get
+// back whatever the process was started with, rather than inheriting the
+// capture thread's CPUs from the mainloop that spawned them.
+static cpu_set_t thread_cpus[RT_THREADS];
+static bool thread_pinned[RT_THREADS];
+static cpu_set_t process_cpus;
+static bool process_cpus_known = false;
 #endif
-    DBusError error;
-    DBusConnection *bus;
 
-    dbus_error_init(&error);
+#ifdef HAVE_DBUS
+/* One connection to RealtimeKit, opened by realtime_init() and shared by
+ * all threads asking it for realtime scheduling. */
+static DBusConnection *rtkit_bus = NULL;
+static int rtkit_max_priority = 0;
+static std::mutex rtkit_lock;
 #endif
 
-    memset(&sp, 0, sizeof(sp));
-    sp.sched_priority = rtprio;
+bool realtime_set_cpus(RtThread thread, const char *list) {
+#ifdef HAVE_SCHED_H
+    cpu_set_t set;
+    CPU_ZERO(&set);
 
-#ifdef SCHED_RESET_ON_FORK
-    if (pthread_setschedparam(pthread_self(), SCHED_RR|SCHED_RESET_ON_FORK, &sp) == 0) {
-        printf("SCHED_RR|SCHED_RESET_ON_FORK worked.\n");
-        return 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p)
+            return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &set);
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return false;
+        p = end;
     }
+    // Only CPUs we may run on.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        CPU_AND(&set, &set, &allowed);
+    if (!CPU_COUNT(&set))
+        return false;
+
+    thread_cpus[thread] = set;
+    thread_pinned[thread] = true;
+    return true;
+#else
+    return false;
 #endif
+}
 
-    if (pthread_setschedparam(pthread_self(), SCHED_RR, &sp) == 0) {
-        printf("SCHED_RR worked.\n");
-        return 0;
-    }
-#endif  /* HAVE_SCHED_H */
+void realtime_init() {
+#ifdef HAVE_SCHED_H
+    process_cpus_known = sched_getaffinity(0, sizeof(process_cpus), &process_cpus) == 0;
+#endif
 
 #ifdef HAVE_DBUS
-    /* Try to talk to RealtimeKit */
+    DBusError error;
+    dbus_error_init(&error);
 
-    if (!(bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error))) {
+    if (!(rtkit_bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error))) {
         printf("Failed to connect to system bus: %s\n", error.message);
         dbus_error_free(&error);
-        errno = -EIO;
-        return -1;
+        return;
     }
 
     /* We need to disable exit on disconnect because otherwise
      * dbus_shutdown will kill us. See
      * https://bugs.freedesktop.org/show_bug.cgi?id=16924 */
-    dbus_connection_set_exit_on_disconnect(bus, FALSE);
+    dbus_connection_set_exit_on_disconnect(rtkit_bus, FALSE);
+
+    long long rttime = rtkit_get_rttime_usec_max(rtkit_bus);
+    rtkit_max_priority = rtkit_get_max_realtime_priority(rtkit_bus);
+    if (rttime < 0 || rtkit_max_priority <= 0) {
+        // No RealtimeKit on this system, don't ask it again for every thread.
+        dbus_connection_close(rtkit_bus);
+        dbus_connection_unref(rtkit_bus);
+        rtkit_bus = NULL;
+        return;
+    }
 
-    rttime = rtkit_get_rttime_usec_max(bus);
-    if (rttime >= 0) {
 #ifdef RLIMIT_RTTIME
-        r = getrlimit(RLIMIT_RTTIME, &rl);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_RTTIME, &rl) == 0 && rl.rlim_max > (rlim_t) rttime) {
+        printf("Clamping rlimit-rttime to %lld for RealtimeKit\n", rttime);
+        rl.rlim_cur = rl.rlim_max = rttime;
+        if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+            printf("setrlimit() failed: %s\n", strerror(errno));
+    }
+#endif
+#endif
+}
 
-        if (rl.rlim_max > (rlim_t) rttime) {
-            printf("Clamping rlimit-rttime to %lld for RealtimeKit\n", rttime);
-            rl.rlim_cur = rl.rlim_max = rttime;
-            r = setrlimit(RLIMIT_RTTIME, &rl);
+#ifdef HAVE_SCHED_H
+static bool set_scheduler(int rtprio) {
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = rtprio;
 
-            if (r < 0)
-                printf("setrlimit() failed: %s\n", strerror(errno));
-        }
+#ifdef SCHED_RESET_ON_FORK
+    if (pthread_setschedparam(pthread_self(), SCHED_RR|SCHED_RESET_ON_FORK, &sp) == 0)
+        return true;
+#endif
+    return pthread_setschedparam(pthread_self(), SCHED_RR, &sp) == 0;
+}
 #endif
-        r = rtkit_make_realtime(bus, 0, rtprio);
-        dbus_connection_close(bus);
-        dbus_connection_unref(bus);
 
-        if (r >= 0) {
-            printf("RealtimeKit worked.\n");
-            return 0;
-        }
-        printf("RealtimeKit error %i.\n", r);
+// Returns the priority that was granted, or -1.
+static int acquire_priority(int rtprio) {
+#ifdef HAVE_SCHED_H
+    if (set_scheduler(rtprio))
+        return rtprio;
 
+    // Unprivileged, but maybe allowed some priority by RLIMIT_RTPRIO.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur > 0 && (int) rl.rlim_cur < rtprio &&
+        set_scheduler(rl.rlim_cur))
+        return rl.rlim_cur;
+#endif
+
+#ifdef HAVE_DBUS
+    std::lock_guard<std::mutex> guard(rtkit_lock);
+    if (rtkit_bus) {
+        int prio = std::min(rtprio, rtkit_max_priority);
+        int r = rtkit_make_realtime(rtkit_bus, 0, prio);
+        if (r >= 0)
+            return prio;
         errno = -r;
-    } else {
-        dbus_connection_close(bus);
-        dbus_connection_unref(bus);
-        errno = -rttime;
     }
 #endif
     return -1;
 }
 
+static void __attribute__((noinline)) prefault_stack() {
+    volatile char stack[PREFAULT_STACK_BYTES];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
 
 /* Make the current thread a realtime thread, and acquire the highest
- * rtprio we can get that is less or equal the specified parameter. If
- * the thread is already realtime, don't do anything. */
-int make_realtime(int rtprio) {
-    int p;
-
-    if (set_scheduler(rtprio) >= 0) {
-        printf("Successfully enabled SCHED_RR scheduling for thread, with priority %i.\n", rtprio);
-        return 0;
+ * rtprio we can get that is less or equal the specified parameter. */
+int make_realtime(RtThread thread, int rtprio) {
+#ifdef HAVE_SCHED_H
+    if (thread_pinned[thread] || process_cpus_known) {
+        cpu_set_t *set = thread_pinned[thread] ? &thread_cpus[thread] : &process_cpus;
+        int r = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+        if (r != 0)
+            printf("Can't pin the %s thread: %s\n", thread_names[thread], strerror(r));
+    }
+#endif
+    prefault_stack();
+
+    int prio = acquire_priority(rtprio);
+    if (prio < 0) {
+        printf("Failed to acquire real-time scheduling for the %s thread: %s\n", thread_names[thread], strerror(errno));
+        printf("This is fine, but audio may stutter if you have high CPU usage\n");
+        return -1;
     }
+    if (prio < rtprio)
+        printf("Successfully enabled SCHED_RR scheduling for the %s thread, with priority %i, which is lower than the requested %i.\n",
+               thread_names[thread], prio, rtprio);
+    else
+        printf("Successfully enabled SCHED_RR scheduling for the %s thread, with priority %i.\n", thread_names[thread], prio);
+    return 0;
+}
 
-    for (p = rtprio-1; p >= 1; p--)
-        if (set_scheduler(p) >= 0) {
-            printf("Successfully enabled SCHED_RR scheduling for thread, with priority %i, which is lower than the requested %i.\n", p, rtprio);
-            return 0;
+void realtime_prefault(void *p, size_t len) {
+    volatile char *c = (volatile char*) p;
+    long page = sysconf(_SC_PAGESIZE);
+    // Write, or the page is just mapped to the shared zero page.
+    for (size_t i = 0; i < len; i += page)
+        c[i] = c[i];
+    if (len)
+        c[len - 1] = c[len - 1];
+}
+
+void realtime_lock_memory() {
+    // Locking what's mapped later too means every thread stack and buffer
+    // allocated afterwards counts against RLIMIT_MEMLOCK, and gets refused
+    // past it. Only do that when there's no limit to run into.
+    struct rlimit rl;
+    bool unlimited = geteuid() == 0 ||
+        (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur == RLIM_INFINITY);
+    int flags = MCL_CURRENT | (unlimited ? MCL_FUTURE : 0);
+
+    // Lock pages as they're faulted in rather than all of every mapping
+    // right away, which would pull in megabytes of untouched thread stacks.
+    // What the realtime path uses has been prefaulted.
+    int r = -1;
+#ifdef MCL_ONFAULT
+    r = mlockall(flags | MCL_ONFAULT);
+#endif
+    if (r < 0)
+        r = mlockall(flags);
+    if (r < 0) {
+        printf("mlockall() failed: %s. Raise the memlock limit (ulimit -l) to keep page faults off the audio path\n",
+               strerror(errno));
+        return;
+    }
+    printf("Memory locked%s\n", unlimited ? ", including future allocations" : "");
+}
+
+static void latency_thread_main(RtThread thread, int rtprio, long long interval, std::vector<long long> *samples) {
+    make_realtime(thread, rtprio);
+    realtime_prefault(samples->data(), samples->capacity() * sizeof(long long));
+
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (samples->size() < samples->capacity()) {
+        next.tv_nsec += interval;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
         }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0)
+            ;
 
-    printf("Failed to acquire real-time scheduling: %s\n", strerror(errno));
-    printf("This is fine, but audio may stutter if you have high CPU usage\n");
-    return -1;
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        samples->push_back((now.tv_sec - next.tv_sec) * 1000000000LL + now.tv_nsec - next.tv_nsec);
+    }
+}
+
+bool realtime_latency_test(RtThread thread, int rtprio, int seconds, int interval_us, LatencyTest *result) {
+    std::vector<long long> samples;
+    samples.reserve((long long) seconds * 1000000 / interval_us);
+    if (!samples.capacity())
+        return false;
+
+    std::thread t(latency_thread_main, thread, rtprio, interval_us * 1000LL, &samples);
+    t.join();
+
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    result->samples = n;
+    result->p50_us = samples[n / 2] / 1000.0;
+    result->p99_us = samples[n * 99 / 100] / 1000.0;
+    result->p999_us = samples[n * 999 / 1000] / 1000.0;
+    result->max_us = samples[n - 1] / 1000.0;
+    return true;
 }
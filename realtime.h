@@ -1 +1,42 @@
-int make_realtime(int rtprio);
+#pragma once
+
+#include <stddef.h>
+
+/* Realtime setup for the threads on the audio path: scheduling (directly
+ * or through RealtimeKit), CPU placement and locked memory. */
+
+// Threads that can be given CPUs of their own.
+enum RtThread {
+    RT_CAPTURE,  // the mainloop, where capture and packetization run
+    RT_SENDER,
+    RT_SNTP,     // the SNTP shards and the repair server
+    RT_THREADS
+};
+
+// Parse a CPU list like taskset takes ("2", "0-1,4") as the CPUs `thread`
+// runs on. False if it isn't one.
+bool realtime_set_cpus(RtThread thread, const char *list);
+
+// Look up what RealtimeKit allows, once. Call before starting any thread.
+void realtime_init();
+
+// Make the calling thread a realtime thread of the given kind, at the
+// highest priority up to `rtprio` it can get, and move it to its CPUs.
+int make_realtime(RtThread thread, int rtprio);
+
+// Fault in `len` bytes at `p` now, so the realtime threads never take a
+// page fault on them.
+void realtime_prefault(void *p, size_t len);
+
+// Lock everything mapped so far, and what gets faulted in later, into
+// memory. Call once the threads and buffers are set up.
+void realtime_lock_memory();
+
+// Wakeup latency of a realtime thread of the given kind, measured like
+// cyclictest does: sleep until an absolute deadline every `interval_us`
+// for `seconds` and see how late it wakes up.
+struct LatencyTest {
+    unsigned samples;
+    double p50_us, p99_us, p999_us, max_us;
+};
+bool realtime_latency_test(RtThread thread, int rtprio, int seconds, int interval_us, LatencyTest *result);
@@ -0,0 +1,555 @@
+/* Emulates a speaker receiving the stream, to benchmark latency profiles
+ * and send path changes on one machine:
+ *
+ *     ./stream --source=sine &
+ *     ./receiver --duration=30
+ *
+ * It keeps its clock in sync with stream's SNTP server the way a speaker
+ * does, joins the multicast group, asks for repairs of missing packets,
+ * and plays every packet out at its timestamp through a simulated buffer.
+ * At the end it reports how many packets missed their playout deadline,
+ * how many were lost, and where the latency went.
+ *
+ * With --drop=PERCENT it throws away a share of the group's packets as if
+ * they'd been lost on the way, to see repairs at work, and checks that
+ * every repair is a byte-for-byte copy of the packet it stands in for. */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "repair.h"
+#include "sender.h"
+
+#define SNTP_PORT 12300
+#define UNIX_TO_NTP_OFFSET 2208988800LL
+
+// SNTP exchanges kept for picking the least delayed one, and how often one
+// is made once synced.
+#define SNTP_SAMPLES 8
+#define SNTP_INTERVAL_NSEC 1000000000LL
+#define SNTP_INITIAL 4
+
+#define REPORT_INTERVAL_NSEC (5 * 1000000000LL)
+
+// Bigger counter jumps are a restarted transmission rather than loss.
+#define MAX_GAP_PACKETS 256
+
+// A packet is still counted as late, rather than lost, if it turns up
+// within this many packet periods after its deadline.
+#define LATE_PERIODS 2
+
+static const long long e9 = 1000000000LL;
+
+static long long now_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
+
+static void die(const char *s) {
+    perror(s);
+    exit(1);
+}
+
+static bool parse_addr(const char *s, struct sockaddr_in *addr, int default_port) {
+    char ip[64];
+    const char *colon = strchr(s, ':');
+    size_t len = colon ? (size_t) (colon - s) : strlen(s);
+    if (len >= sizeof(ip))
+        return false;
+    memcpy(ip, s, len);
+    ip[len] = 0;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(colon ? atoi(colon + 1) : default_port);
+    return inet_aton(ip, &addr->sin_addr) != 0;
+}
+
+/*********** Clock sync **************/
+/* Same exchange as a speaker makes with sntp.cpp: a 48 byte SNTP request
+ * carrying our transmit time, answered with the server's receive and
+ * transmit times. The server's clock is its CLOCK_MONOTONIC, which the
+ * packet timestamps are on as well. */
+struct SntpSample {
+    long long offset;  // server clock minus ours, ns
+    long long delay;   // round trip minus server time, ns
+};
+
+static int sntp_sock;
+static struct sockaddr_in sntp_server;
+static SntpSample sntp_samples[SNTP_SAMPLES];
+static unsigned sntp_count = 0;
+static long long clock_offset = 0;
+static long long clock_delay = 0;
+
+static unsigned long long ntp_from_nsec(long long ns) {
+    unsigned long long sec = ns / e9 + UNIX_TO_NTP_OFFSET;
+    unsigned long long frac = ((unsigned long long) (ns % e9) << 32) / e9;
+    return sec << 32 | frac;
+}
+
+static long long nsec_from_ntp(unsigned long long t) {
+    long long sec = (long long) (t >> 32) - UNIX_TO_NTP_OFFSET;
+    return sec * e9 + (long long) (((t & 0xffffffffULL) * e9) >> 32);
+}
+
+static unsigned long long load_be64(const unsigned char *p) {
+    unsigned long long v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static void store_be64(unsigned char *p, unsigned long long v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static void sntp_request() {
+    unsigned char req[48];
+    memset(req, 0, sizeof(req));
+    req[0] = 0x1b;  // version 3, client
+    store_be64(req + 40, ntp_from_nsec(now_nsec()));
+    if (sendto(sntp_sock, req, sizeof(req), 0, (struct sockaddr*) &sntp_server, sizeof(sntp_server)) < 0)
+        perror("sendto SNTP");
+}
+
+static void sntp_reply() {
+    unsigned char rep[48];
+    int n = recv(sntp_sock, rep, sizeof(rep), 0);
+    long long t4 = now_nsec();
+    if (n < (int) sizeof(rep))
+        return;
+
+    long long t1 = nsec_from_ntp(load_be64(rep + 24));
+    long long t2 = nsec_from_ntp(load_be64(rep + 32));
+    long long t3 = nsec_from_ntp(load_be64(rep + 40));
+
+    SntpSample s;
+    s.offset = ((t2 - t1) + (t3 - t4)) / 2;
+    s.delay = (t4 - t1) - (t3 - t2);
+    sntp_samples[sntp_count++ % SNTP_SAMPLES] = s;
+
+    // The exchange that took the least time has the least asymmetry.
+    unsigned n_samples = std::min(sntp_count, (unsigned) SNTP_SAMPLES);
+    SntpSample best = sntp_samples[0];
+    for (unsigned i = 1; i < n_samples; i++)
+        if (sntp_samples[i].delay < best.delay)
+            best = sntp_samples[i];
+    clock_offset = best.offset;
+    clock_delay = best.delay;
+}
+
+/*********** Playout **************/
+struct Slot {
+    long long playout;   // on our clock
+    long long deadline;  // playout minus the device margin
+    long long arrival;   // 0 until it arrived
+    bool repaired;
+    bool requested;
+};
+
+// Packets not yet played out, by packet_counter.
+static std::map<unsigned, Slot> pending;
+static bool have_last = false;
+static unsigned last_counter;
+static long long period = 0;  // playout time per packet, learned from the payload size
+
+static long long deadline_margin = 2000000;
+static long long buffer_capacity = 200000000;
+static long long playout_offset = 35000000;
+
+static struct {
+    unsigned long long received, duplicates, on_time, late, lost, repaired, overflows, stale;
+    unsigned long long dropped, repairs_checked, repairs_differing;
+    std::vector<double> headroom_us, transit_us;
+    long long max_depth;
+} stats;
+
+// What stats looked like at the last periodic report.
+static unsigned long long last_on_time, last_late, last_lost;
+
+static int repair_sock;
+static struct sockaddr_in repair_server;
+static bool repair = true;
+
+// Share of group packets dropped on purpose (--drop), and what they held,
+// by packet_counter, until their repair comes in or they're played out.
+static double drop_rate = 0;
+static uint32_t drop_rnd = 0x2545f491;
+static std::map<unsigned, std::vector<unsigned char> > dropped;
+
+static bool drop(const unsigned char *buf, int len) {
+    if (drop_rate <= 0 || len < HEADER_LEN)
+        return false;
+    drop_rnd ^= drop_rnd << 13;
+    drop_rnd ^= drop_rnd >> 17;
+    drop_rnd ^= drop_rnd << 5;
+    if (drop_rnd >= drop_rate * 4294967296.0)
+        return false;
+    unsigned counter = ntohl(*(unsigned*) (buf+0));
+    dropped[counter].assign(buf, buf + len);
+    stats.dropped++;
+    return true;
+}
+
+// A repair of a packet we dropped must be that very packet.
+static void check_repair(const unsigned char *buf, int len) {
+    if (len < HEADER_LEN)
+        return;
+    auto it = dropped.find(ntohl(*(unsigned*) (buf+0)));
+    if (it == dropped.end())
+        return;
+    stats.repairs_checked++;
+    if (it->second.size() != (size_t) len || memcmp(it->second.data(), buf, len)) {
+        if (!stats.repairs_differing)
+            printf("Repair of packet %u differs from what was sent\n", it->first);
+        stats.repairs_differing++;
+    }
+    dropped.erase(it);
+}
+
+static void request_repairs(const std::vector<unsigned> &missing) {
+    if (!repair || missing.empty() || !repair_server.sin_addr.s_addr)
+        return;
+    for (size_t i = 0; i < missing.size(); i += REPAIR_MAX_PER_REQUEST) {
+        unsigned req[REPAIR_MAX_PER_REQUEST];
+        size_t n = std::min(missing.size() - i, (size_t) REPAIR_MAX_PER_REQUEST);
+        for (size_t j = 0; j < n; j++)
+            req[j] = htonl(missing[i + j]);
+        sendto(repair_sock, req, n * 4, 0, (struct sockaddr*) &repair_server, sizeof(repair_server));
+    }
+}
+
+// A packet came in, from the group or as a repair.
+static void packet_arrived(const unsigned char *buf, int len, long long arrival, bool repaired) {
+    if (len < HEADER_LEN)
+        return;
+    unsigned counter = ntohl(*(unsigned*) (buf+0));
+    long long sec = ntohl(*(unsigned*) (buf+12));
+    long long usec = ntohl(*(unsigned*) (buf+16));
+    long long playout = sec * e9 + usec * 1000 - clock_offset;
+    int rate = ntohs(*(unsigned short*) (buf+26));
+    if (rate > 0)
+        period = (long long) (len - HEADER_LEN) * e9 / (rate * FRAME_SIZE);
+
+    stats.transit_us.push_back((arrival - (playout - playout_offset)) / 1000.0);
+
+    auto it = pending.find(counter);
+    if (it == pending.end()) {
+        if (have_last && (int) (counter - last_counter) <= 0) {
+            // Already played out, or given up on.
+            stats.stale++;
+            return;
+        }
+
+        // Anything between the last one and this one is missing so far.
+        // It'd have been played out at regular intervals in between.
+        std::vector<unsigned> missing;
+        if (have_last && counter - last_counter <= MAX_GAP_PACKETS) {
+            for (unsigned c = last_counter + 1; c != counter; c++) {
+                Slot s = {0, 0, 0, false, true};
+                s.playout = playout - (long long) (counter - c) * period;
+                s.deadline = s.playout - deadline_margin;
+                pending[c] = s;
+                missing.push_back(c);
+            }
+        }
+        request_repairs(missing);
+
+        Slot s = {playout, playout - deadline_margin, 0, false, false};
+        it = pending.insert(std::make_pair(counter, s)).first;
+        have_last = true;
+        last_counter = counter;
+    }
+
+    Slot &s = it->second;
+    if (s.arrival) {
+        stats.duplicates++;
+        return;
+    }
+    s.arrival = arrival;
+    s.repaired = repaired;
+    stats.received++;
+
+    // How much of the buffer this packet would take up, from now to its
+    // playout time, on top of what's already there.
+    long long depth = playout - arrival;
+    if (depth > buffer_capacity)
+        stats.overflows++;
+    if (depth > stats.max_depth)
+        stats.max_depth = depth;
+}
+
+// Play out everything whose deadline has passed. Slots are kept a little
+// longer so that late packets are told apart from lost ones.
+static void play_out(long long now) {
+    while (!pending.empty()) {
+        auto it = pending.begin();
+        Slot &s = it->second;
+        if (s.deadline + LATE_PERIODS * period > now)
+            break;
+
+        if (!s.arrival)
+            stats.lost++;
+        else if (s.arrival > s.deadline)
+            stats.late++;
+        else {
+            stats.on_time++;
+            if (s.repaired)
+                stats.repaired++;
+            stats.headroom_us.push_back((s.deadline - s.arrival) / 1000.0);
+        }
+        dropped.erase(it->first);
+        pending.erase(it);
+    }
+}
+
+/*********** Reporting **************/
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (p * (v.size() - 1) + 0.5)];
+}
+
+static void report(bool final) {
+    if (!final) {
+        printf("%llu on time, %llu late, %llu lost in the last %lld s; clock offset %+.3f ms, delay %.0f us\n",
+               stats.on_time - last_on_time, stats.late - last_late, stats.lost - last_lost,
+               REPORT_INTERVAL_NSEC / e9, clock_offset / 1e6, clock_delay / 1e3);
+        last_on_time = stats.on_time;
+        last_late = stats.late;
+        last_lost = stats.lost;
+        return;
+    }
+
+    unsigned long long played = stats.on_time + stats.late + stats.lost;
+    printf("\nPlayout\n");
+    printf("  %llu packets due, %llu on time (%llu of them repaired), %llu late, %llu lost\n",
+           played, stats.on_time, stats.repaired, stats.late, stats.lost);
+    if (played)
+        printf("  %.3f%% missed their deadline (%.1f ms before playout)\n",
+               100.0 * (stats.late + stats.lost) / played, deadline_margin / 1e6);
+    printf("  %llu duplicates, %llu after they were played out\n", stats.duplicates, stats.stale);
+    if (drop_rate > 0)
+        printf("  %llu dropped on purpose, %llu repairs of them checked, %llu not identical to the original\n",
+               stats.dropped, stats.repairs_checked, stats.repairs_differing);
+
+    printf("\nLatency (playout offset %.0f ms)\n", playout_offset / 1e6);
+    printf("  capture to arrival: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           percentile(stats.transit_us, 0.5) / 1e3, percentile(stats.transit_us, 0.99) / 1e3,
+           percentile(stats.transit_us, 1) / 1e3);
+    printf("  headroom before the deadline: min %.2f ms, p1 %.2f ms, p50 %.2f ms\n",
+           percentile(stats.headroom_us, 0) / 1e3, percentile(stats.headroom_us, 0.01) / 1e3,
+           percentile(stats.headroom_us, 0.5) / 1e3);
+
+    printf("\nBuffer\n");
+    printf("  up to %.1f ms ahead of playout, %llu packets arrived beyond the %.0f ms capacity\n",
+           stats.max_depth / 1e6, stats.overflows, buffer_capacity / 1e6);
+    printf("\nClock: offset %+.3f ms to the server, %.0f us round trip, %u SNTP exchanges\n",
+           clock_offset / 1e6, clock_delay / 1e3, sntp_count);
+}
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int) {
+    stop = 1;
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [options]\n"
+           "  --group=IP:PORT          multicast group to join (default 225.238.76.46:6982)\n"
+           "  --server=IP              where stream runs, for SNTP and repairs (default 127.0.0.1)\n"
+           "  --playout-offset=MS      stream's playout offset, to split up latency (default 35)\n"
+           "  --deadline-margin=MS     how long before playout a packet must be in (default 2)\n"
+           "  --buffer=MS              playout buffer size (default 200)\n"
+           "  --no-repair              don't ask for missing packets\n"
+           "  --drop=PERCENT           drop this share of the group's packets, to exercise repairs\n"
+           "  --duration=SECONDS       stop after this long, otherwise on Ctrl-C\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in group;
+    parse_addr("225.238.76.46:6982", &group, 6982);
+    parse_addr("127.0.0.1", &sntp_server, SNTP_PORT);
+    int duration = 0;
+
+    static struct option long_options[] = {
+        {"group", required_argument, NULL, 'g'},
+        {"server", required_argument, NULL, 's'},
+        {"playout-offset", required_argument, NULL, 'o'},
+        {"deadline-margin", required_argument, NULL, 'm'},
+        {"buffer", required_argument, NULL, 'b'},
+        {"no-repair", no_argument, NULL, 'n'},
+        {"drop", required_argument, NULL, 'D'},
+        {"duration", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'g':
+                if (!parse_addr(optarg, &group, 6982)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (!parse_addr(optarg, &sntp_server, SNTP_PORT)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'o':
+                playout_offset = atof(optarg) * 1e6;
+                break;
+            case 'm':
+                deadline_margin = atof(optarg) * 1e6;
+                break;
+            case 'b':
+                buffer_capacity = atof(optarg) * 1e6;
+                break;
+            case 'n':
+                repair = false;
+                break;
+            case 'D':
+                drop_rate = atof(optarg) / 100;
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if ((sntp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        (repair_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        die("socket");
+    repair_server = sntp_server;
+    repair_server.sin_port = htons(REPAIR_PORT_1);
+
+    // Sync before listening, packets are no use without a clock.
+    printf("Syncing with %s:%d\n", inet_ntoa(sntp_server.sin_addr), SNTP_PORT);
+    for (int i = 0; i < 50 && sntp_count < SNTP_INITIAL; i++) {
+        sntp_request();
+        struct pollfd p = {sntp_sock, POLLIN, 0};
+        if (poll(&p, 1, 100) > 0)
+            sntp_reply();
+    }
+    if (sntp_count == 0) {
+        printf("No SNTP reply, is stream running?\n");
+        return 1;
+    }
+    printf("Clock offset %+.3f ms, %.0f us round trip\n", clock_offset / 1e6, clock_delay / 1e3);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        die("socket");
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    setsockopt(repair_sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    struct sockaddr_in local = group;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*) &local, sizeof(local)) < 0)
+        die("bind");
+    if (IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = group.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            die("IP_ADD_MEMBERSHIP");
+    }
+    printf("Listening on %s:%d\n", inet_ntoa(group.sin_addr), ntohs(group.sin_port));
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    // Kernel arrival times are on CLOCK_REALTIME.
+    timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    long long realtime_offset = rt.tv_sec * e9 + rt.tv_nsec - now_nsec();
+
+    long long start = now_nsec();
+    long long next_sntp = start + SNTP_INTERVAL_NSEC;
+    long long next_report = start + REPORT_INTERVAL_NSEC;
+
+    while (!stop) {
+        long long now = now_nsec();
+        if (duration && now - start >= duration * e9)
+            break;
+        if (now >= next_sntp) {
+            sntp_request();
+            next_sntp += SNTP_INTERVAL_NSEC;
+        }
+        if (now >= next_report) {
+            report(false);
+            next_report += REPORT_INTERVAL_NSEC;
+        }
+
+        struct pollfd fds[3] = {{sock, POLLIN, 0}, {repair_sock, POLLIN, 0}, {sntp_sock, POLLIN, 0}};
+        int r = poll(fds, 3, 1);
+        if (r < 0 && errno != EINTR)
+            die("poll");
+
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            unsigned char buf[HEADER_LEN + PAYLOAD_MAX];
+            char control[CMSG_SPACE(sizeof(timespec))];
+            struct sockaddr_in from;
+            struct iovec iov = {buf, sizeof(buf)};
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &from;
+            msg.msg_namelen = sizeof(from);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            int n = recvmsg(fds[i].fd, &msg, 0);
+            if (n < 0)
+                continue;
+            if (i == 0 && drop(buf, n))
+                continue;
+            if (i == 1)
+                check_repair(buf, n);
+
+            long long arrival = 0;
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+                if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                    timespec ts;
+                    memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+                    arrival = ts.tv_sec * e9 + ts.tv_nsec - realtime_offset;
+                }
+            packet_arrived(buf, n, arrival ? arrival : now_nsec(), i == 1);
+        }
+        if (fds[2].revents & POLLIN)
+            sntp_reply();
+
+        play_out(now_nsec());
+    }
+
+    play_out(now_nsec());
+    report(true);
+    return stats.repairs_differing ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
+
+#include "realtime.h"
+#include "recorder.h"
+#include "ringbuffer.h"
+#include "sender.h"
+
+// Half a minute of packets at the default packet size.
+typedef SpscRing<PacketRecord, 8192> RecordRing;
+
+// How often the writer drains the ring into the file.
+#define WRITE_INTERVAL_NSEC 100000000
+
+std::atomic<unsigned long long> recorder_dropped(0);
+
+static RecordRing ring;
+static FILE *file = NULL;
+
+void recorder_log(const char *header, long long send_nsec, int destinations, int sent) {
+    if (!file)
+        return;
+
+    PacketRecord *r = ring.write_slot();
+    if (!r) {
+        recorder_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    r->packet_counter = load_be32(header + StreamPacketizer::COUNTER_OFFSET);
+    r->sec = load_be32(header + StreamPacketizer::SEC_OFFSET);
+    r->usec = load_be32(header + StreamPacketizer::USEC_OFFSET);
+    r->byte_counter = load_be32(header + StreamPacketizer::POSITION_OFFSET);
+    r->send_nsec = send_nsec;
+    r->destinations = destinations;
+    r->sent = sent;
+    r->reserved = 0;
+    ring.push();
+}
+
+static void writer_thread_main() {
+    timespec interval = {0, WRITE_INTERVAL_NSEC};
+
+    while (1) {
+        nanosleep(&interval, NULL);
+
+        // Every record is written from its slot, then the lot handed back.
+        unsigned n = ring.size();
+        for (unsigned i = 0; i < n; i++)
+            fwrite(ring.at(i), sizeof(PacketRecord), 1, file);
+        ring.pop(n);
+
+        // Flushed every time, so a killed process leaves a usable file.
+        if (n)
+            fflush(file);
+    }
+}
+
+void recorder_start(const char *path, int payload_len, long long playout_offset) {
+    if (!(file = fopen(path, "wb"))) {
+        perror(path);
+        exit(1);
+    }
+
+    RecordFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+    h.sample_rate = SAMPLE_RATE;
+    h.frame_size = FRAME_SIZE;
+    h.payload_len = payload_len;
+    h.playout_offset_nsec = playout_offset;
+    fwrite(&h, sizeof(h), 1, file);
+    fflush(file);
+
+    realtime_prefault(&ring, sizeof(ring));
+    std::thread t(writer_thread_main);
+    t.detach();
+    printf("Recording sent packets to %s\n", path);
+}
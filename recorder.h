@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/* Optional log of every packet put on the wire (--record=PATH), to look
+ * into stutter after the fact with ./analyze.
+ *
+ * The file is a RecordFileHeader followed by one PacketRecord per packet,
+ * in the order they were sent, all in host byte order. The sender hands
+ * records to a writer thread through a lock-free ring, so logging never
+ * blocks it; if the writer falls behind, records are dropped and show up
+ * as packet_counter gaps in the file. */
+
+#define RECORD_MAGIC "SCREC001"
+
+struct RecordFileHeader {
+    char magic[8];
+    uint32_t sample_rate;
+    uint32_t frame_size;
+    uint32_t payload_len;
+    uint32_t reserved;
+    int64_t playout_offset_nsec;
+};
+
+struct PacketRecord {
+    // Header fields as sent.
+    uint32_t packet_counter;
+    uint32_t sec, usec;
+    uint32_t byte_counter;
+
+    // CLOCK_MONOTONIC time the send call returned, the clock the
+    // timestamps are on too.
+    int64_t send_nsec;
+
+    // Datagrams it went out as (one per session), and how many of them
+    // the kernel took.
+    uint16_t destinations, sent;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(RecordFileHeader) == 32, "record file layout changed");
+static_assert(sizeof(PacketRecord) == 32, "record file layout changed");
+
+// Records lost because the writer fell behind.
+extern std::atomic<unsigned long long> recorder_dropped;
+
+// Create `path` and start the writer thread. Exits if the file can't be
+// created.
+void recorder_start(const char *path, int payload_len, long long playout_offset);
+
+// Log a packet given its header as sent. Only ever called by whichever
+// thread sends, never blocks. Does nothing unless recorder_start() was
+// called.
+void recorder_log(const char *header, long long send_nsec, int destinations, int sent);
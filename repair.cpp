@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <thread>
+
+#include "realtime.h"
+#include "repair.h"
+#include "sender.h"
+
+// Requests and replies handled per recvmmsg/sendmmsg call.
+#define REPAIR_BATCH 16
+
+/* One history entry. The sender and the repair thread share it through a
+ * sequence lock: the sequence is odd while the sender is rewriting the
+ * entry, and a reader that sees it change has to discard its copy. */
+struct HistorySlot {
+    std::atomic<unsigned> seq;
+    unsigned int packet_counter;
+    int len;
+    char data[1];  // packet_len bytes
+};
+
+static char *history;
+static unsigned history_slots;  // power of two
+static size_t slot_size;
+static int packet_len;
+
+static std::atomic<unsigned long long> resent(0);
+
+static HistorySlot *slot_for(unsigned int packet_counter) {
+    return (HistorySlot*) (history + (packet_counter & (history_slots - 1)) * slot_size);
+}
+
+void repair_store(unsigned int packet_counter, const char *header, const char *payload, int payload_len) {
+    if (!history)
+        return;
+
+    HistorySlot *slot = slot_for(packet_counter);
+    unsigned seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->packet_counter = packet_counter;
+    slot->len = HEADER_LEN + payload_len;
+    memcpy(slot->data, header, HEADER_LEN);
+    memcpy(slot->data + HEADER_LEN, payload, payload_len);
+    slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+int repair_load(unsigned int packet_counter, char *out) {
+    HistorySlot *slot = slot_for(packet_counter);
+
+    unsigned seq = slot->seq.load(std::memory_order_acquire);
+    if (seq & 1)
+        return 0;
+    if (slot->packet_counter != packet_counter)
+        return 0;
+    int len = slot->len;
+    if (len > packet_len)
+        return 0;
+    memcpy(out, slot->data, len);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != seq)
+        return 0;
+    return len;
+}
+
+int repair_open_socket(int port) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    struct sockaddr_in si_me;
+    memset(&si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(port);
+    si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(s, (struct sockaddr*) &si_me, sizeof(si_me)) < 0) {
+        perror("bind repair port");
+        exit(1);
+    }
+    return s;
+}
+
+/* Request and reply buffers. They're allocated once in repair_init(), the
+ * request loop itself doesn't allocate. */
+static struct mmsghdr reqs[REPAIR_BATCH];
+static struct iovec req_iovs[REPAIR_BATCH];
+static struct sockaddr_in peers[REPAIR_BATCH];
+static unsigned int req_bufs[REPAIR_BATCH][REPAIR_MAX_PER_REQUEST];
+
+static struct mmsghdr replies[REPAIR_BATCH];
+static struct iovec reply_iovs[REPAIR_BATCH];
+static char *reply_bufs;
+
+static void serve_requests(int s) {
+    for (int i = 0; i < REPAIR_BATCH; i++) {
+        req_iovs[i].iov_base = req_bufs[i];
+        req_iovs[i].iov_len = sizeof(req_bufs[i]);
+        memset(&reqs[i].msg_hdr, 0, sizeof(reqs[i].msg_hdr));
+        reqs[i].msg_hdr.msg_name = &peers[i];
+        reqs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        reqs[i].msg_hdr.msg_iov = &req_iovs[i];
+        reqs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(s, reqs, REPAIR_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            perror("recvmmsg repair");
+        return;
+    }
+
+    // Requests from different receivers are independent, so just answer
+    // them in the order they came in, a batch of replies at a time.
+    int nreplies = 0;
+    for (int i = 0; i < n; i++) {
+        int count = reqs[i].msg_len / 4;
+        for (int j = 0; j < count; j++) {
+            char *out = reply_bufs + nreplies * packet_len;
+            int len = repair_load(ntohl(req_bufs[i][j]), out);
+            if (len == 0)
+                continue;
+
+            reply_iovs[nreplies].iov_base = out;
+            reply_iovs[nreplies].iov_len = len;
+            memset(&replies[nreplies].msg_hdr, 0, sizeof(replies[nreplies].msg_hdr));
+            replies[nreplies].msg_hdr.msg_name = &peers[i];
+            replies[nreplies].msg_hdr.msg_namelen = reqs[i].msg_hdr.msg_namelen;
+            replies[nreplies].msg_hdr.msg_iov = &reply_iovs[nreplies];
+            replies[nreplies].msg_hdr.msg_iovlen = 1;
+            nreplies++;
+
+            if (nreplies == REPAIR_BATCH) {
+                if (sendmmsg(s, replies, nreplies, 0) < 0)
+                    perror("sendmmsg repair");
+                else
+                    resent += nreplies;
+                nreplies = 0;
+            }
+        }
+    }
+    if (nreplies > 0) {
+        if (sendmmsg(s, replies, nreplies, 0) < 0)
+            perror("sendmmsg repair");
+        else
+            resent += nreplies;
+    }
+}
+
+static void repair_thread_main() {
+    make_realtime(RT_SNTP, 4);
+
+    struct pollfd fds[2];
+    fds[0].fd = repair_open_socket(REPAIR_PORT_1);
+    fds[1].fd = repair_open_socket(REPAIR_PORT_2);
+    fds[0].events = fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll repair");
+            exit(1);
+        }
+        for (int i = 0; i < 2; i++)
+            if (fds[i].revents & POLLIN)
+                serve_requests(fds[i].fd);
+    }
+}
+
+void repair_init(int seconds, int len, int packets_per_sec) {
+    packet_len = len;
+    slot_size = (offsetof(HistorySlot, data) + len + 63) & ~(size_t) 63;
+
+    unsigned want = seconds * packets_per_sec;
+    history_slots = 1;
+    while (history_slots < want)
+        history_slots <<= 1;
+
+    history = (char*) calloc(history_slots, slot_size);
+    reply_bufs = (char*) malloc(REPAIR_BATCH * packet_len);
+    if (!history || !reply_bufs) {
+        perror("malloc history");
+        exit(1);
+    }
+    // Slot i is where packet i lives, so storing i + 1 in it makes every
+    // slot miss until the sender actually fills it.
+    for (unsigned i = 0; i < history_slots; i++)
+        ((HistorySlot*) (history + i * slot_size))->packet_counter = i + 1;
+    realtime_prefault(history, history_slots * slot_size);
+    realtime_prefault(reply_bufs, REPAIR_BATCH * packet_len);
+}
+
+void repair_start() {
+    std::thread t(repair_thread_main);
+    t.detach();
+}
+
+unsigned long long repair_resent() {
+    return resent.load();
+}
+
+void repair_count_resent(int n) {
+    resent += n;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+/* Packet history and retransmission service.
+ *
+ * Every packet the sender puts on the wire is also kept in a fixed-size
+ * history indexed by packet_counter. Receivers that lost packets can ask for
+ * them on the repair ports advertised in CurrentTransportSettings (6980 and
+ * 6981) and get them back as unicast, byte for byte as originally sent.
+ *
+ * The Sonos repair request format isn't documented, so requests are simply
+ * a list of big-endian 32-bit packet_counter values, at most
+ * REPAIR_MAX_PER_REQUEST of them per datagram. Counters that are no longer
+ * (or not yet) in the history are ignored. */
+
+#define REPAIR_PORT_1 6980
+#define REPAIR_PORT_2 6981
+#define REPAIR_MAX_PER_REQUEST 64
+
+// Allocate a history able to hold the last `seconds` of packets of
+// `packet_len` bytes each.
+void repair_init(int seconds, int packet_len, int packets_per_sec);
+
+// Start the thread serving repair requests.
+void repair_start();
+
+// Remember a packet that was just sent. Called from the sending thread
+// only; never blocks or allocates.
+void repair_store(unsigned int packet_counter, const char *header, const char *payload, int payload_len);
+
+// Number of packets resent so far.
+unsigned long long repair_resent();
+
+/* For an event loop serving repairs itself instead of repair_start()'s
+ * thread (see uring.h). */
+
+// Bind a repair port.
+int repair_open_socket(int port);
+
+// Copy a packet out of the history. Returns its length, or 0 if it isn't
+// there anymore. Safe against the sender storing packets meanwhile.
+int repair_load(unsigned int packet_counter, char *out);
+
+// Count packets that were resent.
+void repair_count_resent(int n);
@@ -0,0 +1,468 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+#include "resample.h"
+
+struct ResamplePreset {
+    int taps;       // multiple of 8
+    int phases;
+    double beta;    // Kaiser window shape, sets the stopband attenuation
+    double cutoff;  // -6 dB point, relative to the lower Nyquist frequency
+};
+
+// The presets are laid out for inputs up to this rate. Faster ones get
+// proportionally more taps, so the transition band stays as narrow in Hz.
+#define PRESET_MAX_RATE 48000
+
+static const ResamplePreset presets[] = {
+    {24, 64, 6.0, 0.90},    // RESAMPLE_FAST
+    {48, 128, 8.0, 0.94},   // RESAMPLE_MEDIUM
+    {96, 256, 10.0, 0.97},  // RESAMPLE_BEST
+};
+
+bool resample_quality_parse(const char *name, ResampleQuality *quality) {
+    if (!strcmp(name, "fast"))
+        *quality = RESAMPLE_FAST;
+    else if (!strcmp(name, "medium"))
+        *quality = RESAMPLE_MEDIUM;
+    else if (!strcmp(name, "best"))
+        *quality = RESAMPLE_BEST;
+    else
+        return false;
+    return true;
+}
+
+/*********** Filter kernels **************/
+// out = {l.h0, l.h1, r.h0, r.h1}, over n taps.
+typedef void (*dot_fn)(const float *l, const float *r, const float *h0, const float *h1, int n, float *out);
+
+static void dot_scalar(const float *l, const float *r, const float *h0, const float *h1, int n, float *out) {
+    float a = 0, b = 0, c = 0, d = 0;
+    for (int k = 0; k < n; k++) {
+        a += l[k] * h0[k];
+        b += l[k] * h1[k];
+        c += r[k] * h0[k];
+        d += r[k] * h1[k];
+    }
+    out[0] = a;
+    out[1] = b;
+    out[2] = c;
+    out[3] = d;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static inline float hsum_sse2(__m128 v) {
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static void dot_sse2(const float *l, const float *r, const float *h0, const float *h1, int n, float *out) {
+    __m128 a = _mm_setzero_ps(), b = a, c = a, d = a;
+    for (int k = 0; k < n; k += 4) {
+        __m128 vl = _mm_loadu_ps(l + k), vr = _mm_loadu_ps(r + k);
+        __m128 v0 = _mm_loadu_ps(h0 + k), v1 = _mm_loadu_ps(h1 + k);
+        a = _mm_add_ps(a, _mm_mul_ps(vl, v0));
+        b = _mm_add_ps(b, _mm_mul_ps(vl, v1));
+        c = _mm_add_ps(c, _mm_mul_ps(vr, v0));
+        d = _mm_add_ps(d, _mm_mul_ps(vr, v1));
+    }
+    out[0] = hsum_sse2(a);
+    out[1] = hsum_sse2(b);
+    out[2] = hsum_sse2(c);
+    out[3] = hsum_sse2(d);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma")))
+static void dot_avx2(const float *l, const float *r, const float *h0, const float *h1, int n, float *out) {
+    __m256 a = _mm256_setzero_ps(), b = a, c = a, d = a;
+    for (int k = 0; k < n; k += 8) {
+        __m256 vl = _mm256_loadu_ps(l + k), vr = _mm256_loadu_ps(r + k);
+        __m256 v0 = _mm256_loadu_ps(h0 + k), v1 = _mm256_loadu_ps(h1 + k);
+        a = _mm256_fmadd_ps(vl, v0, a);
+        b = _mm256_fmadd_ps(vl, v1, b);
+        c = _mm256_fmadd_ps(vr, v0, c);
+        d = _mm256_fmadd_ps(vr, v1, d);
+    }
+    out[0] = hsum_avx(a);
+    out[1] = hsum_avx(b);
+    out[2] = hsum_avx(c);
+    out[3] = hsum_avx(d);
+}
+
+static bool have_avx2() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void dot_neon(const float *l, const float *r, const float *h0, const float *h1, int n, float *out) {
+    float32x4_t a = vdupq_n_f32(0), b = a, c = a, d = a;
+    for (int k = 0; k < n; k += 4) {
+        float32x4_t vl = vld1q_f32(l + k), vr = vld1q_f32(r + k);
+        float32x4_t v0 = vld1q_f32(h0 + k), v1 = vld1q_f32(h1 + k);
+        a = vfmaq_f32(a, vl, v0);
+        b = vfmaq_f32(b, vl, v1);
+        c = vfmaq_f32(c, vr, v0);
+        d = vfmaq_f32(d, vr, v1);
+    }
+    out[0] = vaddvq_f32(a);
+    out[1] = vaddvq_f32(b);
+    out[2] = vaddvq_f32(c);
+    out[3] = vaddvq_f32(d);
+}
+#endif
+
+static dot_fn dot;
+static const char *dot_name;
+
+static void pick_kernel() {
+    if (dot)
+        return;
+    dot = dot_scalar;
+    dot_name = "scalar";
+#ifdef HAVE_X86_KERNELS
+    dot = dot_sse2;
+    dot_name = "sse2";
+    if (have_avx2()) {
+        dot = dot_avx2;
+        dot_name = "avx2";
+    }
+#endif
+#ifdef HAVE_NEON_KERNELS
+    dot = dot_neon;
+    dot_name = "neon";
+#endif
+}
+
+const char *resample_kernel_name() {
+    pick_kernel();
+    return dot_name;
+}
+
+/*********** Filter design **************/
+// Zeroth order modified Bessel function of the first kind.
+static double bessel_i0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+Resampler::Resampler(int in_rate, int out_rate, ResampleQuality quality)
+    : in_rate(in_rate), nominal_rate(out_rate), out_rate(out_rate) {
+    pick_kernel();
+
+    const ResamplePreset &p = presets[quality];
+    taps = p.taps;
+    if (in_rate > PRESET_MAX_RATE)
+        taps = (p.taps * in_rate / PRESET_MAX_RATE + 7) / 8 * 8;
+    phases = p.phases;
+
+    // Cutoff as a fraction of the input rate.
+    double fc = 0.5 * (in_rate < out_rate ? in_rate : out_rate) * p.cutoff / in_rate;
+    double half = taps / 2.0;
+
+    // Phase `ph` is the filter for an output falling ph/phases of the way
+    // from one input frame to the next; the extra last row equals the
+    // first one shifted by a frame, for interpolating past the last phase.
+    coeffs = (float*) malloc((phases + 1) * taps * sizeof(float));
+    for (int ph = 0; ph <= phases; ph++) {
+        float *h = coeffs + ph * taps;
+        double sum = 0;
+        for (int k = 0; k < taps; k++) {
+            double x = k - half + 1 - (double) ph / phases;
+            double s = x == 0 ? 1 : sin(M_PI * 2 * fc * x) / (M_PI * 2 * fc * x);
+            double w = fabs(x) >= half ? 0 : bessel_i0(p.beta * sqrt(1 - (x / half) * (x / half))) / bessel_i0(p.beta);
+            h[k] = s * w;
+            sum += h[k];
+        }
+        // Unity gain at DC for every phase.
+        for (int k = 0; k < taps; k++)
+            h[k] /= sum;
+    }
+
+    step = (double) in_rate / out_rate;
+
+    // Start on taps-1 frames of silence, so the first output is due with
+    // the first input frame and the output lags by half the filter.
+    hist_cap = taps * 4;
+    hist_l = (float*) calloc(hist_cap, sizeof(float));
+    hist_r = (float*) calloc(hist_cap, sizeof(float));
+    hist_len = taps - 1;
+    t = half - 1;
+
+    out = NULL;
+    out_cap = 0;
+}
+
+Resampler::~Resampler() {
+    free(coeffs);
+    free(hist_l);
+    free(hist_r);
+    free(out);
+}
+
+void Resampler::reserve(size_t frames) {
+    // Between calls at most taps-1 frames of history are left.
+    if (taps - 1 + frames > hist_cap) {
+        hist_cap = taps - 1 + frames;
+        hist_l = (float*) realloc(hist_l, hist_cap * sizeof(float));
+        hist_r = (float*) realloc(hist_r, hist_cap * sizeof(float));
+    }
+    // And they yield at most one output per step, plus one, at the
+    // fastest the ratio can be trimmed to.
+    size_t need = (size_t) (frames * nominal_rate * (1 + MAX_RATE_TRIM) / in_rate) + 2;
+    if (need > out_cap) {
+        free(out);
+        out = (int16_t*) malloc(need * 2 * sizeof(int16_t));
+        out_cap = need;
+    }
+}
+
+void Resampler::set_output_rate(double rate) {
+    double lo = nominal_rate * (1 - MAX_RATE_TRIM), hi = nominal_rate * (1 + MAX_RATE_TRIM);
+    out_rate = rate < lo ? lo : rate > hi ? hi : rate;
+    step = in_rate / out_rate;
+}
+
+static inline int16_t clamp_s16(float v) {
+    v = v > -32768.f ? v : -32768.f;
+    v = v < 32767.f ? v : 32767.f;
+    return lrintf(v);
+}
+
+const int16_t *Resampler::process(const int16_t *in, size_t frames, size_t *out_frames) {
+    assert(hist_len + frames <= hist_cap);
+    for (size_t i = 0; i < frames; i++) {
+        hist_l[hist_len + i] = in[2*i];
+        hist_r[hist_len + i] = in[2*i+1];
+    }
+    hist_len += frames;
+
+    int half = taps / 2;
+    size_t n = 0;
+    float acc[4];
+    while ((size_t) t + half < hist_len) {
+        size_t i = (size_t) t;
+        double pos = (t - i) * phases;
+        int ph = (int) pos;
+        float w = pos - ph;
+        size_t base = i + 1 - half;
+        assert(n < out_cap);
+
+        dot(hist_l + base, hist_r + base, coeffs + ph * taps, coeffs + (ph + 1) * taps, taps, acc);
+        out[2*n] = clamp_s16(acc[0] + w * (acc[1] - acc[0]));
+        out[2*n+1] = clamp_s16(acc[2] + w * (acc[3] - acc[2]));
+        n++;
+        t += step;
+    }
+
+    // Drop the input no future output reaches back to.
+    size_t drop = (size_t) t + 1 - half;
+    memmove(hist_l, hist_l + drop, (hist_len - drop) * sizeof(float));
+    memmove(hist_r, hist_r + drop, (hist_len - drop) * sizeof(float));
+    hist_len -= drop;
+    t -= drop;
+
+    *out_frames = n;
+    return out;
+}
+
+/*********** Benchmark **************/
+#define BENCH_OUT_RATE 44100
+#define BENCH_CHUNK 1024
+
+// Run `seconds` of a sine at `freq` and `amplitude` through a fresh
+// resampler and fit a sine at the same frequency to the left channel of the
+// output, after the filter has settled. Returns the fitted amplitude, and
+// the RMS of what the fit leaves over in *residual.
+static double measure_tone(ResampleQuality q, int in_rate, double freq, double amplitude, double seconds, double *residual) {
+    Resampler r(in_rate, BENCH_OUT_RATE, q);
+    r.reserve(BENCH_CHUNK);
+    size_t in_frames = in_rate * seconds;
+    int16_t *in = (int16_t*) malloc(in_frames * 4);
+    for (size_t i = 0; i < in_frames; i++)
+        in[2*i] = in[2*i+1] = lrint(amplitude * sin(2 * M_PI * freq * i / in_rate));
+
+    size_t cap = (size_t) (in_frames * (double) BENCH_OUT_RATE / in_rate) + 16, len = 0;
+    double *y = (double*) malloc(cap * sizeof(double));
+    for (size_t i = 0; i < in_frames; i += BENCH_CHUNK) {
+        size_t n = in_frames - i < BENCH_CHUNK ? in_frames - i : BENCH_CHUNK, got;
+        const int16_t *o = r.process(in + 2*i, n, &got);
+        for (size_t k = 0; k < got && len < cap; k++)
+            y[len++] = o[2*k];
+    }
+
+    // Least squares fit of a*sin + b*cos + c, skipping the first 10%.
+    size_t start = len / 10;
+    double m[3][4] = {{0}};
+    for (size_t k = start; k < len; k++) {
+        double ph = 2 * M_PI * freq * k / BENCH_OUT_RATE;
+        double basis[3] = {sin(ph), cos(ph), 1};
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                m[i][j] += basis[i] * basis[j];
+            m[i][3] += basis[i] * y[k];
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        for (int j = i + 1; j < 3; j++) {
+            double f = m[j][i] / m[i][i];
+            for (int k = i; k < 4; k++)
+                m[j][k] -= f * m[i][k];
+        }
+    double coef[3];
+    for (int i = 2; i >= 0; i--) {
+        coef[i] = m[i][3];
+        for (int j = i + 1; j < 3; j++)
+            coef[i] -= m[i][j] * coef[j];
+        coef[i] /= m[i][i];
+    }
+    double a = coef[0], b = coef[1], c = coef[2];
+
+    double err = 0;
+    for (size_t k = start; k < len; k++) {
+        double ph = 2 * M_PI * freq * k / BENCH_OUT_RATE;
+        double e = y[k] - (a * sin(ph) + b * cos(ph) + c);
+        err += e * e;
+    }
+    *residual = sqrt(err / (len - start));
+
+    free(in);
+    free(y);
+    return sqrt(a * a + b * b);
+}
+
+static long long thread_cpu_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tm);
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+// What each preset has to meet: flat to within `ripple` dB up to
+// `passband` Hz (scaled down for inputs below 44.1 kHz), THD+N and aliasing
+// at most this many dB.
+struct BenchLimits {
+    double passband, ripple, thdn, alias;
+};
+
+static const BenchLimits limits[] = {
+    {16000, 0.1, -60, -58},  // RESAMPLE_FAST
+    {18000, 0.1, -88, -78},  // RESAMPLE_MEDIUM
+    {20000, 0.1, -92, -95},  // RESAMPLE_BEST
+};
+
+int resample_benchmark(int in_rate) {
+    static const char *names[] = {"fast", "medium", "best"};
+    const double full = 32767 * 0.891;  // -1 dBFS
+    int failures = 0;
+
+    printf("Resampling %d -> %d Hz using %s kernels\n", in_rate, BENCH_OUT_RATE, resample_kernel_name());
+    printf("  %-7s %5s %10s %17s %10s %14s\n", "quality", "taps", "THD+N", "ripple", "aliasing", "CPU per second");
+
+    for (int q = RESAMPLE_FAST; q <= RESAMPLE_BEST; q++) {
+        ResampleQuality quality = (ResampleQuality) q;
+        double residual;
+
+        // THD+N of a 997 Hz tone, relative to the tone.
+        double amp = measure_tone(quality, in_rate, 997, full, 2, &residual);
+        double thdn = 20 * log10(residual / (amp / sqrt(2)));
+
+        // Passband ripple: spread of the gain from 20 Hz to the passband edge.
+        double edge = limits[q].passband * (in_rate < BENCH_OUT_RATE ? in_rate : BENCH_OUT_RATE) / BENCH_OUT_RATE;
+        double gmin = 1e9, gmax = -1e9;
+        for (double f = 20; f <= edge; f *= 1.25) {
+            double g = 20 * log10(measure_tone(quality, in_rate, f, full, 0.5, &residual) / full);
+            gmin = g < gmin ? g : gmin;
+            gmax = g > gmax ? g : gmax;
+        }
+        double g = 20 * log10(measure_tone(quality, in_rate, edge, full, 0.5, &residual) / full);
+        gmin = g < gmin ? g : gmin;
+        gmax = g > gmax ? g : gmax;
+
+        // A tone above the output Nyquist frequency shows up folded back
+        // around it; it should have been filtered out.
+        double alias_in = BENCH_OUT_RATE / 2 + (in_rate - BENCH_OUT_RATE) / 2 * 0.9;
+        double alias = 0;
+        if (in_rate > BENCH_OUT_RATE) {
+            Resampler r(in_rate, BENCH_OUT_RATE, quality);
+            r.reserve(BENCH_CHUNK);
+            size_t in_frames = in_rate / 2;
+            int16_t *in = (int16_t*) malloc(in_frames * 4);
+            for (size_t i = 0; i < in_frames; i++)
+                in[2*i] = in[2*i+1] = lrint(full * sin(2 * M_PI * alias_in * i / in_rate));
+            double sum = 0;
+            size_t count = 0;
+            for (size_t i = 0; i < in_frames; i += BENCH_CHUNK) {
+                size_t n = in_frames - i < BENCH_CHUNK ? in_frames - i : BENCH_CHUNK, got;
+                const int16_t *o = r.process(in + 2*i, n, &got);
+                for (size_t k = 0; k < got; k++, count++)
+                    if (count > (size_t) BENCH_OUT_RATE / 20)
+                        sum += (double) o[2*k] * o[2*k];
+            }
+            alias = 10 * log10(sum / (count - BENCH_OUT_RATE / 20) / (full * full / 2) + 1e-20);
+            free(in);
+        }
+
+        // CPU per second of stereo noise.
+        Resampler r(in_rate, BENCH_OUT_RATE, quality);
+        r.reserve(BENCH_CHUNK);
+        size_t in_frames = in_rate * 10;
+        int16_t *in = (int16_t*) malloc(in_frames * 4);
+        uint32_t s = 0x12345678;
+        for (size_t i = 0; i < in_frames * 2; i++) {
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            in[i] = (int16_t) s;
+        }
+        long long start = thread_cpu_nsec();
+        for (size_t i = 0; i < in_frames; i += BENCH_CHUNK) {
+            size_t got;
+            r.process(in + 2*i, in_frames - i < BENCH_CHUNK ? in_frames - i : BENCH_CHUNK, &got);
+        }
+        double cpu_ms = (thread_cpu_nsec() - start) / 1e6 / 10;
+        free(in);
+
+        char alias_str[32];
+        if (in_rate > BENCH_OUT_RATE)
+            snprintf(alias_str, sizeof(alias_str), "%.1f dB", alias);
+        else
+            snprintf(alias_str, sizeof(alias_str), "-");
+        bool ok = thdn <= limits[q].thdn && gmax - gmin <= limits[q].ripple &&
+                  (in_rate <= BENCH_OUT_RATE || alias <= limits[q].alias);
+        printf("  %-7s %5d %7.1f dB %6.3f dB <%2.0fkHz %10s %11.3f ms  %s\n", names[q], r.delay() * 2,
+               thdn, gmax - gmin, edge / 1000, alias_str, cpu_ms, ok ? "ok" : "FAIL");
+        if (!ok)
+            failures++;
+    }
+    return failures;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Polyphase sample rate converter for S16 stereo, so 48 kHz sources can be
+ * taken as they are instead of relying on whatever resampler the sound
+ * server is configured with.
+ *
+ * The filter is a Kaiser windowed sinc tabulated at a number of phases;
+ * outputs between two phases interpolate linearly between them. That makes
+ * the ratio continuous, so it can be trimmed while running to follow clock
+ * drift. */
+
+// How far set_output_rate() may trim the ratio, far more than clocks drift.
+#define MAX_RATE_TRIM 0.01
+
+enum ResampleQuality {
+    RESAMPLE_FAST,    // 24 taps, ~60 dB stopband, flat to 16 kHz
+    RESAMPLE_MEDIUM,  // 48 taps, ~80 dB stopband, flat to 18 kHz
+    RESAMPLE_BEST,    // 96 taps, ~100 dB stopband, flat to 20 kHz
+};
+
+// Parse fast, medium or best.
+bool resample_quality_parse(const char *name, ResampleQuality *quality);
+
+class Resampler {
+public:
+    Resampler(int in_rate, int out_rate, ResampleQuality quality);
+    ~Resampler();
+
+    // Size the buffers for up to `frames` input frames per call. Done once
+    // at setup, process() itself never allocates.
+    void reserve(size_t frames);
+
+    // Trim the ratio: produce `rate` frames for every in_rate input frames.
+    // Nominally that's out_rate; it's kept within MAX_RATE_TRIM of that.
+    void set_output_rate(double rate);
+    double output_rate() const { return out_rate; }
+
+    // Resample `frames` frames of interleaved stereo, at most as many as
+    // reserved. The result lives in an internal buffer that's reused by the
+    // next call.
+    const int16_t *process(const int16_t *in, size_t frames, size_t *out_frames);
+
+    // Input frames of delay through the filter.
+    int delay() const { return taps / 2; }
+
+private:
+    int in_rate, nominal_rate;
+    double out_rate;
+    int taps, phases;
+    float *coeffs;  // phases+1 rows of taps coefficients
+
+    double step;  // input frames per output frame
+    double t;     // time of the next output frame, in input frames from hist[0]
+
+    // Input history, split by channel so the filter reads it contiguously.
+    float *hist_l, *hist_r;
+    size_t hist_len, hist_cap;
+
+    int16_t *out;
+    size_t out_cap;
+};
+
+// Name of the filter kernel picked for this CPU.
+const char *resample_kernel_name();
+
+// Measure THD+N, passband ripple, aliasing and CPU cost of every quality
+// preset going from `in_rate` to 44.1 kHz, print them and check them
+// against the preset's limits. Returns how many presets missed one.
+int resample_benchmark(int in_rate);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+/* Single-producer/single-consumer ring of preallocated slots.
+ *
+ * The producer fills the slot returned by write_slot() in place and makes it
+ * visible with push(). The consumer looks at front() and hands the slot back
+ * with pop(). If something else still reads from slots the consumer is done
+ * with, like the kernel after a zero-copy send, it can move on with consume()
+ * and hand them back later, in the same order, with release(). Neither side
+ * ever blocks or allocates, so it's safe to use from the Pulse callback and
+ * from realtime threads. */
+template <typename T, unsigned N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    SpscRing() : head(0), read(0), tail(0) {}
+
+    // Slot to fill next, or NULL if the ring is full.
+    T* write_slot() {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+            return NULL;
+        return &slots[h & (N - 1)];
+    }
+
+    void push() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Oldest published slot, or NULL if the ring is empty.
+    T* front() {
+        unsigned r = read.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == r)
+            return NULL;
+        return &slots[r & (N - 1)];
+    }
+
+    // i-th oldest published slot. Only valid for i < size().
+    T* at(unsigned i) {
+        return &slots[(read.load(std::memory_order_relaxed) + i) & (N - 1)];
+    }
+
+    void pop(unsigned n = 1) {
+        consume(n);
+        release(n);
+    }
+
+    void consume(unsigned n) {
+        read.store(read.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    void release(unsigned n) {
+        tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    // Number of published slots not yet consumed. Only a snapshot when
+    // called from a third thread.
+    unsigned size() const {
+        return head.load(std::memory_order_acquire) - read.load(std::memory_order_acquire);
+    }
+
+    // Slots the producer can still fill, counting released ones only.
+    unsigned room() const {
+        return N - (head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire));
+    }
+
+    static constexpr unsigned capacity() {
+        return N;
+    }
+
+private:
+    T slots[N];
+    alignas(64) std::atomic<unsigned> head;
+    alignas(64) std::atomic<unsigned> read;
+    std::atomic<unsigned> tail;
+};
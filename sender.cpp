@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <thread>
+
+#include "metrics.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "repair.h"
+#include "sender.h"
+#include "session.h"
+#include "uring.h"
+
+#ifndef SCM_TXTIME
+#define SCM_TXTIME 61
+#endif
+
+// How long an unpaced sender sleeps when it finds the ring empty.
+#define IDLE_POLL_NSEC 50000
+
+BlockRing block_ring;
+SenderStats sender_stats;
+
+static int sock;
+static int payload_len;
+static SendMode send_mode;
+static Pacing pacing;
+static pthread_t sender_thread;
+static bool sender_running = false;
+
+static uint32_t packet_counter = 1234;
+
+static const long long e9 = 1000000000LL;
+
+static long long now_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
+
+static void sleep_until(long long t) {
+    if (send_mode == SEND_URING) {
+        // Serves SNTP and repairs meanwhile.
+        uring_wait_until(t);
+        return;
+    }
+
+    timespec tm;
+    tm.tv_sec = t / e9;
+    tm.tv_nsec = t % e9;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tm, NULL) != 0)
+        ;
+}
+
+/* Headers for the packets of the batch being sent, one slot per packet. */
+static char headers[SENDER_MAX_BATCH][HEADER_LEN];
+static struct iovec iovs[SENDER_MAX_BATCH][2];
+
+/* Launch times, see sender_set_launch(). */
+static long long launch_lead;
+static bool txtime = false;
+static clockid_t txtime_clock;
+static char txtime_control[SENDER_MAX_BATCH][CMSG_SPACE(sizeof(uint64_t))];
+
+// A launch time the qdisc finds already past may be dropped (etf) rather
+// than sent, so late packets are given this much from now.
+#define TXTIME_MIN_LEAD_NSEC 200000
+
+/* Sessions the batch being sent goes to, as they were when it started. */
+static struct sockaddr_in dests[MAX_SESSIONS];
+static Session *dest_sessions[MAX_SESSIONS];
+static int ndests;
+
+// Destinations each packet of the batch made it to.
+static int packet_sent[SENDER_MAX_BATCH];
+
+static void load_dests() {
+    ndests = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        uint64_t dest = sessions[i].dest.load(std::memory_order_acquire);
+        if (!dest)
+            continue;
+        session_unpack(dest, &dests[ndests]);
+        dest_sessions[ndests] = &sessions[i];
+        ndests++;
+    }
+}
+
+static void build_header(char *buf, const OutPacket *p) {
+    StreamPacketizer::write_header(buf, packet_counter, p->timestamp, p->position);
+    packet_counter += 1;
+}
+
+// Message for packet i of the batch (and those after it, if iovlen says
+// so) to a destination.
+static void init_msg(struct msghdr *msg, int dest, int i, int iovlen) {
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &dests[dest];
+    msg->msg_namelen = sizeof(dests[dest]);
+    msg->msg_iov = iovs[i];
+    msg->msg_iovlen = iovlen;
+    if (txtime) {
+        msg->msg_control = txtime_control[i];
+        msg->msg_controllen = sizeof(txtime_control[i]);
+    }
+}
+
+// Stamp every packet of the batch with its launch time.
+static void stamp_launch_times(const OutPacket *packets, int n, long long now) {
+    long long offset = 0;
+    if (txtime_clock != CLOCK_MONOTONIC) {
+        timespec tm;
+        clock_gettime(txtime_clock, &tm);
+        offset = tm.tv_sec * e9 + tm.tv_nsec - now;
+    }
+
+    for (int i = 0; i < n; i++) {
+        long long launch = packets[i].timestamp - launch_lead;
+        if (launch < now) {
+            sender_stats.underruns++;
+            launch = now + TXTIME_MIN_LEAD_NSEC;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = txtime_control[i];
+        msg.msg_controllen = sizeof(txtime_control[i]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_TXTIME;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        *(uint64_t*) CMSG_DATA(cm) = launch + offset;
+    }
+}
+
+// Consecutive send errors after which they stop being logged.
+#define MAX_LOGGED_ERRORS 10
+static int consecutive_errors = 0;
+
+// A failed send loses the packets, but the stream goes on: the speakers
+// ask for repairs, and the error may well be transient (e.g. ENOBUFS, or
+// the network going away for a moment).
+static void send_error(const char *what, int lost) {
+    sender_stats.send_errors += lost;
+    if (++consecutive_errors <= MAX_LOGGED_ERRORS)
+        perror(what);
+    if (consecutive_errors == MAX_LOGGED_ERRORS)
+        printf("Not logging any more send errors until one succeeds\n");
+}
+
+// Each of these sends the n packets of the batch to every destination from
+// `first` on, and adds what made it to each one's entry in `sent`.
+static void send_single(int n, int first, int *sent) {
+    for (int d = first; d < ndests; d++) {
+        for (int i = 0; i < n; i++) {
+            struct msghdr msg;
+            init_msg(&msg, d, i, 2);
+            int cnt = sendmsg(sock, &msg, 0);
+            sender_stats.syscalls++;
+            if (cnt < 0)
+                send_error("sendmsg", 1);
+            else {
+                sent[d]++;
+                packet_sent[i]++;
+            }
+        }
+    }
+}
+
+// One call for all destinations, so extra sessions cost the kernel's
+// work per datagram but no more syscalls.
+static void send_mmsg(int n, int first, int *sent) {
+    static struct mmsghdr msgs[SENDER_MAX_BATCH * MAX_SESSIONS];
+
+    int total = 0;
+    for (int d = first; d < ndests; d++) {
+        for (int i = 0; i < n; i++) {
+            init_msg(&msgs[total].msg_hdr, d, i, 2);
+            msgs[total].msg_len = 0;
+            total++;
+        }
+    }
+
+    int done = 0;
+    while (done < total) {
+        int cnt = sendmmsg(sock, msgs+done, total-done, 0);
+        sender_stats.syscalls++;
+        if (cnt < 0) {
+            // Only this packet failed, but don't insist with the rest of
+            // its destination. The others may well be fine.
+            int next = (done / n + 1) * n;
+            send_error("sendmmsg", next - done);
+            done = next;
+            continue;
+        }
+        for (int i = 0; i < cnt; i++) {
+            sent[first + (done + i) / n]++;
+            packet_sent[(done + i) % n]++;
+        }
+        done += cnt;
+    }
+}
+
+// All packets have the same size, so the kernel can cut them apart again
+// from one big datagram per destination.
+static void send_gso(int n, int first, int *sent) {
+    if (n == 1) {
+        send_mmsg(n, first, sent);
+        return;
+    }
+
+    for (int d = first; d < ndests; d++) {
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr msg;
+        init_msg(&msg, d, 0, 2 * n);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t*) CMSG_DATA(cm) = HEADER_LEN+payload_len;
+
+        int cnt = sendmsg(sock, &msg, 0);
+        sender_stats.syscalls++;
+        if (cnt < 0) {
+            if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT) {
+                // Kernel or device can't segment for us, stick to sendmmsg.
+                printf("UDP GSO not available (%s), falling back to sendmmsg\n", strerror(errno));
+                send_mode = SEND_MMSG;
+                send_mmsg(n, d, sent);
+                return;
+            }
+            send_error("sendmsg", n);
+            continue;
+        }
+        sent[d] += n;
+        for (int i = 0; i < n; i++)
+            packet_sent[i]++;
+    }
+}
+
+// Every packet is one registered buffer, header and payload, and the
+// ring takes them for all destinations at once.
+static void send_uring(int n, int first, int *sent) {
+    const char *bufs[SENDER_MAX_BATCH];
+    for (int i = 0; i < n; i++)
+        bufs[i] = (const char*) iovs[i][0].iov_base;
+
+    int failed = uring_send(bufs, n, HEADER_LEN+payload_len, dests + first, ndests - first, sent + first, packet_sent);
+    if (failed)
+        send_error("io_uring send", failed);
+}
+
+static void record_interval(long long now) {
+    static long long last_emit = 0;
+
+    if (last_emit) {
+        unsigned long long us = (now - last_emit) / 1000;
+        sender_stats.intervals.fetch_add(1, std::memory_order_relaxed);
+        sender_stats.interval_us_sum.fetch_add(us, std::memory_order_relaxed);
+        sender_stats.interval_us_sq_sum.fetch_add(us * us, std::memory_order_relaxed);
+        if (us > sender_stats.interval_us_max.load(std::memory_order_relaxed))
+            sender_stats.interval_us_max.store(us, std::memory_order_relaxed);
+    }
+    last_emit = now;
+}
+
+void sender_send(const OutPacket *packets, int n) {
+    for (int i = 0; i < n; i++) {
+        char *header = headers[i];
+        if (send_mode == SEND_URING)
+            header = (char*) packets[i].payload - HEADER_LEN;
+        build_header(header, &packets[i]);
+        iovs[i][0].iov_base = header;
+        iovs[i][0].iov_len = HEADER_LEN;
+        iovs[i][1].iov_base = (void*) packets[i].payload;
+        iovs[i][1].iov_len = payload_len;
+    }
+
+    if (txtime)
+        stamp_launch_times(packets, n, now_nsec());
+
+    load_dests();
+    int sent[MAX_SESSIONS] = {0};
+    memset(packet_sent, 0, n * sizeof(packet_sent[0]));
+    switch (send_mode) {
+        case SEND_SINGLE:
+            send_single(n, 0, sent);
+            break;
+        case SEND_MMSG:
+            send_mmsg(n, 0, sent);
+            break;
+        case SEND_GSO:
+            send_gso(n, 0, sent);
+            break;
+        case SEND_URING:
+            send_uring(n, 0, sent);
+            break;
+    }
+
+    long long now = now_nsec();
+    int total = 0;
+    for (int d = 0; d < ndests; d++) {
+        Session *s = dest_sessions[d];
+        if (sent[d] && !s->first_packet_nsec.load(std::memory_order_relaxed))
+            s->first_packet_nsec.store(now, std::memory_order_relaxed);
+        s->packets.fetch_add(sent[d], std::memory_order_relaxed);
+        total += sent[d];
+    }
+    if (total == n * ndests)
+        consecutive_errors = 0;
+    sender_stats.packets += total;
+    sender_stats.bytes_sent += total * payload_len;
+    record_interval(now);
+
+    // Packets of a batch are in timestamp order.
+    long long margin = (packets[0].timestamp - now) / 1000;
+    if (margin < sender_stats.margin_us_min.load(std::memory_order_relaxed))
+        sender_stats.margin_us_min.store(margin, std::memory_order_relaxed);
+    for (int i = 0; i < n; i++) {
+        long long lead = packets[i].timestamp - now;
+        if (lead < 0)
+            sender_stats.late++;
+        metrics.timestamp_lead_us.observe(lead / 1000);
+    }
+
+    for (int i = 0; i < n; i++) {
+        const char *header = (const char*) iovs[i][0].iov_base;
+        repair_store(packet_counter - n + i, header, packets[i].payload, payload_len);
+        recorder_log(header, now, ndests, packet_sent[i]);
+    }
+}
+
+static void send_blocks(int n) {
+    OutPacket batch[SENDER_MAX_BATCH];
+
+    // Slots stay ours until popped, so they can be sent in place.
+    for (int i = 0; i < n; i++) {
+        AudioBlock *b = block_ring.at(i);
+        batch[i].payload = b->payload;
+        batch[i].timestamp = b->timestamp;
+        batch[i].position = b->position;
+    }
+    sender_send(batch, n);
+    // io_uring releases them once the kernel is done sending from them.
+    if (send_mode == SEND_URING)
+        block_ring.consume(n);
+    else
+        block_ring.pop(n);
+}
+
+// Set when capture stops on purpose, so the ring running dry afterwards
+// isn't an underrun.
+static std::atomic<bool> end_of_stream(false);
+
+void sender_end_of_stream() {
+    end_of_stream = true;
+}
+
+// Send each packet at its launch time, together with any others due by
+// then. With SO_TXTIME they're handed to the kernel a period early instead,
+// and the qdisc holds them back to the exact time.
+static void launch_paced_loop(long long period) {
+    long long ahead = txtime ? period : 0;
+
+    while (1) {
+        AudioBlock *b = block_ring.front();
+        if (!b) {
+            sleep_until(now_nsec() + period / 4);
+            continue;
+        }
+
+        long long due = b->timestamp - launch_lead - ahead;
+        long long now = now_nsec();
+        if (due > now)
+            sleep_until(due);
+        else if (!txtime && now - due > period / 2)
+            sender_stats.underruns++;
+
+        now = now_nsec();
+        unsigned fill = block_ring.size();
+        int n = 1;
+        while (n < (int) fill && n < SENDER_MAX_BATCH && block_ring.at(n)->timestamp - launch_lead - ahead <= now)
+            n++;
+        send_blocks(n);
+    }
+}
+
+static void sender_thread_main() {
+    make_realtime(RT_SENDER, 5);
+
+    long long period = payload_len * e9 / (SAMPLE_RATE * FRAME_SIZE);
+    long long next = 0;
+    bool running = false;
+
+    if (pacing == PACE_LAUNCH)
+        launch_paced_loop(period);
+
+    while (1) {
+        unsigned fill = block_ring.size();
+
+        if (pacing == PACE_NONE) {
+            if (fill == 0) {
+                sleep_until(now_nsec() + IDLE_POLL_NSEC);
+                continue;
+            }
+            send_blocks(fill < SENDER_MAX_BATCH ? fill : SENDER_MAX_BATCH);
+            continue;
+        }
+
+        if (!running) {
+            // Wait for the ring to refill before picking the cadence back up.
+            if (fill < PREFILL_BLOCKS) {
+                sleep_until(now_nsec() + period / 2);
+                continue;
+            }
+            running = true;
+            end_of_stream = false;
+            next = now_nsec();
+        }
+
+        if (fill == 0) {
+            if (!end_of_stream.exchange(false))
+                sender_stats.underruns++;
+            running = false;
+            continue;
+        }
+
+        // One packet is due per period. The sound card and CLOCK_MONOTONIC
+        // don't tick at exactly the same rate though, so the ring slowly
+        // fills up or drains. Send any excess together with the due packet
+        // instead of letting latency pile up; the drain case is handled by
+        // the underrun/prefill path above.
+        int n = 1;
+        if (fill > PREFILL_BLOCKS + 1) {
+            n = fill - PREFILL_BLOCKS;
+            if (n > SENDER_MAX_BATCH)
+                n = SENDER_MAX_BATCH;
+            next = now_nsec();
+        }
+
+        send_blocks(n);
+
+        next += period;
+        sleep_until(next);
+    }
+}
+
+void sender_init(int s, int len, SendMode mode) {
+    sock = s;
+    payload_len = len;
+    send_mode = mode;
+    sender_stats.margin_us_min = LLONG_MAX;
+}
+
+void sender_set_launch(long long lead, bool use_txtime, clockid_t clock) {
+    launch_lead = lead;
+    txtime = use_txtime;
+    txtime_clock = clock;
+    if (txtime && send_mode == SEND_GSO) {
+        // A GSO datagram has one launch time for all its segments.
+        printf("SO_TXTIME pacing needs a launch time per packet, using sendmmsg instead of GSO\n");
+        send_mode = SEND_MMSG;
+    }
+}
+
+void sender_start(Pacing pace) {
+    pacing = pace;
+    realtime_prefault(&block_ring, sizeof(block_ring));
+
+    std::thread t(sender_thread_main);
+    sender_thread = t.native_handle();
+    sender_running = true;
+    t.detach();
+}
+
+long long sender_cpu_nsec() {
+    clockid_t cid;
+    timespec tm;
+    if (!sender_running)
+        return 0;
+    if (pthread_getcpuclockid(sender_thread, &cid) != 0 || clock_gettime(cid, &tm) != 0)
+        return 0;
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <time.h>
+
+#include "packetizer.h"
+#include "ringbuffer.h"
+
+#define HEADER_LEN 28
+#define PAYLOAD_MAX 4068
+
+#define SAMPLE_RATE 44100
+#define FRAME_SIZE 4
+
+// What goes on the wire: S16LE stereo.
+typedef Packetizer<int16_t, 2, SAMPLE_RATE> StreamPacketizer;
+static_assert(StreamPacketizer::HEADER_BYTES == HEADER_LEN, "header length");
+static_assert(StreamPacketizer::FRAME_BYTES == FRAME_SIZE, "frame size");
+
+/* One packet worth of captured PCM, as queued by the capture side. */
+struct AudioBlock {
+    long long timestamp;  // playout time, CLOCK_MONOTONIC nanoseconds
+    long long position;   // byte offset of the payload in the capture stream
+    char reserved[64 - 16 - HEADER_LEN];
+    // Room for the header right in front of the payload, for sending both
+    // as one buffer (SEND_URING). The payload starts a cache line in.
+    char header[HEADER_LEN];
+    char payload[PAYLOAD_MAX];
+};
+static_assert(offsetof(AudioBlock, payload) == offsetof(AudioBlock, header) + HEADER_LEN, "header right before the payload");
+
+typedef SpscRing<AudioBlock, 64> BlockRing;
+
+/* A packet ready to go out. The header is built by the sender in its own
+ * slot and sent together with the payload as one iovec pair, so the payload
+ * can live anywhere: in a ring block or straight in the capture buffer. */
+struct OutPacket {
+    const char *payload;
+    long long timestamp;
+    long long position;
+};
+
+// How the sender hands packets that are due at the same time to the kernel.
+enum SendMode {
+    SEND_SINGLE,  // one sendmsg() per packet
+    SEND_MMSG,    // one sendmmsg() per wakeup
+    SEND_GSO,     // one sendmsg() per wakeup, segmented by the kernel (UDP_SEGMENT)
+    SEND_URING,   // one io_uring_enter() per wakeup, from registered buffers (see uring.h)
+};
+
+// How the sender thread spaces packets out.
+enum Pacing {
+    PACE_NONE,    // as soon as they're in the ring
+    PACE_PERIOD,  // one per payload period, from when it (re)started
+    PACE_LAUNCH,  // each at its launch time, see sender_set_launch()
+};
+
+struct SenderStats {
+    std::atomic<unsigned long long> packets;  // datagrams, summed over sessions
+    std::atomic<unsigned long long> syscalls;
+    std::atomic<unsigned long long> send_errors;  // packets lost to failed sends
+    std::atomic<unsigned> underruns;  // sender was due but the ring was empty, or
+                                      // a packet only got there after its launch time
+    std::atomic<unsigned> overruns;   // capture found the ring full and dropped a block
+
+    // Payload bytes put on the wire, and how many of them were memcpy'd on
+    // the way from the capture buffer to the socket.
+    std::atomic<unsigned long long> bytes_sent;
+    std::atomic<unsigned long long> bytes_copied;
+
+    // Time between consecutive sender wakeups that put packets on the wire.
+    std::atomic<unsigned long long> intervals;
+    std::atomic<unsigned long long> interval_us_sum;
+    std::atomic<unsigned long long> interval_us_sq_sum;
+    std::atomic<unsigned> interval_us_max;
+
+    // Least time left between a packet going out and its playout time, in
+    // microseconds, since this was last reset to LLONG_MAX; and how many
+    // went out after it, in total.
+    std::atomic<long long> margin_us_min;
+    std::atomic<unsigned> late;
+};
+
+// Blocks the paced sender buffers before (re)starting to send. Absorbs the
+// jitter of the fragment delivery so the sender can keep a steady cadence,
+// at the cost of as much latency.
+#define PREFILL_BLOCKS 2
+
+extern BlockRing block_ring;
+extern SenderStats sender_stats;
+
+// Set up how packets are sent. Where to is up to the sessions, every
+// packet goes to each one that's active when it's sent.
+void sender_init(int sock, int payload_len, SendMode mode);
+
+// Packets are launched `lead` ns before their playout time. With `txtime`
+// every packet is stamped with its launch time on `clock` for the qdisc to
+// hold it back (see txtime.h), and a PACE_LAUNCH sender thread hands them
+// over a period early. Without, it sleeps until each launch time itself.
+void sender_set_launch(long long lead, bool txtime, clockid_t clock);
+
+// Start the realtime sender thread draining block_ring.
+void sender_start(Pacing pacing);
+
+// Send packets right away from the calling thread, bypassing block_ring.
+// Mustn't be mixed with a running sender thread. With SEND_URING only the
+// sender thread sends, and only payloads of block_ring's blocks.
+void sender_send(const OutPacket *packets, int n);
+
+// Capture has been stopped on purpose: let the sender drain block_ring
+// without counting an underrun when it runs dry.
+void sender_end_of_stream();
+
+// Most packets sender_send() takes at once.
+#define SENDER_MAX_BATCH 16
+
+// CPU time consumed by the sender thread so far, in nanoseconds.
+long long sender_cpu_nsec();
@@ -1,5 +1,6 @@
 import asyncio
 import binascii
+import os
 import socket
 import struct
 import subprocess
@@ -68,8 +69,24 @@ class Subscription():
         self.service = service
         self.callback_url = callback_url
         self.seq = 0
+        self._sending = False
+        self._changed = False
 
     async def notify(self):
+        # One NOTIFY at a time, so they arrive in SEQ order. Whatever changes
+        # while one is out goes in a single one after it.
+        self._changed = True
+        if self._sending:
+            return
+        self._sending = True
+        try:
+            while self._changed and self.id in self.service.subscriptions:
+                self._changed = False
+                await self._send()
+        finally:
+            self._sending = False
+
+    async def _send(self):
         ns = 'urn:schemas-upnp-org:event-1-0'
 
         root = ET.Element('{%s}propertyset' % ns)
@@ -86,17 +103,21 @@ class Subscription():
 
         if evented_variables > 0:
             xml = ET.tostring(root, encoding='utf-8')
-            print(xml)
-            resp = await aiohttp.request('NOTIFY', self.callback_url, data=xml, headers={
-                'CONTENT-TYPE': 'text/xml',
-                'NT': 'upnp:event',
-                'NTS': 'upnp:propchange',
-                'SID': 'uuid:'+self.id,
-                'SEQ': str(self.seq),
-            })
+            seq = self.seq
             self.seq += 1
-            print(resp.status)
-            print(await resp.text())
+            try:
+                async with aiohttp.request('NOTIFY', self.callback_url, data=xml, headers={
+                    'CONTENT-TYPE': 'text/xml',
+                    'NT': 'upnp:event',
+                    'NTS': 'upnp:propchange',
+                    'SID': 'uuid:'+self.id,
+                    'SEQ': str(seq),
+                }) as resp:
+                    await resp.read()
+            except (aiohttp.ClientError, OSError) as e:
+                # It'll subscribe again if it's still around.
+                print('Dropping subscription', self.id, e)
+                self.service.subscriptions.pop(self.id, None)
 
 
 NS_SOAP_ENV = "{http://schemas.xmlsoap.org/soap/envelope/}"
@@ -258,6 +279,7 @@ class Service():
         self._pending_event = False
 
     async def handle_control(self, request):
+        self._request_time = time.monotonic()
         def print_c(e):
             for c in e.getchildren():
                 print(c, c.tag)
@@ -283,6 +305,11 @@ class Service():
             return build_soap_error(401)
 
         res = func(**kwargs)
+        # Handlers that talk to ./stream are coroutines.
+        if asyncio.iscoroutine(res):
+            res = await res
+        if isinstance(res, Response):
+            return res
 
         return Response(
             text=res,
@@ -330,7 +357,8 @@ class Service():
         if not self._pending_event:
             return
         self._pending_event = False
-        print("Sending events!!!")
+        for s in list(self.subscriptions.values()):
+            asyncio.ensure_future(s.notify())
 
     def _get_variable(self, name):
         return self._variable_values[name]
@@ -340,7 +368,8 @@ class Service():
         self._variable_values[name] = value
         if var.is_evented and not self._pending_event:
             self._pending_event = True
-            self._send_events()
+            # Whatever else changes along with it goes in the same event.
+            asyncio.get_event_loop().call_soon(self._send_events)
 
 class Variable(object):
     def snoop_name(self, objtype):
@@ -463,9 +492,6 @@ class QueueService(Service):
     def __init__(self, router):
         Service.__init__(self, 'MediaRenderer/Queue', router)
 
-class RenderingControlService(Service):
-    def __init__(self, router):
-        Service.__init__(self, 'MediaRenderer/RenderingControl', router)
 
 class ZoneGroupTopologyService(Service):
     ZoneGroupState = Variable(is_evented=True, default='''<ZoneGroups>
@@ -508,6 +534,113 @@ class ZoneGroupTopologyService(Service):
 
 
 
+STREAM_CONTROL_PATH = '/tmp/sonoscast.sock'
+# How long a control command may take, connecting included, before it's
+# given up on. It's awaited, so the event loop keeps going meanwhile.
+STREAM_CONTROL_TIMEOUT = 1.0
+
+# Every group listening to us gets its own multicast group, from this range,
+# on the same port. At most as many as ./stream has sessions (MAX_SESSIONS).
+MULTICAST_BASE = '225.238.76.46'
+MULTICAST_PORT = 6982
+MAX_SESSIONS = 8
+
+# The line in levels are fetched from ./stream and evented this often. They
+# go from 0 at LEVEL_RANGE_DB below full scale to 100 at full scale.
+LEVEL_POLL_INTERVAL = 0.1
+LEVEL_RANGE_DB = 60
+
+class StreamControl():
+    """The ./stream daemon, started once and driven over its control socket,
+    so starting a transmission doesn't pay for process startup, RealtimeKit
+    and connecting to PulseAudio."""
+
+    def __init__(self, path):
+        self.path = path
+        if os.path.exists(path):
+            os.unlink(path)
+        self.proc = subprocess.Popen(["./stream", "--control="+path])
+
+    async def _command(self, cmd):
+        # The daemon may still be setting up right after launch.
+        while True:
+            try:
+                reader, writer = await asyncio.open_unix_connection(self.path)
+                break
+            except (FileNotFoundError, ConnectionRefusedError):
+                await asyncio.sleep(0.01)
+        try:
+            writer.write((cmd+'\n').encode('utf-8'))
+            return (await reader.readline()).decode('utf-8').split()
+        finally:
+            writer.close()
+
+    async def command(self, cmd):
+        try:
+            reply = await asyncio.wait_for(self._command(cmd), STREAM_CONTROL_TIMEOUT)
+        except asyncio.TimeoutError:
+            print('stream:', cmd, 'timed out')
+            return None
+        except OSError as e:
+            print('stream control socket unavailable:', e)
+            return None
+        if not reply or reply[0] != 'ok':
+            print('stream:', cmd, 'failed:', ' '.join(reply))
+            return None
+        return reply[1:]
+
+    async def status(self, session):
+        reply = await self.command('status ' + session)
+        if reply is None:
+            return None
+        status = {'state': reply[0]}
+        for field in reply[1:]:
+            k, v = field.split('=', 1)
+            status[k] = float(v)
+        return status
+
+    async def levels(self):
+        """Peak and RMS of the line in over the last 100 ms, in dBFS."""
+        reply = await self.command('levels')
+        if reply is None:
+            return None
+        return {k: float(v) for k, v in (field.split('=', 1) for field in reply)}
+
+    async def metrics(self):
+        """The daemon's counters and histograms in Prometheus text format."""
+        reply = await self.command('metrics')
+        if reply is None:
+            return None
+        names = [field.rsplit('=', 1)[0].split('{', 1)[0] for field in reply]
+        histograms = {n[:-len('_bucket')] for n in names if n.endswith('_bucket')}
+        lines, typed = [], set()
+        for field in reply:
+            name, value = field.rsplit('=', 1)
+            base, kind = name.split('{', 1)[0], None
+            for suffix in ('_bucket', '_sum', '_count'):
+                if base.endswith(suffix) and base[:-len(suffix)] in histograms:
+                    base, kind = base[:-len(suffix)], 'histogram'
+            if kind is None:
+                kind = 'counter' if base.endswith('_total') else 'gauge'
+            if base not in typed:
+                typed.add(base)
+                lines.append('# TYPE {} {}'.format(base, kind))
+            lines.append('{} {}'.format(name, value))
+        return '\n'.join(lines) + '\n'
+
+    async def report_first_packet(self, session, soap_time, command_time):
+        """Log how long it took from the SOAP call to the first packet."""
+        for attempt in range(100):
+            status = await self.status(session)
+            if status is None:
+                return
+            if status['first_packet_ms'] >= 0:
+                print('First packet {:.1f} ms after StartTransmissionToGroup ({:.1f} ms in stream)'.format(
+                    (command_time - soap_time) * 1000 + status['first_packet_ms'], status['first_packet_ms']))
+                return
+            await asyncio.sleep(0.01)
+        print('No packet sent 1 s after StartTransmissionToGroup')
+
 class AudioInService(Service):
     AudioInputName = Variable(is_evented=True, default='SonosCast')
     Icon = Variable(is_evented=True, default='AudioComponent')
@@ -515,22 +648,110 @@ class AudioInService(Service):
     LeftLineInLevel = Variable(is_evented=True, default='1')
     RightLineInLevel = Variable(is_evented=True, default='1')
 
-    def __init__(self, router):
+    def __init__(self, router, stream):
         Service.__init__(self, 'AudioIn', router)
-        self.proc = None
+        self.stream = stream
+        self.groups = {}  # CoordinatorID -> multicast address it's sent to
+
+    def _group_address(self, coordinator):
+        if coordinator in self.groups:
+            return self.groups[coordinator]
+        base = struct.unpack('>I', socket.inet_aton(MULTICAST_BASE))[0]
+        taken = set(self.groups.values())
+        for i in range(MAX_SESSIONS):
+            addr = socket.inet_ntoa(struct.pack('>I', base + i))
+            if addr not in taken:
+                self.groups[coordinator] = addr
+                return addr
+        return None
+
+    async def meter_levels(self):
+        """Keep LeftLineInLevel and RightLineInLevel following the peak
+        levels ./stream measures, evented whenever they change."""
+        while True:
+            await asyncio.sleep(LEVEL_POLL_INTERVAL)
+            levels = await self.stream.levels()
+            if levels is None:
+                continue
+            # Straight to the values, the descriptors log every access.
+            for name, db in (('LeftLineInLevel', levels['peak_left']), ('RightLineInLevel', levels['peak_right'])):
+                level = str(max(0, round(100 + db * 100 / LEVEL_RANGE_DB)))
+                if level != self._get_variable(name):
+                    self._set_variable(name, level)
 
-    def handle_soap_starttransmissiontogroup(self, CoordinatorID):
+    async def handle_soap_starttransmissiontogroup(self, CoordinatorID):
         print('StartTransmissionToGroup', CoordinatorID)
-        if self.proc is None:
-            self.proc = subprocess.Popen(["./stream"])
-        return '<s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/"><s:Body><u:StartTransmissionToGroupResponse xmlns:u="urn:schemas-upnp-org:service:AudioIn:1"><CurrentTransportSettings>225.238.76.46:6982,{my_ip}:6980:6981,{my_id}</CurrentTransportSettings></u:StartTransmissionToGroupResponse></s:Body></s:Envelope>'.format(my_ip=MY_IP, my_id=SONOS_ID)
-
-    def handle_soap_stoptransmissiontogroup(self, CoordinatorID):
-        if self.proc:
-            self.proc.kill()
-        self.proc = None
+        command_time = time.monotonic()
+        addr = self._group_address(CoordinatorID)
+        if addr is None:
+            print('Already transmitting to', MAX_SESSIONS, 'groups')
+            return build_soap_error(500)
+        if await self.stream.command('start {} {}:{}'.format(CoordinatorID, addr, MULTICAST_PORT)) is not None:
+            asyncio.ensure_future(self.stream.report_first_packet(CoordinatorID, self._request_time, command_time))
+        return '<s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/"><s:Body><u:StartTransmissionToGroupResponse xmlns:u="urn:schemas-upnp-org:service:AudioIn:1"><CurrentTransportSettings>{addr}:{port},{my_ip}:6980:6981,{my_id}</CurrentTransportSettings></u:StartTransmissionToGroupResponse></s:Body></s:Envelope>'.format(addr=addr, port=MULTICAST_PORT, my_ip=MY_IP, my_id=SONOS_ID)
+
+    async def handle_soap_stoptransmissiontogroup(self, CoordinatorID):
+        await self.stream.command('stop ' + CoordinatorID)
+        self.groups.pop(CoordinatorID, None)
         print('StopTransmissionToGroup', CoordinatorID)
 
+class RenderingControlService(Service):
+    """Volume and mute of the line-in, applied by ./stream as it sends, so
+    they're heard in every group listening. Only the Master channel."""
+    LastChange = Variable(is_evented=True, default='')
+
+    def __init__(self, router, stream):
+        Service.__init__(self, 'MediaRenderer/RenderingControl', router)
+        self.stream = stream
+        self.volume = 100
+        self.mute = False
+        self._update_last_change()
+
+    def _update_last_change(self):
+        self.LastChange = ('<Event xmlns="urn:schemas-upnp-org:metadata-1-0/RCS/"><InstanceID val="0">'
+                           '<Volume channel="Master" val="{}"/><Mute channel="Master" val="{}"/>'
+                           '</InstanceID></Event>').format(self.volume, int(self.mute))
+
+    def _response(self, method, args=''):
+        return ('<s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/"><s:Body>'
+                '<u:{m}Response xmlns:u="urn:schemas-upnp-org:service:RenderingControl:1">{args}</u:{m}Response>'
+                '</s:Body></s:Envelope>').format(m=method, args=args)
+
+    def handle_soap_getvolume(self, InstanceID=0, Channel='Master'):
+        if Channel != 'Master':
+            return build_soap_error(402)
+        return self._response('GetVolume', '<CurrentVolume>{}</CurrentVolume>'.format(self.volume))
+
+    async def handle_soap_setvolume(self, InstanceID=0, Channel='Master', DesiredVolume=None):
+        try:
+            volume = int(DesiredVolume)
+        except (TypeError, ValueError):
+            return build_soap_error(402)
+        if Channel != 'Master':
+            return build_soap_error(402)
+        if not 0 <= volume <= 100:
+            return build_soap_error(601)
+        if await self.stream.command('volume {}'.format(volume)) is None:
+            return build_soap_error(501)
+        self.volume = volume
+        self._update_last_change()
+        return self._response('SetVolume')
+
+    def handle_soap_getmute(self, InstanceID=0, Channel='Master'):
+        if Channel != 'Master':
+            return build_soap_error(402)
+        return self._response('GetMute', '<CurrentMute>{}</CurrentMute>'.format(int(self.mute)))
+
+    async def handle_soap_setmute(self, InstanceID=0, Channel='Master', DesiredMute=None):
+        if Channel != 'Master' or DesiredMute is None:
+            return build_soap_error(402)
+        mute = DesiredMute in (True, 1, '1', 'true')
+        if await self.stream.command('mute {}'.format(int(mute))) is None:
+            return build_soap_error(501)
+        self.mute = mute
+        self._update_last_change()
+        return self._response('SetMute')
+
 app = aiohttp.web.Application()
 
 @aiohttp_jinja2.template('device_description.xml')
@@ -551,10 +772,21 @@ DevicePropertiesService(app.router)
 GroupManagementService(app.router)
 QueueService(app.router)
 AVTransportService(app.router)
-RenderingControlService(app.router)
 ContentDirectoryService(app.router)
 ZoneGroupTopologyService(app.router)
-AudioInService(app.router)
+stream = StreamControl(STREAM_CONTROL_PATH)
+RenderingControlService(app.router, stream)
+audio_in = AudioInService(app.router, stream)
+asyncio.ensure_future(audio_in.meter_levels())
+
+async def get_metrics(request):
+    metrics = await stream.metrics()
+    if metrics is None:
+        return Response(status=503, text='stream not responding\n')
+    return Response(text=metrics, content_type='text/plain', charset='utf-8',
+                    headers={'X-Prometheus-Version': '0.0.4'})
+
+app.router.add_get('/metrics', get_metrics)
 
 app.router.add_static('/', 'webroot/')
 aiohttp.web.run_app(app, port=1400)
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+
+Session sessions[MAX_SESSIONS];
+
+bool session_parse_dest(const char *s, struct sockaddr_in *addr) {
+    char ip[64];
+    const char *colon = strchr(s, ':');
+    if (!colon || colon - s >= (int) sizeof(ip))
+        return false;
+    memcpy(ip, s, colon - s);
+    ip[colon - s] = 0;
+
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (*end || port <= 0 || port > 65535)
+        return false;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_aton(ip, &addr->sin_addr) != 0;
+}
+
+// Top bit marks the word as in use, so 0.0.0.0:0 can't be mistaken for a
+// free slot.
+#define DEST_VALID (1ULL << 63)
+
+uint64_t session_pack(const struct sockaddr_in &addr) {
+    return DEST_VALID | (uint64_t) addr.sin_addr.s_addr << 16 | addr.sin_port;
+}
+
+void session_unpack(uint64_t dest, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = (uint32_t) (dest >> 16);
+    addr->sin_port = (uint16_t) dest;
+}
+
+Session *session_find(const char *id) {
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].id[0] && !strcmp(sessions[i].id, id))
+            return &sessions[i];
+    return NULL;
+}
+
+Session *session_start(const char *id, const struct sockaddr_in &addr, long long now) {
+    Session *s = session_find(id);
+    for (int i = 0; i < MAX_SESSIONS && !s; i++)
+        if (!sessions[i].id[0])
+            s = &sessions[i];
+    if (!s || strlen(id) >= SESSION_ID_MAX)
+        return NULL;
+
+    strcpy(s->id, id);
+    s->start_command_nsec = now;
+    s->first_packet_nsec = 0;
+    s->dest.store(session_pack(addr), std::memory_order_release);
+    return s;
+}
+
+void session_stop(Session *s) {
+    s->dest.store(0, std::memory_order_release);
+    s->id[0] = 0;
+}
+
+int session_count() {
+    int n = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        if (sessions[i].dest.load(std::memory_order_relaxed))
+            n++;
+    return n;
+}
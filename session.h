@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Transmissions to Sonos groups.
+ *
+ * Every group listening to us gets a session: its own multicast address,
+ * named by the group's CoordinatorID. Sessions share everything upstream of
+ * the socket, i.e. capture, packetization, the repair history and the SNTP
+ * service, and the sender puts each packet on the wire once per session.
+ * A packet is the same bytes for every group, so a receiver asking for a
+ * repair gets the right one whichever group it's in. */
+
+#define MAX_SESSIONS 8
+#define SESSION_ID_MAX 64
+
+struct Session {
+    // Only touched from the mainloop.
+    char id[SESSION_ID_MAX];        // CoordinatorID, "" if the slot is free
+    long long start_command_nsec;   // when it was (re)started
+
+    // Read by the sender on every batch. Packed address and port, see
+    // session_pack(); 0 while the session isn't sending.
+    std::atomic<uint64_t> dest;
+
+    // Kept by the sender.
+    std::atomic<unsigned long long> packets;
+    std::atomic<long long> first_packet_nsec;  // 0 until one went out
+};
+
+extern Session sessions[MAX_SESSIONS];
+
+// Parse IP:PORT. False if it isn't one.
+bool session_parse_dest(const char *s, struct sockaddr_in *addr);
+
+// Pack a destination into one word the sender can load atomically, and
+// back.
+uint64_t session_pack(const struct sockaddr_in &addr);
+void session_unpack(uint64_t dest, struct sockaddr_in *addr);
+
+// Session with that id, or NULL.
+Session *session_find(const char *id);
+
+// Start sending to `addr` for `id`, reusing its session if there is one.
+// NULL if all sessions are taken.
+Session *session_start(const char *id, const struct sockaddr_in &addr, long long now);
+
+void session_stop(Session *s);
+
+// Sessions currently sending.
+int session_count();
@@ -0,0 +1,237 @@
+/* Example producer for stream --source=shm:PATH: plays a sine, or raw S16LE
+ * stereo at 44.1 kHz from stdin, into the shared memory ring in real time.
+ * With --bench it measures how fast and how promptly `stream` takes blocks
+ * instead.
+ *
+ *   gcc -O2 -o shm_producer shm_producer.c -lm
+ *   ./stream --source=shm:/tmp/sonoscast-pcm &
+ *   ./shm_producer /tmp/sonoscast-pcm
+ *   ffmpeg -i song.flac -f s16le -ar 44100 -ac 2 - | ./shm_producer --stdin /tmp/sonoscast-pcm
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "shm_ring.h"
+
+#define SINE_FREQ 440.0
+#define SINE_AMPLITUDE 16384.0
+
+static struct shm_ring_header *ring;
+static int wakefd;
+static uint32_t write_index;
+static unsigned long sleeps, wakeups;
+
+static long long now_nsec(void) {
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+/* Connect to `stream` and map the ring it hands over. */
+static int attach(const char *path) {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    if (s < 0 || connect(s, (struct sockaddr*) &sun, sizeof(sun)) < 0) {
+        perror(path);
+        return 0;
+    }
+
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm;
+    if (recvmsg(s, &msg, 0) < 1 || !(cm = CMSG_FIRSTHDR(&msg)) || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        printf("%s didn't hand over a ring, is another producer attached?\n", path);
+        return 0;
+    }
+    // Left open: we're attached for as long as it is.
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    wakefd = fds[1];
+
+    struct stat st;
+    if (fstat(fds[0], &st) < 0 ||
+        (ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+    close(fds[0]);
+
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || ring->version != SHM_RING_VERSION ||
+        ring->format != SHM_FORMAT_S16LE || ring->channels != 2 || ring->sample_rate != 44100) {
+        printf("Unexpected ring format\n");
+        return 0;
+    }
+    // Carry on after whatever an earlier producer left.
+    write_index = __atomic_load_n(&ring->write_index, __ATOMIC_ACQUIRE);
+    printf("Attached to %u blocks of %u frames\n", ring->block_count, ring->block_frames);
+    return 1;
+}
+
+/* Slot for the next block, once there's room for it. */
+static struct shm_block *next_block(void) {
+    for (;;) {
+        uint32_t r = __atomic_load_n(&ring->read_index, __ATOMIC_ACQUIRE);
+        if (write_index - r < ring->block_count)
+            return shm_ring_block(ring, write_index);
+
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        r = __atomic_load_n(&ring->read_index, __ATOMIC_SEQ_CST);
+        if (write_index - r == ring->block_count) {
+            // Don't hang for good if `stream` has gone away.
+            struct timespec timeout = {1, 0};
+            syscall(SYS_futex, &ring->read_index, FUTEX_WAIT, r, &timeout, NULL, 0);
+            sleeps++;
+        }
+        __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void publish(struct shm_block *b, uint32_t frames, long long captured_at) {
+    b->frames = frames;
+    b->flags = 0;
+    b->captured_at = captured_at;
+    __atomic_store_n(&ring->write_index, write_index + 1, __ATOMIC_SEQ_CST);
+    // `stream` had taken everything before this block, it may be asleep.
+    if (__atomic_load_n(&ring->read_index, __ATOMIC_SEQ_CST) == write_index) {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0)
+            perror("eventfd");
+        wakeups++;
+    }
+    write_index++;
+}
+
+static double phase;
+
+static void sine(int16_t *out, uint32_t frames) {
+    double step = 2 * M_PI * SINE_FREQ / 44100;
+    for (uint32_t i = 0; i < frames; i++) {
+        out[2*i] = out[2*i+1] = lrint(SINE_AMPLITUDE * sin(phase));
+        phase = fmod(phase + step, 2 * M_PI);
+    }
+}
+
+/* Produce in real time, each block once its last frame is due. */
+static void play(int from_stdin) {
+    long long start = now_nsec();
+    long long frames_done = 0;
+    for (;;) {
+        struct shm_block *b = next_block();
+        uint32_t frames = ring->block_frames;
+        if (from_stdin) {
+            size_t n = fread(shm_block_pcm(b), 4, frames, stdin);
+            if (n == 0)
+                return;
+            frames = n;
+        } else
+            sine(shm_block_pcm(b), frames);
+
+        frames_done += frames;
+        long long due = start + frames_done * 1000000000LL / 44100;
+        struct timespec tm = {due / 1000000000LL, due % 1000000000LL};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tm, NULL) != 0)
+            ;
+        publish(b, frames, due);
+    }
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long*) a, y = *(const long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Half the time flat out, for throughput; the other half one block at a
+ * time, for how long `stream` takes to pick one up once it's published. */
+static void bench(int seconds) {
+    long long half = seconds * 500000000LL;
+    long long start = now_nsec(), now;
+    unsigned long blocks = 0;
+    do {
+        struct shm_block *b = next_block();
+        sine(shm_block_pcm(b), ring->block_frames);
+        publish(b, ring->block_frames, 0);
+        blocks++;
+        now = now_nsec();
+    } while (now - start < half);
+    double elapsed = (now - start) / 1e9;
+    double frames = (double) blocks * ring->block_frames;
+    printf("Throughput: %lu blocks in %.2f s, %.0f blocks/s, %.1f MB/s, %.0fx real time\n",
+           blocks, elapsed, blocks / elapsed, frames * 4 / elapsed / 1e6, frames / elapsed / 44100);
+    printf("  slept on a full ring %lu times, woke stream %lu times\n", sleeps, wakeups);
+
+    // Let it settle first.
+    while (__atomic_load_n(&ring->read_index, __ATOMIC_ACQUIRE) != write_index)
+        usleep(1000);
+
+    int max = half / 1000000;
+    long long *latency = malloc(max * sizeof(long long));
+    int n = 0;
+    start = now_nsec();
+    while (n < max && now_nsec() - start < half) {
+        struct shm_block *b = next_block();
+        sine(shm_block_pcm(b), ring->block_frames);
+        long long t = now_nsec();
+        publish(b, ring->block_frames, t);
+        while (__atomic_load_n(&ring->read_index, __ATOMIC_ACQUIRE) != write_index)
+            ;
+        latency[n++] = now_nsec() - t;
+        usleep(1000);
+    }
+    qsort(latency, n, sizeof(long long), compare_ll);
+    if (n)
+        printf("Latency: publish to consumed over %d blocks: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+               n, latency[n / 2] / 1e3, latency[n * 99 / 100] / 1e3, latency[n - 1] / 1e3);
+    free(latency);
+}
+
+int main(int argc, char **argv) {
+    int from_stdin = 0, bench_seconds = 0, bad = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--stdin"))
+            from_stdin = 1;
+        else if (!strncmp(argv[i], "--bench=", 8))
+            bench_seconds = atoi(argv[i] + 8);
+        else if (argv[i][0] != '-')
+            path = argv[i];
+        else
+            bad = 1;
+    }
+    if (!path || bad) {
+        printf("Usage: %s [--stdin] [--bench=SECONDS] PATH\n", argv[0]);
+        return 1;
+    }
+    if (!attach(path))
+        return 1;
+
+    if (bench_seconds)
+        bench(bench_seconds);
+    else
+        play(from_stdin);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Shared memory PCM ring for producers on the same host (--source=shm:PATH),
+ * so a local player or TTS engine can feed `stream` without PulseAudio.
+ * Plain C, for the producers' sake; see shm_producer.c.
+ *
+ * `stream` creates the ring in a memfd and listens on a Unix socket at
+ * PATH. A producer connects and gets two file descriptors back in an
+ * SCM_RIGHTS message: the memfd, to mmap() shared and read-write in full,
+ * and an eventfd to wake `stream` with. One producer at a time: it keeps
+ * the connection open for as long as it's attached, and `stream` closes
+ * any other without handing anything over meanwhile.
+ *
+ * The memfd starts with a struct shm_ring_header, followed by block_count
+ * blocks of block_size bytes each from data_offset on. Every block is a
+ * struct shm_block and up to block_frames frames of PCM in the format the
+ * header gives, which is always S16LE stereo at 44100 Hz for now. `stream`
+ * keeps its own copy of the layout, so a producer changing the header
+ * doesn't change where it reads.
+ *
+ * write_index and read_index count blocks since the ring was created and
+ * wrap around at 2^32; block i lives in slot i % block_count. To publish a
+ * block the producer:
+ *
+ *   1. waits while write_index - read_index == block_count (the ring is
+ *      full): it sets producer_waiting, checks again, then sleeps with
+ *      FUTEX_WAIT on read_index, which `stream` wakes after consuming;
+ *   2. fills slot write_index % block_count: PCM, frames, captured_at;
+ *   3. stores write_index + 1;
+ *   4. reads read_index, and if that equals the write_index it just
+ *      replaced, `stream` had run dry and may be asleep: it adds 1 to the
+ *      eventfd.
+ *
+ * Steps 3 and 4, and `stream` storing read_index before it reads
+ * write_index again, must be sequentially consistent, or a wakeup can be
+ * lost. Nothing else needs more than acquire/release. */
+
+#define SHM_RING_MAGIC 0x48534353  /* "SCSH" */
+#define SHM_RING_VERSION 1
+
+#define SHM_FORMAT_S16LE 1
+
+struct shm_ring_header {
+    uint32_t magic;          /* SHM_RING_MAGIC */
+    uint32_t version;        /* SHM_RING_VERSION */
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t format;         /* SHM_FORMAT_* */
+    uint32_t block_frames;   /* most frames one block holds */
+    uint32_t block_count;    /* a power of two */
+    uint32_t block_size;     /* bytes from one block to the next */
+    uint32_t data_offset;    /* where block 0 starts */
+    uint8_t pad0[32];
+
+    /* Each side writes its own cache line. */
+    uint32_t write_index;       /* blocks published, written by the producer */
+    uint8_t pad1[60];
+    uint32_t read_index;        /* blocks consumed, written by `stream` */
+    uint32_t producer_waiting;  /* set by a producer about to sleep on read_index */
+    uint8_t pad2[56];
+};
+
+struct shm_block {
+    /* CLOCK_MONOTONIC time in nanoseconds at which the last frame was
+     * captured or generated, or 0 to leave it to `stream`. Playout times
+     * are counted from it. */
+    int64_t captured_at;
+    uint32_t frames;  /* frames of PCM that follow, at most block_frames */
+    uint32_t flags;   /* 0 */
+};
+
+static inline struct shm_block *shm_ring_block(struct shm_ring_header *h, uint32_t index) {
+    return (struct shm_block*) ((char*) h + h->data_offset + (uint64_t) (index & (h->block_count - 1)) * h->block_size);
+}
+
+static inline int16_t *shm_block_pcm(struct shm_block *b) {
+    return (int16_t*) (b + 1);
+}
@@ -7,6 +7,12 @@
 #include<sys/socket.h>
 #include <time.h>
 #include<unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <thread>
+
+#include "realtime.h"
+#include "sntp.h"
 
 #define BUFLEN 512
 #define PORT 12300
@@ -48,21 +54,150 @@ struct SNTPPacket {
     long long req_recv_time;
     long long send_time;
 };
+static_assert(sizeof(SNTPPacket) == SNTP_PACKET_LEN, "SNTP packet layout");
+
+SntpStats sntp_stats;
+
+// Requests received and replies sent per syscall.
+#define SNTP_BATCH 32
+
+// Errors a thread logs at most, the rest are only counted.
+#define MAX_LOGGED_ERRORS 10
+
+// How many table slots to look at for a client before evicting one.
+#define CLIENT_PROBES 8
+
+static SntpClient clients[SNTP_MAX_THREADS][SNTP_MAX_CLIENTS];
+static int num_threads;
+
+static long long ntp_time(const timespec &tm) {
+    long long t = ((long long)(tm.tv_nsec) << 32) / 1000000000;
+    t += (long long)(tm.tv_sec + UNIX_TO_NTP_OFFSET) << 32;
+    return t;
+}
+
+static long long timespec_nsec(const timespec &tm) {
+    return tm.tv_sec * 1000000000LL + tm.tv_nsec;
+}
+
+unsigned sntp_turnaround_percentile(double p) {
+    return sntp_stats.turnaround.percentile(p);
+}
+
+/* Per-thread open addressing table keyed by client IP. Only the owning
+ * thread writes to it; the fields are atomics so the stats reporter can
+ * read them at any time. */
+static void record_client(SntpClient *table, unsigned ip, long long now) {
+    unsigned h = (ip * 2654435761u) % SNTP_MAX_CLIENTS;
+    SntpClient *oldest = &table[h];
+
+    for (int i = 0; i < CLIENT_PROBES; i++) {
+        SntpClient *c = &table[(h + i) % SNTP_MAX_CLIENTS];
+        unsigned cip = c->ip.load(std::memory_order_relaxed);
+        if (cip == ip) {
+            long long dt = now - c->last_seen.load(std::memory_order_relaxed);
+            if (dt > 0) {
+                float rate = c->rate.load(std::memory_order_relaxed);
+                c->rate.store(0.8f * rate + 0.2f * (1e9f / dt), std::memory_order_relaxed);
+            }
+            c->last_seen.store(now, std::memory_order_relaxed);
+            c->requests.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (cip == 0) {
+            oldest = c;
+            break;
+        }
+        if (c->last_seen.load(std::memory_order_relaxed) < oldest->last_seen.load(std::memory_order_relaxed))
+            oldest = c;
+    }
+
+    oldest->ip.store(ip, std::memory_order_relaxed);
+    oldest->last_seen.store(now, std::memory_order_relaxed);
+    oldest->requests.store(1, std::memory_order_relaxed);
+    oldest->rate.store(0, std::memory_order_relaxed);
+}
+
+int sntp_active_clients(int window_sec, float *max_rate) {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    long long since = timespec_nsec(tm) - window_sec * 1000000000LL;
+
+    int n = 0;
+    *max_rate = 0;
+    for (int t = 0; t < num_threads; t++) {
+        for (int i = 0; i < SNTP_MAX_CLIENTS; i++) {
+            SntpClient *c = &clients[t][i];
+            if (c->ip.load(std::memory_order_relaxed) == 0 || c->last_seen.load(std::memory_order_relaxed) < since)
+                continue;
+            n++;
+            float rate = c->rate.load(std::memory_order_relaxed);
+            if (rate > *max_rate)
+                *max_rate = rate;
+        }
+    }
+    return n;
+}
+
+/* The kernel stamps packets with CLOCK_REALTIME, but the speakers sync to
+ * our CLOCK_MONOTONIC. Translate using the current offset between the two,
+ * sampled back to back. */
+long long sntp_realtime_offset() {
+    timespec now_rt, now_mono;
+    clock_gettime(CLOCK_REALTIME, &now_rt);
+    clock_gettime(CLOCK_MONOTONIC, &now_mono);
+    return timespec_nsec(now_rt) - timespec_nsec(now_mono);
+}
+
+static void log_error(const char *what, int *errors) {
+    sntp_stats.errors.fetch_add(1, std::memory_order_relaxed);
+    if (++*errors <= MAX_LOGGED_ERRORS)
+        perror(what);
+}
+
+void sntp_turn_around(void *buf, long long recv_time) {
+    timespec recv_tm;
+    recv_tm.tv_sec = recv_time / 1000000000LL;
+    recv_tm.tv_nsec = recv_time % 1000000000LL;
+
+    SNTPPacket *packet = (SNTPPacket*) buf;
+    packet->header = 0x0f1c;
+    packet->req_send_time = packet->send_time;
+    packet->req_recv_time = htont(ntp_time(recv_tm));
+}
 
-void sntp_loop() {
-    struct sockaddr_in si_me, si_other;
+long long sntp_stamp(void *buf) {
+    timespec send_tm;
+    clock_gettime(CLOCK_MONOTONIC, &send_tm);
+    ((SNTPPacket*) buf)->send_time = htont(ntp_time(send_tm));
+    return timespec_nsec(send_tm);
+}
 
-    int s, i;
-    socklen_t slen = sizeof(si_other);
+void sntp_served(int shard, unsigned ip, long long recv_time, long long send_time) {
+    sntp_stats.turnaround.observe((send_time - recv_time) / 1000);
+    record_client(clients[shard], ip, send_time);
+    sntp_stats.requests.fetch_add(1, std::memory_order_relaxed);
+}
 
-    SNTPPacket packet;
+static int open_socket(bool reuseport) {
+    struct sockaddr_in si_me;
+    int s;
 
     //create a UDP socket
-    if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    if ((s=socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP)) == -1)
     {
         die("socket");
     }
 
+    int on = 1;
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        die("SO_REUSEPORT");
+
+    // Have the kernel tell us when each request actually arrived, so our
+    // own wakeup latency doesn't end up in the speakers' offset.
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+        perror("SO_TIMESTAMPNS, using userspace receive timestamps");
+
     // zero out the structure
     memset((char *) &si_me, 0, sizeof(si_me));
 
@@ -74,32 +209,151 @@ void sntp_loop() {
     if( bind(s , (struct sockaddr*)&si_me, sizeof(si_me) ) == -1)
         die("bind");
 
-    //keep listening for data
+    return s;
+}
+
+static void sntp_loop(int thread, int s) {
+    SNTPPacket packets[SNTP_BATCH];
+    struct sockaddr_in peers[SNTP_BATCH];
+    char controls[SNTP_BATCH][CMSG_SPACE(sizeof(timespec))];
+    struct iovec iovs[SNTP_BATCH];
+    struct mmsghdr msgs[SNTP_BATCH];
+    long long recv_times[SNTP_BATCH];
+
+    int errors = 0;
+
+    int ep = epoll_create1(0);
+    if (ep == -1)
+        die("epoll_create1");
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev) == -1)
+        die("epoll_ctl");
+
+    //keep listening for data. Nothing on the path from recvmmsg to sendmmsg
+    //may log or block, it all adds up in the offset the speakers compute.
     while(1) {
-        printf("Waiting for data...\n");
-
-        int recv_len = recvfrom(s, &packet, sizeof(packet), 0, (struct sockaddr *) &si_other, &slen);
-
-        //try to receive some data, this is a blocking call
-        if(recv_len == -1)
-            die("recvfrom()");
-        //print details of the client/vpeer and the data received
-        printf("Received packet from %s:%d\n", inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port));
-        if(recv_len != sizeof(packet))
-            printf("Unexpected length, got %d, should be %d\n", recv_len, sizeof(packet));
-
-        timespec tm;
-        clock_gettime(CLOCK_MONOTONIC, &tm);
-        long long t = ((long long)(tm.tv_nsec) << 32) / 1000000000;
-        t += (long long)(tm.tv_sec + UNIX_TO_NTP_OFFSET) << 32;
-        packet.header = 0x0f1c;
-        packet.req_send_time = packet.send_time;
-        packet.req_recv_time = packet.send_time = htont(t);
-
-        //now reply the client with the same data
-        if (sendto(s, &packet, sizeof(packet), 0, (struct sockaddr*) &si_other, slen) == -1)
-            die("sendto()");
+        int r = epoll_wait(ep, &ev, 1, -1);
+        if (r == -1) {
+            if (errno != EINTR)
+                log_error("epoll_wait()", &errors);
+            continue;
+        }
+
+        // Drain everything that's queued up, a batch at a time.
+        while (1) {
+            for (int i = 0; i < SNTP_BATCH; i++) {
+                iovs[i].iov_base = &packets[i];
+                iovs[i].iov_len = sizeof(packets[i]);
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_name = &peers[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                msgs[i].msg_hdr.msg_control = controls[i];
+                msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+            }
+
+            int n = recvmmsg(s, msgs, SNTP_BATCH, 0, NULL);
+            if (n == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    log_error("recvmmsg()", &errors);
+                break;
+            }
+
+            long long offset = sntp_realtime_offset();
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            // Short datagrams aren't requests, they get no reply. The rest
+            // move up to fill their places.
+            int m = 0;
+            for (int i = 0; i < n; i++) {
+                if (msgs[i].msg_len < SNTP_PACKET_LEN)
+                    continue;
+                struct msghdr *msg = &msgs[i].msg_hdr;
+                long long recv_time = timespec_nsec(now);
+                for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+                    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                        timespec rt;
+                        memcpy(&rt, CMSG_DATA(cm), sizeof(rt));
+                        recv_time = timespec_nsec(rt) - offset;
+                    }
+                }
+                if (m != i) {
+                    packets[m] = packets[i];
+                    peers[m] = peers[i];
+                    msgs[m].msg_hdr.msg_namelen = msg->msg_namelen;
+                }
+                recv_times[m] = recv_time;
+                sntp_turn_around(&packets[m], recv_time);
+                m++;
+            }
+            if (m == 0) {
+                if (n < SNTP_BATCH)
+                    break;
+                continue;
+            }
+
+            // Stamp the replies as late as possible.
+            long long send_nsec = sntp_stamp(&packets[0]);
+            for (int i = 0; i < m; i++) {
+                packets[i].send_time = packets[0].send_time;
+                msgs[i].msg_hdr.msg_control = NULL;
+                msgs[i].msg_hdr.msg_controllen = 0;
+            }
+
+            //now reply the clients with the same data
+            int sent = 0;
+            while (sent < m) {
+                int r = sendmmsg(s, msgs + sent, m - sent, 0);
+                if (r == -1) {
+                    // One unreachable client shouldn't stop the others from
+                    // getting their replies.
+                    log_error("sendmmsg()", &errors);
+                    r = 1;
+                }
+                sent += r;
+            }
+
+            for (int i = 0; i < m; i++)
+                sntp_served(thread, peers[i].sin_addr.s_addr, recv_times[i], send_nsec);
+
+            if (n < SNTP_BATCH)
+                break;
+        }
     }
+}
+
+static void sntp_thread_main(int thread, int s) {
+    make_realtime(RT_SNTP, 5);
+    sntp_loop(thread, s);
+}
+
+void sntp_start(int threads) {
+    if (threads < 1)
+        threads = 1;
+    if (threads > SNTP_MAX_THREADS)
+        threads = SNTP_MAX_THREADS;
+    num_threads = threads;
+
+    // Bind every socket up front so a port conflict is reported right away.
+    int socks[SNTP_MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+        socks[i] = open_socket(threads > 1);
+
+    for (int i = 0; i < threads; i++) {
+        std::thread t(sntp_thread_main, i, socks[i]);
+        t.detach();
+    }
+
+    printf("SNTP server listening on port %d with %d thread%s\n", PORT, threads, threads > 1 ? "s" : "");
+}
 
-    close(s);
+int sntp_open() {
+    num_threads = 1;
+    int s = open_socket(false);
+    printf("SNTP server listening on port %d\n", PORT);
+    return s;
 }
@@ -1 +1,64 @@
-void sntp_loop();
+#pragma once
+
+#include <atomic>
+
+#include "metrics.h"
+
+// Clients tracked per SNTP thread. A household with more players than this
+// still gets served, the least recently seen ones just drop out of the
+// table.
+#define SNTP_MAX_CLIENTS 256
+
+#define SNTP_MAX_THREADS 8
+
+// Requests and replies are this long.
+#define SNTP_PACKET_LEN 48
+
+struct SntpStats {
+    std::atomic<unsigned long long> requests;
+    std::atomic<unsigned long long> errors;
+    Histogram turnaround;  // us from the request hitting the socket to the reply leaving
+};
+
+struct SntpClient {
+    std::atomic<unsigned> ip;           // network byte order, 0 if unused
+    std::atomic<long long> last_seen;   // CLOCK_MONOTONIC nanoseconds
+    std::atomic<unsigned long long> requests;
+    std::atomic<float> rate;            // requests per second, smoothed
+};
+
+extern SntpStats sntp_stats;
+
+// Turnaround in microseconds below which the given fraction of replies fell.
+unsigned sntp_turnaround_percentile(double p);
+
+// Number of clients seen within the last `window_sec` seconds, and the
+// highest request rate among them.
+int sntp_active_clients(int window_sec, float *max_rate);
+
+// Serve SNTP on PORT from `threads` realtime threads. With more than one,
+// each thread gets its own SO_REUSEPORT socket and the kernel spreads the
+// clients over them.
+void sntp_start(int threads);
+
+/* The steps of answering a request, for an event loop that serves SNTP
+ * itself instead of sntp_start()'s threads (see uring.h). */
+
+// Bind the SNTP port, with SO_TIMESTAMPNS on, as the only shard.
+int sntp_open();
+
+// CLOCK_REALTIME minus CLOCK_MONOTONIC, to translate the kernel's receive
+// timestamps with.
+long long sntp_realtime_offset();
+
+// Turn the request in `buf` (SNTP_PACKET_LEN bytes) into its reply, in
+// place. `recv_time` is when it came in, on CLOCK_MONOTONIC.
+void sntp_turn_around(void *buf, long long recv_time);
+
+// Stamp a reply with the current time as it's about to be sent, and
+// return that time.
+long long sntp_stamp(void *buf);
+
+// Count a reply that went out to `ip` (network byte order) in the stats of
+// `shard`.
+void sntp_served(int shard, unsigned ip, long long recv_time, long long send_time);
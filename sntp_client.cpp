@@ -0,0 +1,253 @@
+/* Measures stream's SNTP server from the outside, the way speakers see it:
+ *
+ *     ./stream --source=sine &
+ *     ./sntp_client --requests=10000
+ *     ./sntp_client --clients=500 --rate=20000 --duration=10
+ *
+ * Sends requests one at a time, each stamped with its transmit time, and
+ * reports percentiles of the round trip and of the server's turnaround:
+ * the time between the receive and transmit stamps in its reply, which is
+ * what ends up as asymmetry in a speaker's clock offset if it's long.
+ *
+ * With --rate it simulates a crowd instead: --clients sockets, each a
+ * speaker of its own to the server, take turns sending at that rate in
+ * total, without waiting for replies, and it reports how many replies a
+ * second came back and the same percentiles under that load. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#define SNTP_PORT 12300
+#define SNTP_PACKET_LEN 48
+#define UNIX_TO_NTP_OFFSET 2208988800LL
+
+// A request without a reply by then counts as lost.
+#define REPLY_TIMEOUT_MS 100
+
+static const long long e9 = 1000000000LL;
+
+static long long now_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
+
+static unsigned long long ntp_from_nsec(long long ns) {
+    unsigned long long sec = ns / e9 + UNIX_TO_NTP_OFFSET;
+    unsigned long long frac = ((unsigned long long) (ns % e9) << 32) / e9;
+    return sec << 32 | frac;
+}
+
+static long long nsec_from_ntp(unsigned long long t) {
+    long long sec = (long long) (t >> 32) - UNIX_TO_NTP_OFFSET;
+    return sec * e9 + (long long) (((t & 0xffffffffULL) * e9) >> 32);
+}
+
+static unsigned long long load_be64(const unsigned char *p) {
+    unsigned long long v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static void store_be64(unsigned char *p, unsigned long long v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static double percentile(std::vector<double> &v, double p) {
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[(size_t) (p * (v.size() - 1) + 0.5)];
+}
+
+static void print_percentiles(const char *what, std::vector<double> &v) {
+    printf("  %-11s p50 %7.1f us, p99 %7.1f us, p99.9 %7.1f us, max %7.1f us\n", what,
+           percentile(v, 0.5), percentile(v, 0.99), percentile(v, 0.999), percentile(v, 1));
+}
+
+static std::vector<double> round_trip_us, turnaround_us;
+
+static void send_request(int s, long long t1) {
+    unsigned char req[SNTP_PACKET_LEN];
+    memset(req, 0, sizeof(req));
+    req[0] = 0x1b;  // version 3, client
+    store_be64(req + 40, ntp_from_nsec(t1));
+    if (send(s, req, sizeof(req), 0) < 0)
+        perror("send");
+}
+
+/*********** Load **************/
+static long long replies = 0;
+
+// Take whatever replies there are on `s`. Requests don't need to be
+// remembered: each reply echoes its request's transmit time.
+static void drain(int s) {
+    unsigned char rep[SNTP_PACKET_LEN];
+    int n;
+    while ((n = recv(s, rep, sizeof(rep), MSG_DONTWAIT)) >= 0) {
+        long long t4 = now_nsec();
+        if (n < (int) sizeof(rep))
+            continue;
+        long long t1 = nsec_from_ntp(load_be64(rep + 24));
+        long long t2 = nsec_from_ntp(load_be64(rep + 32));
+        long long t3 = nsec_from_ntp(load_be64(rep + 40));
+        round_trip_us.push_back((t4 - t1) / 1e3);
+        turnaround_us.push_back((t3 - t2) / 1e3);
+        replies++;
+    }
+}
+
+static void load(const std::vector<int> &socks, double rate, int duration) {
+    std::vector<struct pollfd> fds(socks.size());
+    for (size_t i = 0; i < socks.size(); i++) {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+    }
+
+    long long interval = e9 / rate;
+    long long start = now_nsec(), end = start + duration * e9, next = start;
+    long long sent = 0;
+    long long now;
+    while ((now = now_nsec()) < end + REPLY_TIMEOUT_MS * 1000000LL) {
+        while (next <= now && next < end) {
+            send_request(socks[sent % socks.size()], now);
+            sent++;
+            next += interval;
+        }
+
+        long long wait = (next < end ? next : end + REPLY_TIMEOUT_MS * 1000000LL) - now;
+        timespec tm = {(time_t) (wait / e9), (long) (wait % e9)};
+        if (ppoll(fds.data(), fds.size(), &tm, NULL) <= 0)
+            continue;
+        for (size_t i = 0; i < fds.size(); i++)
+            if (fds[i].revents & POLLIN)
+                drain(fds[i].fd);
+    }
+
+    printf("%lld requests from %zu clients in %d s, %lld replies, %.0f replies/s, %.3f%% lost\n",
+           sent, socks.size(), duration, replies, replies / (double) duration,
+           sent ? 100.0 * (sent - replies) / sent : 0);
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [options]\n"
+           "  --server=IP              where stream runs (default 127.0.0.1)\n"
+           "  --requests=N             how many to send, one at a time (default 10000)\n"
+           "  --rate=PER_SEC           send this many a second instead, without waiting for replies\n"
+           "  --clients=N              from this many sockets in turn, with --rate (default 100)\n"
+           "  --duration=SECONDS       for this long, with --rate (default 10)\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(SNTP_PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int requests = 10000;
+    double rate = 0;
+    int clients = 100, duration = 10;
+
+    static struct option long_options[] = {
+        {"server", required_argument, NULL, 's'},
+        {"requests", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"clients", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                if (!inet_aton(optarg, &server.sin_addr)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'n':
+                requests = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (rate > 0 && (clients < 1 || duration < 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::vector<int> socks(rate > 0 ? clients : 1);
+    for (size_t i = 0; i < socks.size(); i++) {
+        socks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (socks[i] < 0 || connect(socks[i], (struct sockaddr*) &server, sizeof(server)) < 0) {
+            perror("socket");
+            return 1;
+        }
+    }
+
+    if (rate > 0) {
+        load(socks, rate, duration);
+        print_percentiles("round trip", round_trip_us);
+        print_percentiles("turnaround", turnaround_us);
+        return 0;
+    }
+
+    int s = socks[0];
+    int lost = 0;
+    for (int i = 0; i < requests; i++) {
+        unsigned char rep[SNTP_PACKET_LEN];
+        long long t1 = now_nsec();
+        unsigned long long stamp = ntp_from_nsec(t1);
+        send_request(s, t1);
+
+        // Replies to requests given up on may still turn up, they're told
+        // apart by the transmit time they echo.
+        bool answered = false;
+        while (!answered) {
+            struct pollfd p = {s, POLLIN, 0};
+            if (poll(&p, 1, REPLY_TIMEOUT_MS) <= 0)
+                break;
+            int n = recv(s, rep, sizeof(rep), 0);
+            long long t4 = now_nsec();
+            if (n < (int) sizeof(rep) || load_be64(rep + 24) != stamp)
+                continue;
+            long long t2 = nsec_from_ntp(load_be64(rep + 32));
+            long long t3 = nsec_from_ntp(load_be64(rep + 40));
+            round_trip_us.push_back((t4 - t1) / 1e3);
+            turnaround_us.push_back((t3 - t2) / 1e3);
+            answered = true;
+        }
+        if (!answered)
+            lost++;
+    }
+
+    printf("%d requests to %s:%d, %d lost\n", requests, inet_ntoa(server.sin_addr), SNTP_PORT, lost);
+    print_percentiles("round trip", round_trip_us);
+    print_percentiles("turnaround", turnaround_us);
+    return 0;
+}
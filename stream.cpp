@@ -1,89 +1,79 @@
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <getopt.h>
 #include <pulse/pulseaudio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <thread>
-
+#include <sys/resource.h>
+
+#include "capture.h"
+#include "control.h"
+#include "convert.h"
+#include "drift.h"
+#include "gain.h"
+#include "metrics.h"
+#include "probe.h"
 #include "realtime.h"
+#include "recorder.h"
+#include "resample.h"
+#include "repair.h"
+#include "sender.h"
+#include "session.h"
 #include "sntp.h"
+#include "txtime.h"
+#include "uring.h"
 
-#define CLEAR_LINE "\n"
-#define _(x) x
+#define REPAIR_HISTORY_SECONDS 5
+#define STATS_INTERVAL_USEC (10 * PA_USEC_PER_SEC)
 
-#define TIME_EVENT_USEC 10000
+// Period of the --rt-test wakeups, as cyclictest's default.
+#define RT_TEST_INTERVAL_USEC 1000
 
-// From pulsecore/macro.h
-#define pa_memzero(x,l) (memset((x), 0, (l)))
-#define pa_zero(x) (pa_memzero(&(x), sizeof(x)))
+// Time a packet should have left between being sent and being played, for
+// the network and the speaker. Less than that is warned about.
+#define MIN_NETWORK_MARGIN_USEC 5000
 
 int verbose = 1;
 int ret;
 
-pa_context *context;
+/*********** Latency profiles **************/
+/* How far ahead of playout the audio is sent, and in what chunks. Lower is
+ * better for lip sync, higher rides out a bad network. */
+struct LatencyProfile {
+    const char *name;
+    int offset_ms;          // playout time after capture
+    int frames_per_packet;
+    int fragment_packets;   // Pulse fragsize, in packets
+    int buffer_ms;          // Pulse record buffer
+};
 
-static pa_sample_spec sample_spec = {
-    PA_SAMPLE_S16LE,
-    44100,
-    2
+/* The record buffer only fills up while the mainloop isn't reading, so it
+ * costs no latency. It's what lets a scheduling hiccup pass without audio
+ * getting lost. */
+static const LatencyProfile profiles[] = {
+    {"low", 20, 128, 1, 100},
+    {"default", 35, 251, 1, 100},
+    {"robust", 100, 502, 1, 250},
 };
+#define PROFILES (sizeof(profiles) / sizeof(profiles[0]))
 
-static pa_stream *stream = NULL;
-
-void stream_state_callback(pa_stream *s, void *userdata) {
-    assert(s);
-    switch (pa_stream_get_state(s)) {
-        case PA_STREAM_CREATING:
-            // The stream has been created, so
-            // let's open a file to record to
-            printf("Creating stream\n");
-            //TODO FIXOR
-            //fdout = creat(fname,  0711);
-            break;
-        case PA_STREAM_TERMINATED:
-            //TODO FIXOR
-            //close(fdout);
-            break;
-        case PA_STREAM_READY:
-            // Just for info: no functionality in this branch
-            if (verbose) {
-                const pa_buffer_attr *a;
-                char cmt[PA_CHANNEL_MAP_SNPRINT_MAX], sst[PA_SAMPLE_SPEC_SNPRINT_MAX];
-
-                printf("Stream successfully created.\n");
-
-                if (!(a = pa_stream_get_buffer_attr(s)))
-                    printf("pa_stream_get_buffer_attr() failed: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
-                else {
-                    printf("Buffer metrics: maxlength=%u, fragsize=%u\n", a->maxlength, a->fragsize);
+// Playout time of a packet relative to the capture of its last byte.
+long long playout_offset = 35 * 1000000LL;
 
-                }
+/*********** Packetizer **************/
+// Where the capture stream is cut into packets, see the profiles for their
+// length.
+StreamPacketizer packetizer(251);
 
-                printf("Connected to device %s (%u, %ssuspended).\n",
-                       pa_stream_get_device_name(s),
-                       pa_stream_get_device_index(s),
-                       pa_stream_is_suspended(s) ? "" : "not ");
-            }
-            break;
-        case PA_STREAM_FAILED:
-        default:
-            printf("Stream error: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
-            exit(1);
-    }
-}
+int sock;
 
-/*********** Stream callbacks **************/
-char buf[4098];
-int buffill = 0;
-int buflen = 1004;
-
-struct sockaddr_in addr;
-int addrlen, sock, cnt;
-int packet_counter = 1234;
-int byte_counter = 1234;
+// Block currently being filled by capture_push().
+AudioBlock *block = NULL;
 
 int min(int a, int b) {
     return a < b ? a : b;
@@ -98,175 +88,932 @@ long long getnsec() {
     return nsec + sec * e9;
 }
 
-long long start_timestamp = 0;
+// Capture clock vs CLOCK_MONOTONIC. Observed once per captured fragment.
+DriftEstimator drift(SAMPLE_RATE * FRAME_SIZE, packetizer.frames() * 1e9 / SAMPLE_RATE);
 
-/* This is called whenever new data is available */
-static void stream_read_callback(pa_stream *s, size_t length, void *userdata) {
-    assert(s);
-    assert(length > 0);
+CaptureBackend *capture;
 
-    while (pa_stream_readable_size(s) > 0) {
-        const void *data;
-        size_t length;
+// Trim the capture rate to follow the measured drift (--rate-correction).
+bool rate_correction = false;
+double capture_rate = SAMPLE_RATE;
 
-        // peek actually creates and fills the data vbl
-        if (pa_stream_peek(s, &data, &length) < 0) {
-            fprintf(stderr, "Read failed\n");
-            exit(1);
-            return;
-        }
+// Send straight from the capture buffer instead of going through the ring
+// and the sender thread (--zero-copy).
+bool zero_copy = false;
 
-        int used = 0;
-        while(used < length) {
-            int gonnause = min(buflen-buffill, length-used);
-            memcpy(buf+28+buffill, ((unsigned char*)data)+used, gonnause);
-            buffill += gonnause;
-            used += gonnause;
-            if(buffill == buflen) {
-                buffill = 0;
+// Packets that straddle two capture fragments are assembled here in
+// zero-copy mode. Two of them, because the one finished at the start of a
+// fragment is still queued when the next one starts at its end.
+char carry[2][PAYLOAD_MAX];
+int carry_index = 0;
 
-                if(start_timestamp == 0)
-                    start_timestamp = getnsec();
+// Volume, mute and fades, applied as PCM is copied into packets.
+Gain gain;
 
-                pa_usec_t t;
-                if (pa_stream_get_time(s, &t) < 0) {
-                    printf("Failed to get latency: %s", pa_strerror(pa_context_errno(context)));
-                    exit(1);
-                }
+// Length of the fades on start and stop (--fade), and of volume changes.
+long long fade_usec = 20000;
+#define VOLUME_RAMP_USEC 50000
 
-                //printf("%lld\n", nsec);
-                //timestamp -= latency_usec * 1000;
-                long long timestamp2 = start_timestamp + t * 1000;
-                timestamp2 += 35 * 1000000;
-
-                int sec = timestamp2 / e9;
-                int usec = (timestamp2 % e9) / 1000;
-                * (unsigned int*) (buf+0) = htonl(packet_counter);
-                * (unsigned int*) (buf+4) = 0;
-                * (unsigned int*) (buf+8) = 0xf0030001;
-                * (unsigned int*) (buf+12) = htonl(sec);
-                * (unsigned int*) (buf+16) = htonl(usec);
-                * (unsigned int*) (buf+20) =  htonl(byte_counter);
-                * (unsigned short*) (buf+24) =  0x1002;
-                * (unsigned short*) (buf+26) =  htons(44100);
-                byte_counter += buflen;
-                packet_counter += 1;
-
-                int cnt = sendto(sock, buf, 28+buflen, 0, (struct sockaddr *) &addr, addrlen);
-                if (cnt < 0) {
-                    perror("sendto");
-                    exit(1);
-                }
+// Zero-copy packets that need a gain applied are copied here instead.
+char gained[SENDER_MAX_BATCH][PAYLOAD_MAX];
+
+// Line in levels, metered as PCM goes into packets. Every
+// LEVEL_INTERVAL_USEC worth of audio they're latched for the `levels`
+// command, which reports silence once capture has been quiet for a while.
+#define LEVEL_INTERVAL_USEC 100000
+Levels levels, latched_levels;
+pa_usec_t levels_latched_at = 0;
+
+static long long usec_frames(long long usec) {
+    return usec * SAMPLE_RATE / 1000000;
+}
+
+static long long packet_timestamp(long long position) {
+    return drift.time_at(position + packetizer.payload_bytes()) + playout_offset;
+}
+
+/* Zero-copy variant of the packetizer: whole packets inside the fragment go
+ * out as {header, slice of data} iovecs, only the ones straddling fragment
+ * boundaries are copied, and any that need their gain changed. Everything is
+ * sent before returning, since the backend reclaims the data afterwards. */
+static void packetize_in_place(const char *data, size_t length) {
+    OutPacket batch[SENDER_MAX_BATCH];
+    int n = 0;
+    int bytes = packetizer.payload_bytes();
+
+    int used = 0;
+    while(used < length) {
+        OutPacket *p = &batch[n];
+        long long position = packetizer.position();
+        if (packetizer.fill() == 0 && length - used >= bytes) {
+            if (gain.unity()) {
+                meter_levels((const int16_t*) (data + used), packetizer.frames(), &levels);
+                p->payload = data + used;
+            } else {
+                gain.apply((const int16_t*) (data + used), (int16_t*) gained[n], packetizer.frames(), &levels);
+                sender_stats.bytes_copied += bytes;
+                p->payload = gained[n];
             }
+            used += bytes;
+            packetizer.add(bytes);
+        } else {
+            int gonnause = min(packetizer.room(), length-used);
+            gain.apply((const int16_t*) (data + used), (int16_t*) (carry[carry_index] + packetizer.fill()), gonnause / FRAME_SIZE, &levels);
+            sender_stats.bytes_copied += gonnause;
+            used += gonnause;
+            if (!packetizer.add(gonnause))
+                break;
+            p->payload = carry[carry_index];
+            carry_index ^= 1;
         }
 
-        // swallow the data peeked at before
-        pa_stream_drop(s);
+        p->timestamp = packet_timestamp(position);
+        p->position = position;
+        if (++n == SENDER_MAX_BATCH) {
+            sender_send(batch, n);
+            n = 0;
+        }
     }
+    if (n > 0)
+        sender_send(batch, n);
 }
 
+/* Copies PCM into block_ring, building and sending the packets is up to
+ * the sender thread. */
+static void packetize(const char *data, size_t length) {
+    if (zero_copy) {
+        packetize_in_place(data, length);
+        return;
+    }
 
-// This callback gets called when our context changes state.  We really only
-// care about when it's ready or if it has failed
-void state_cb(pa_context *c, void *userdata) {
-    pa_context_state_t state;
-    int *pa_ready = (int*) userdata;
-
-    printf("State changed\n");
-    state = pa_context_get_state(c);
-    switch  (state) {
-        // There are just here for reference
-        case PA_CONTEXT_UNCONNECTED:
-        case PA_CONTEXT_CONNECTING:
-        case PA_CONTEXT_AUTHORIZING:
-        case PA_CONTEXT_SETTING_NAME:
-        default:
-            break;
-        case PA_CONTEXT_FAILED:
-        case PA_CONTEXT_TERMINATED:
-            *pa_ready = 2;
-            break;
-        case PA_CONTEXT_READY: {
-            pa_buffer_attr buffer_attr;
-
-            if (verbose)
-                printf("Connection established.%s\n", CLEAR_LINE);
-
-            if (!(stream = pa_stream_new(c, "SonosCast", &sample_spec, NULL))) {
-                printf("pa_stream_new() failed: %s", pa_strerror(pa_context_errno(c)));
-                exit(1);
+    int used = 0;
+    while(used < length) {
+        int gonnause = min(packetizer.room(), length-used);
+        if (packetizer.fill() == 0)
+            block = block_ring.write_slot();
+        if (block) {
+            gain.apply((const int16_t*) (data + used), (int16_t*) (block->payload + packetizer.fill()), gonnause / FRAME_SIZE, &levels);
+            sender_stats.bytes_copied += gonnause;
+        } else
+            gain.skip(gonnause / FRAME_SIZE);
+        used += gonnause;
+        long long position = packetizer.position();
+        if (packetizer.add(gonnause)) {
+            if (block) {
+                block->timestamp = packet_timestamp(position);
+                block->position = position;
+                block_ring.push();
+                block = NULL;
+            } else {
+                // The sender fell behind and the ring was full, so this
+                // packet's worth of audio is gone. The gap shows up in
+                // byte_counter.
+                sender_stats.overruns++;
             }
+        }
+    }
+}
+
+/*********** Capture gaps **************/
+// Less lost audio than this is left to the drift estimator, it's within
+// the jitter of fragment delivery.
+#define MIN_GAP_NSEC 5000000
+
+CaptureStats capture_stats;
+
+// A backend reported losing an unknown amount of audio.
+bool gap_suspected = false;
+// Suspected without an overflow being counted for it yet.
+static bool gap_uncounted = false;
+
+static const char silence[PAYLOAD_MAX] = {0};
+
+/* Keep the timeline continuous over `bytes` of lost audio. Silence in
+ * their place still gets to the speakers in time if the gap is shorter
+ * than the playout offset. Longer ones would only be sent late, so they're
+ * skipped: byte_counter and the timestamps jump ahead together, as after a
+ * ring overrun, while packet_counter carries on. */
+static void fill_gap(long long bytes) {
+    bytes -= bytes % FRAME_SIZE;
+    if (bytes <= 0)
+        return;
+    capture_stats.gaps++;
+
+    long long skip = 0;
+    if (bytes * e9 / (SAMPLE_RATE * FRAME_SIZE) >= playout_offset) {
+        // Finish the packet in progress, skip the rest.
+        long long pad = packetizer.fill() ? packetizer.room() : 0;
+        skip = bytes > pad ? bytes - pad : 0;
+        bytes -= skip;
+    }
+    capture_stats.silence_bytes += bytes;
+    while (bytes > 0) {
+        int n = bytes > PAYLOAD_MAX ? PAYLOAD_MAX : bytes;
+        packetize(silence, n);
+        bytes -= n;
+    }
+    packetizer.skip(skip);
+    capture_stats.skipped_bytes += skip;
+}
 
-            // Watch for changes in the stream state to create the output file
-            pa_stream_set_state_callback(stream, stream_state_callback, NULL);
+void capture_gap(size_t length) {
+    capture_stats.overflows++;
+    if (length)
+        fill_gap(length);
+    else {
+        gap_suspected = true;
+        gap_uncounted = false;
+    }
+}
 
-            // Watch for changes in the stream's read state to write to the output file
-            pa_stream_set_read_callback(stream, stream_read_callback, NULL);
+void capture_suspect_gap() {
+    if (!gap_suspected)
+        gap_uncounted = true;
+    gap_suspected = true;
+}
 
-            // timing info
-            //pa_stream_update_timing_info(stream, stream_update_timing_callback, NULL);
+/* This is called by the capture backend whenever new data is available. */
+void capture_push(const void *data, size_t length, long long captured_at) {
+    long long start = getnsec();
+    metrics.fragment_bytes.observe(length);
+    if (!captured_at)
+        captured_at = start;
+
+    // After an overflow, the data is later than its position says by
+    // however much audio went missing.
+    if (gap_suspected && drift.locked()) {
+        long long lost = captured_at - drift.time_at(packetizer.end() + length);
+        if (lost > MIN_GAP_NSEC) {
+            if (gap_uncounted)
+                capture_stats.overflows++;
+            fill_gap(lost * (SAMPLE_RATE * FRAME_SIZE) / e9);
+        }
+    }
+    gap_suspected = false;
+    gap_uncounted = false;
+
+    // Everything up to the end of this fragment has been captured by
+    // now. Packet timestamps come from the estimator rather than straight
+    // from here, which keeps them on the monotonic clock's rate and free
+    // of our own wakeup jitter.
+    drift.update(packetizer.end() + length, captured_at);
+
+    packetize((const char*) data, length);
+    if (levels.frames >= usec_frames(LEVEL_INTERVAL_USEC)) {
+        latched_levels = levels;
+        levels_latched_at = pa_rtclock_now();
+        levels.clear();
+    }
+    metrics.capture_callback_us.observe((getnsec() - start) / 1000);
+}
 
-            // Set properties of the record buffer
-            pa_zero(buffer_attr);
-            buffer_attr.maxlength = buflen;
-            buffer_attr.fragsize = buflen;
+/*********** Control **************/
+// The last latched levels, or none if capture has stopped delivering.
+static Levels current_levels() {
+    if (pa_rtclock_now() - levels_latched_at < 3 * LEVEL_INTERVAL_USEC)
+        return latched_levels;
+    return Levels();
+}
 
-            int flags = 0;
-            flags |= PA_STREAM_AUTO_TIMING_UPDATE;
-            flags |= PA_STREAM_ADJUST_LATENCY;
-            flags |= PA_STREAM_INTERPOLATE_TIMING;
+// Whether capture is running. It is while any session is: with --control
+// the process stays up between transmissions and waits to be told to start.
+bool streaming = false;
+
+// Where `start` without a destination sends to (--dest).
+struct sockaddr_in default_dest;
+#define DEFAULT_SESSION "default"
+
+pa_mainloop_api *mainloop_api;
+
+// The last session to stop, while its audio fades out. It's only dropped
+// once the faded packets have been sent, after stop_delay_usec.
+Session *stopping = NULL;
+pa_time_event *stop_event = NULL;
+long long stop_delay_usec;
+
+static void start_streaming() {
+    // Forget the partial packet and the clock fit of the last transmission,
+    // the capture timeline restarts from scratch.
+    block = NULL;
+    packetizer.discard();
+    gap_suspected = false;
+    gap_uncounted = false;
+    drift.reset();
+    gain.fade_in(usec_frames(fade_usec));
+
+    streaming = true;
+    capture->set_active(true);
+}
 
-            const char* device = NULL;
+static void stop_streaming() {
+    streaming = false;
+    capture->set_active(false);
+    sender_end_of_stream();
+}
 
-            // and start recording
-            if (pa_stream_connect_record(stream, device, &buffer_attr, (pa_stream_flags_t)flags) < 0) {
-                printf("pa_stream_connect_record() failed: %s", pa_strerror(pa_context_errno(c)));
-                exit(1);
-            }
-            break;
+// A group joining while others are listening picks the running stream up
+// from the next packet on.
+static Session *start_session(const char *id, const struct sockaddr_in &dest) {
+    if (stopping) {
+        // Someone's listening again, fade back in from wherever the fade
+        // out got to. A different group doesn't need the old one any more.
+        mainloop_api->time_restart(stop_event, NULL);
+        if (strcmp(stopping->id, id))
+            session_stop(stopping);
+        stopping = NULL;
+        gain.fade_in(usec_frames(fade_usec));
+    }
+
+    Session *s = session_start(id, dest, getnsec());
+    if (s && !streaming)
+        start_streaming();
+    return s;
+}
+
+static void stop_faded_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    a->time_restart(e, NULL);
+    Session *s = stopping;
+    stopping = NULL;
+    session_stop(s);
+    if (streaming && session_count() == 0)
+        stop_streaming();
+}
+
+static void stop_session(Session *s) {
+    if (s == stopping)
+        return;
+
+    // The last one hears the audio fade out rather than stop dead.
+    if (streaming && session_count() == 1 && fade_usec) {
+        stopping = s;
+        gain.fade_out(usec_frames(fade_usec));
+        struct timeval tv;
+        rtclock_timeval(&tv, pa_rtclock_now() + stop_delay_usec);
+        if (stop_event)
+            mainloop_api->time_restart(stop_event, &tv);
+        else
+            stop_event = mainloop_api->time_new(mainloop_api, &tv, stop_faded_callback, NULL);
+        return;
+    }
+
+    session_stop(s);
+    if (streaming && session_count() == 0)
+        stop_streaming();
+}
+
+/* Commands from server.py. Replies start with "ok" or "error". Sessions
+ * are named by the CoordinatorID of their group; commands without one are
+ * about the --dest session. */
+static void control_command(const char *line, char *reply, size_t reply_len) {
+    char cmd[16], id[SESSION_ID_MAX], dest[64];
+    int args = sscanf(line, "%15s %63s %63s", cmd, id, dest);
+    if (args < 2)
+        strcpy(id, DEFAULT_SESSION);
+
+    if (args >= 1 && !strcmp(cmd, "start")) {
+        struct sockaddr_in addr = default_dest;
+        if (args == 3 && !session_parse_dest(dest, &addr))
+            snprintf(reply, reply_len, "error bad destination %s", dest);
+        else if (!start_session(id, addr))
+            snprintf(reply, reply_len, "error all %d sessions taken", MAX_SESSIONS);
+        else
+            snprintf(reply, reply_len, "ok");
+    } else if (args >= 1 && !strcmp(cmd, "stop")) {
+        Session *s = session_find(id);
+        if (s)
+            stop_session(s);
+        snprintf(reply, reply_len, "ok");
+    } else if (args >= 1 && !strcmp(cmd, "status")) {
+        Session *s = session_find(id);
+        long long first = s ? s->first_packet_nsec.load() : 0;
+        double first_ms = first ? (first - s->start_command_nsec) / 1e6 : -1;
+        snprintf(reply, reply_len, "ok %s packets=%llu underruns=%u overruns=%u first_packet_ms=%.2f sessions=%d",
+                 s ? "running" : "stopped", s ? s->packets.load() : 0,
+                 sender_stats.underruns.load(), sender_stats.overruns.load(),
+                 first_ms, session_count());
+    } else if (args >= 1 && !strcmp(cmd, "volume")) {
+        // 0-100, like RenderingControl
+        int volume;
+        if (sscanf(line, "%*s %d", &volume) != 1 || volume < 0 || volume > 100)
+            snprintf(reply, reply_len, "error volume is 0-100");
+        else {
+            gain.set_gain(gain_from_volume(volume), usec_frames(VOLUME_RAMP_USEC));
+            snprintf(reply, reply_len, "ok");
         }
+    } else if (args >= 1 && !strcmp(cmd, "mute")) {
+        int mute;
+        if (sscanf(line, "%*s %d", &mute) != 1)
+            snprintf(reply, reply_len, "error mute takes 0 or 1");
+        else {
+            gain.set_mute(mute, usec_frames(fade_usec));
+            snprintf(reply, reply_len, "ok");
+        }
+    } else if (args >= 1 && !strcmp(cmd, "levels")) {
+        // dBFS over the last LEVEL_INTERVAL_USEC of audio
+        Levels l = current_levels();
+        snprintf(reply, reply_len, "ok peak_left=%.1f peak_right=%.1f rms_left=%.1f rms_right=%.1f",
+                 l.peak_db(0), l.peak_db(1), l.rms_db(0), l.rms_db(1));
+    } else if (args >= 1 && !strcmp(cmd, "metrics")) {
+        float max_rate;
+        // "ok " followed by the name=value pairs
+        int n = snprintf(reply, reply_len, "ok ");
+        MetricsWriter w(reply + n, reply_len - n);
+        w.value("sonoscast_streaming", streaming);
+        w.value("sonoscast_sessions", session_count());
+        w.value("sonoscast_gain", gain.gain());
+        w.value("sonoscast_muted", gain.muted());
+        Levels l = current_levels();
+        w.value("sonoscast_level_peak_dbfs{channel=\"left\"}", l.peak_db(0));
+        w.value("sonoscast_level_peak_dbfs{channel=\"right\"}", l.peak_db(1));
+        w.value("sonoscast_level_rms_dbfs{channel=\"left\"}", l.rms_db(0));
+        w.value("sonoscast_level_rms_dbfs{channel=\"right\"}", l.rms_db(1));
+        w.value("sonoscast_packets_sent_total", sender_stats.packets.load());
+        w.value("sonoscast_send_syscalls_total", sender_stats.syscalls.load());
+        w.value("sonoscast_send_errors_total", sender_stats.send_errors.load());
+        w.value("sonoscast_underruns_total", sender_stats.underruns.load());
+        w.value("sonoscast_overruns_total", sender_stats.overruns.load());
+        w.value("sonoscast_late_packets_total", sender_stats.late.load());
+        w.value("sonoscast_repaired_total", repair_resent());
+        w.value("sonoscast_recorder_dropped_total", recorder_dropped.load());
+        w.value("sonoscast_bytes_sent_total", sender_stats.bytes_sent.load());
+        w.value("sonoscast_bytes_copied_total", sender_stats.bytes_copied.load());
+        w.value("sonoscast_ring_fill", block_ring.size());
+        w.value("sonoscast_drift_ppm", drift.drift_ppm());
+        w.value("sonoscast_capture_discontinuities_total", drift.discontinuities());
+        w.value("sonoscast_capture_overflows_total", capture_stats.overflows);
+        w.value("sonoscast_capture_underflows_total", capture_stats.underflows);
+        w.value("sonoscast_capture_gaps_total", capture_stats.gaps);
+        w.value("sonoscast_capture_silence_bytes_total", capture_stats.silence_bytes);
+        w.value("sonoscast_capture_skipped_bytes_total", capture_stats.skipped_bytes);
+        w.value("sonoscast_sntp_requests_total", sntp_stats.requests.load());
+        w.value("sonoscast_sntp_errors_total", sntp_stats.errors.load());
+        w.value("sonoscast_sntp_clients", sntp_active_clients(60, &max_rate));
+        w.histogram("sonoscast_capture_callback_us", metrics.capture_callback_us);
+        w.histogram("sonoscast_fragment_bytes", metrics.fragment_bytes);
+        w.histogram("sonoscast_timestamp_lead_us", metrics.timestamp_lead_us);
+        w.histogram("sonoscast_sntp_turnaround_us", sntp_stats.turnaround);
+        if (!w.ok())
+            snprintf(reply, reply_len, "error metrics don't fit in a reply");
+    } else
+        snprintf(reply, reply_len, "error unknown command");
+}
+
+/*********** Reporting **************/
+/* Periodic report of how the capture->send pipeline is doing. */
+static void stats_timer_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    static unsigned long long last_packets = 0, last_syscalls = 0;
+    static long long last_cpu = 0;
+
+    unsigned long long packets = sender_stats.packets.load();
+    unsigned long long syscalls = sender_stats.syscalls.load();
+    long long cpu = sender_cpu_nsec();
+    double interval = (double) STATS_INTERVAL_USEC / PA_USEC_PER_SEC;
+
+    printf("Ring fill %u/%u, %d sessions, %llu packets sent, %llu send errors, %u underruns, %u overruns, %llu repaired\n",
+           block_ring.size(), block_ring.capacity(), session_count(),
+           packets, sender_stats.send_errors.load(), sender_stats.underruns.load(), sender_stats.overruns.load(),
+           repair_resent());
+    if (packets > last_packets)
+        printf("Sender: %.1f syscalls/s, %.2f us CPU per packet, %llu of %llu payload bytes copied\n",
+               (syscalls - last_syscalls) / interval,
+               (cpu - last_cpu) / 1000.0 / (packets - last_packets),
+               sender_stats.bytes_copied.load(), sender_stats.bytes_sent.load());
+
+    // Packets going out closer to their playout time than the network
+    // needs will be late at the speakers, or soon will be.
+    static unsigned last_late = 0;
+    long long margin = sender_stats.margin_us_min.exchange(LLONG_MAX);
+    unsigned late = sender_stats.late.load() - last_late;
+    last_late += late;
+    if (margin != LLONG_MAX) {
+        printf("Playout margin: %.1f ms at least\n", margin / 1000.0);
+        if (late)
+            printf("Warning: %u packets sent after their playout time, raise --playout-offset or use --latency=robust\n", late);
+        else if (margin < MIN_NETWORK_MARGIN_USEC)
+            printf("Warning: packets leave only %.1f ms before playout, less than the %d ms the network needs\n",
+                   margin / 1000.0, MIN_NETWORK_MARGIN_USEC / 1000);
     }
+
+    float max_rate;
+    int clients = sntp_active_clients(60, &max_rate);
+    printf("SNTP: %llu requests, %llu errors, %d clients (busiest %.1f req/s), turnaround p50 < %u us, p99 < %u us\n",
+           sntp_stats.requests.load(), sntp_stats.errors.load(), clients, max_rate,
+           sntp_turnaround_percentile(0.5), sntp_turnaround_percentile(0.99));
+
+    if (capture_stats.overflows || capture_stats.underflows)
+        printf("Capture: %u overflows, %u underflows, %u gaps (%.1f ms filled with silence, %.1f ms skipped)\n",
+               capture_stats.overflows, capture_stats.underflows, capture_stats.gaps,
+               capture_stats.silence_bytes * 1e3 / (SAMPLE_RATE * FRAME_SIZE),
+               capture_stats.skipped_bytes * 1e3 / (SAMPLE_RATE * FRAME_SIZE));
+
+    if (drift.locked())
+        printf("Capture clock drift: %+.2f ppm (capture rate %.3f Hz, %u discontinuities)\n",
+               drift.drift_ppm(), capture_rate, drift.discontinuities());
+
+    if (rate_correction && drift.locked()) {
+        // The backend may only manage part of the correction, e.g. whole Hz
+        // with Pulse resampling. The rest is left to the timestamps.
+        double rate = capture->set_rate(capture_rate * (1 + drift.drift_ppm() / 1e6));
+        if (rate && rate != capture_rate) {
+            drift.rebase_drift((rate / capture_rate - 1) * 1e6);
+            capture_rate = rate;
+        }
+    }
+
+    last_packets = packets;
+    last_syscalls = syscalls;
+    last_cpu = cpu;
+
+    struct timeval next;
+    a->time_restart(e, rtclock_timeval(&next, pa_rtclock_now() + STATS_INTERVAL_USEC));
 }
 
+/*********** Benchmark mode **************/
+long long bench_start_nsec;
+long long bench_start_cpu;
+struct rusage bench_start_usage;
+bool wire_probe = false;
+
+// Which I/O engine is running (--io).
+bool use_uring = false;
+
+static long long process_cpu_nsec() {
+    timespec tm;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tm);
+    return tm.tv_sec * e9 + tm.tv_nsec;
+}
 
-void sntp_thread_main() {
-    make_realtime(5);
-    sntp_loop();
+/* End of a --bench run: report throughput, cost and emission jitter. */
+static void bench_done_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    double elapsed = (getnsec() - bench_start_nsec) / 1e9;
+    long long cpu = process_cpu_nsec() - bench_start_cpu;
+    unsigned long long packets = sender_stats.packets.load();
+
+    unsigned long long n = sender_stats.intervals.load();
+    double mean = n ? (double) sender_stats.interval_us_sum.load() / n : 0;
+    double var = n ? (double) sender_stats.interval_us_sq_sum.load() / n - mean * mean : 0;
+
+    // Whole process, so threads the engine doesn't need count too.
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long voluntary = usage.ru_nvcsw - bench_start_usage.ru_nvcsw;
+    long involuntary = usage.ru_nivcsw - bench_start_usage.ru_nivcsw;
+
+    printf("Benchmark: %llu packets in %.2f s, %s I/O\n", packets, elapsed, use_uring ? "io_uring" : "threaded");
+    printf("  %.1f packets/s\n", packets / elapsed);
+    printf("  %.0f ns CPU per packet (%.0f ns in the sender)\n",
+           packets ? (double) cpu / packets : 0, packets ? (double) sender_cpu_nsec() / packets : 0);
+    printf("  %.0f context switches/s (%ld voluntary, %ld involuntary), %.2f per packet, %.1f syscalls/s sending\n",
+           (voluntary + involuntary) / elapsed, voluntary, involuntary,
+           packets ? (double) (voluntary + involuntary) / packets : 0, sender_stats.syscalls.load() / elapsed);
+    printf("  emission interval %.1f us mean, %.1f us stddev, %u us max (nominal %.1f us)\n",
+           mean, var > 0 ? sqrt(var) : 0, sender_stats.interval_us_max.load(),
+           packetizer.frames() * 1e6 / SAMPLE_RATE);
+    printf("  %u underruns, %u overruns\n", sender_stats.underruns.load(), sender_stats.overruns.load());
+    printf("  %llu of %llu payload bytes copied\n", sender_stats.bytes_copied.load(), sender_stats.bytes_sent.load());
+    if (wire_probe)
+        wire_probe_report(packetizer.frames() * 1e6 / SAMPLE_RATE);
+
+    exit(0);
 }
 
-int main() {
-    make_realtime(5);
-    std::thread sntp_thread(sntp_thread_main);
 
-    /* set up socket */
+static void usage(const char *argv0) {
+    printf("Usage: %s [options]\n"
+           "  --source=pulse|alsa:DEVICE|shm:PATH|sine|noise|silence|file:PATH\n"
+           "                                                where the audio comes from (default pulse);\n"
+           "                                                shm: takes it from local producers connecting to PATH\n"
+           "  --fast                                        generate synthetic audio as fast as it can be sent\n"
+           "  --bench=SECONDS                               run for SECONDS, then report throughput and jitter\n"
+           "  --latency=low|default|robust                  playout offset, packet and buffer sizes (default default)\n"
+           "  --playout-offset=MS                           play packets MS after capture, overriding the profile\n"
+           "  --frames-per-packet=N                         audio frames per packet, overriding the profile\n"
+           "  --dest=IP:PORT                                where to send packets (default 225.238.76.46:6982)\n"
+           "  --send-mode=single|mmsg|gso                   how to hand packets to the kernel (default mmsg)\n"
+           "  --pacing=period|launch|txtime                 space packets one period apart, or send each at a launch\n"
+           "                                                time following its audio timestamp, kept by the sender\n"
+           "                                                thread or by the fq/etf qdisc (default period)\n"
+           "  --zero-copy                                   send from the capture buffer, without the sender thread\n"
+           "  --io=threads|uring                            network I/O from a thread each for sending, SNTP and repairs,\n"
+           "                                                or all of it from one io_uring on the sender thread\n"
+           "                                                (needs make IO_URING=1; default threads)\n"
+           "  --rate-correction                             follow capture clock drift with the capture rate\n"
+           "  --sntp-threads=N                              SO_REUSEPORT shards for the SNTP server\n"
+           "  --capture-cpus=LIST                           pin capture to these CPUs (e.g. 2 or 0-1,4)\n"
+           "  --sender-cpus=LIST                            pin the sender thread to these CPUs\n"
+           "  --sntp-cpus=LIST                              pin the SNTP and repair threads to these CPUs\n"
+           "  --record=PATH                                 log every packet sent to PATH, for ./analyze\n"
+           "  --rt-test[=SECONDS]                           measure realtime wakeup latency on the sender's CPUs\n"
+           "                                                at startup (default 2 s) and check it against the margin\n"
+           "  --capture-format=s16|s24|s24-32|s32|float     sample format to record from PulseAudio in (default s16)\n"
+           "  --capture-channels=N                          channels to record from PulseAudio (default 2)\n"
+           "  --dither                                      TPDF dither when converting float capture\n"
+           "  --capture-rate=HZ                             sample rate to record from PulseAudio in (default 44100)\n"
+           "  --resample-quality=fast|medium|best           resampler preset when it isn't 44100 (default best)\n"
+           "  --bench-resample[=HZ]                         measure the resampler from HZ (default 48000) and exit\n"
+           "  --bench-convert                               benchmark the sample format conversion kernels and exit\n"
+           "  --bench-gain                                  benchmark the volume and metering kernels and exit\n"
+           "  --bench-packetizer                            check packet headers against known good ones, time them and exit\n"
+           "  --fade=MS                                     fade in and out over MS on start and stop (default 20, 0 for none)\n"
+           "  --control=PATH                                stay up and wait for start/stop/status commands on\n"
+           "                                                a Unix socket at PATH, starting out stopped;\n"
+           "                                                `start ID IP:PORT` adds a session per group\n",
+           argv0);
+}
+
+int main(int argc, char **argv) {
+    SendMode send_mode = SEND_MMSG;
+    Pacing pacing = PACE_PERIOD;
+    bool txtime = false;
+    int sntp_threads = 1;
+    const char *source = "pulse";
+    bool fast = false;
+    int bench_seconds = 0;
+    const char *dest = "225.238.76.46:6982";
+    const char *control_path = NULL;
+    PulseFormat pulse_format = {SAMPLE_S16, 2, false, SAMPLE_RATE, RESAMPLE_BEST};
+    const LatencyProfile *profile = &profiles[1];
+    int offset_ms = 0;
+    int frames_per_packet = 0;
+    int rt_test_seconds = 0;
+    const char *record_path = NULL;
+
+    static struct option long_options[] = {
+        {"source", required_argument, NULL, 's'},
+        {"fast", no_argument, NULL, 'f'},
+        {"bench", required_argument, NULL, 'b'},
+        {"dest", required_argument, NULL, 'd'},
+        {"send-mode", required_argument, NULL, 'm'},
+        {"pacing", required_argument, NULL, 'p'},
+        {"zero-copy", no_argument, NULL, 'z'},
+        {"rate-correction", no_argument, NULL, 'r'},
+        {"sntp-threads", required_argument, NULL, 't'},
+        {"control", required_argument, NULL, 'c'},
+        {"capture-format", required_argument, NULL, 'F'},
+        {"capture-channels", required_argument, NULL, 'C'},
+        {"dither", no_argument, NULL, 'D'},
+        {"bench-convert", no_argument, NULL, 'B'},
+        {"capture-rate", required_argument, NULL, 'R'},
+        {"resample-quality", required_argument, NULL, 'Q'},
+        {"bench-resample", optional_argument, NULL, 'S'},
+        {"latency", required_argument, NULL, 'L'},
+        {"playout-offset", required_argument, NULL, 'O'},
+        {"frames-per-packet", required_argument, NULL, 'P'},
+        {"capture-cpus", required_argument, NULL, 'A'},
+        {"sender-cpus", required_argument, NULL, 'E'},
+        {"sntp-cpus", required_argument, NULL, 'N'},
+        {"rt-test", optional_argument, NULL, 'T'},
+        {"record", required_argument, NULL, 'W'},
+        {"fade", required_argument, NULL, 'I'},
+        {"bench-gain", no_argument, NULL, 'G'},
+        {"bench-packetizer", no_argument, NULL, 'K'},
+        {"io", required_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                source = optarg;
+                break;
+            case 'f':
+                fast = true;
+                break;
+            case 'b':
+                bench_seconds = atoi(optarg);
+                break;
+            case 'd':
+                dest = optarg;
+                break;
+            case 'm':
+                if (!strcmp(optarg, "single"))
+                    send_mode = SEND_SINGLE;
+                else if (!strcmp(optarg, "mmsg"))
+                    send_mode = SEND_MMSG;
+                else if (!strcmp(optarg, "gso"))
+                    send_mode = SEND_GSO;
+                else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                if (!strcmp(optarg, "period"))
+                    pacing = PACE_PERIOD;
+                else if (!strcmp(optarg, "launch"))
+                    pacing = PACE_LAUNCH;
+                else if (!strcmp(optarg, "txtime")) {
+                    pacing = PACE_LAUNCH;
+                    txtime = true;
+                } else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'z':
+                zero_copy = true;
+                break;
+            case 'r':
+                rate_correction = true;
+                break;
+            case 't':
+                sntp_threads = atoi(optarg);
+                break;
+            case 'c':
+                control_path = optarg;
+                break;
+            case 'F':
+                if (!sample_format_parse(optarg, &pulse_format.format)) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                pulse_format.channels = atoi(optarg);
+                if (pulse_format.channels < 1 || pulse_format.channels > 8) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'D':
+                pulse_format.dither = true;
+                break;
+            case 'B':
+                exit(convert_benchmark() ? 1 : 0);
+            case 'R':
+                pulse_format.rate = atoi(optarg);
+                if (pulse_format.rate < 8000 || pulse_format.rate > 384000) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                if (!resample_quality_parse(optarg, &pulse_format.quality)) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                exit(resample_benchmark(optarg ? atoi(optarg) : 48000) ? 1 : 0);
+            case 'L':
+                profile = NULL;
+                for (unsigned i = 0; i < PROFILES; i++)
+                    if (!strcmp(optarg, profiles[i].name))
+                        profile = &profiles[i];
+                if (!profile) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'O':
+                offset_ms = atoi(optarg);
+                if (offset_ms <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                frames_per_packet = atoi(optarg);
+                if (frames_per_packet <= 0 || frames_per_packet * FRAME_SIZE > PAYLOAD_MAX) {
+                    printf("Frames per packet must be between 1 and %d\n", PAYLOAD_MAX / FRAME_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'A':
+            case 'E':
+            case 'N':
+                if (!realtime_set_cpus(c == 'A' ? RT_CAPTURE : c == 'E' ? RT_SENDER : RT_SNTP, optarg)) {
+                    printf("Bad CPU list %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                rt_test_seconds = optarg ? atoi(optarg) : 2;
+                if (rt_test_seconds <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'W':
+                record_path = optarg;
+                break;
+            case 'I':
+                fade_usec = atoi(optarg) * 1000LL;
+                if (fade_usec < 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'G':
+                exit(gain_benchmark() ? 1 : 0);
+            case 'K':
+                exit(packetizer_benchmark() ? 1 : 0);
+            case 'i':
+                if (!strcmp(optarg, "threads"))
+                    use_uring = false;
+                else if (!strcmp(optarg, "uring"))
+                    use_uring = true;
+                else {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(c == 'h' ? 0 : 1);
+        }
+    }
+
+    playout_offset = (offset_ms ? offset_ms : profile->offset_ms) * 1000000LL;
+    packetizer.set_frames(frames_per_packet ? frames_per_packet : profile->frames_per_packet);
+    int buflen = packetizer.payload_bytes();
+    int fragsize = buflen * profile->fragment_packets;
+    // Whole packets, and at least two fragments.
+    int maxlength = profile->buffer_ms * SAMPLE_RATE / 1000 * FRAME_SIZE;
+    maxlength -= maxlength % buflen;
+    if (maxlength < fragsize * 2)
+        maxlength = fragsize * 2;
+    drift = DriftEstimator(SAMPLE_RATE * FRAME_SIZE, fragsize * 1e9 / (SAMPLE_RATE * FRAME_SIZE));
+
+    // What's left of the offset once the packet has been captured, handed
+    // over and waited its turn in the sender is for the network. The period
+    // paced sender lets the ring run one block above the prefill before
+    // catching up. Launch times leave a whole fragment for delivery and
+    // the prefill for its jitter.
+    double packet_ms = buflen * 1e3 / (SAMPLE_RATE * FRAME_SIZE);
+    double fragment_ms = fragsize * 1e3 / (SAMPLE_RATE * FRAME_SIZE);
+    double launch_delay_ms = fragment_ms + PREFILL_BLOCKS * packet_ms;
+    double queue_ms = zero_copy || fast ? 0 : (PREFILL_BLOCKS + 1) * packet_ms;
+    double margin_ms = playout_offset / 1e6 - fragment_ms - queue_ms;
+    if (pacing == PACE_LAUNCH && !fast && (!zero_copy || txtime))
+        margin_ms = playout_offset / 1e6 - launch_delay_ms;
+    printf("Latency: %.0f ms playout offset, %d frames (%.1f ms) per packet, %d/%d byte fragments/buffer, %.1f ms left for the network\n",
+           playout_offset / 1e6, buflen / FRAME_SIZE, packet_ms, fragsize, maxlength, margin_ms);
+    if (margin_ms * 1000 < MIN_NETWORK_MARGIN_USEC)
+        printf("Warning: less than %d ms left for the network, packets will arrive late. Raise --playout-offset.\n",
+               MIN_NETWORK_MARGIN_USEC / 1000);
+
+    if (!strcmp(source, "pulse"))
+        capture = pulse_capture_new(fragsize, maxlength, rate_correction, pulse_format);
+    else if (!strncmp(source, "alsa:", 5)) {
+        if (!(capture = alsa_capture_new(source + 5, fragsize)))
+            exit(1);
+    } else if (!strncmp(source, "shm:", 4)) {
+        if (!(capture = shm_capture_new(source + 4, fragsize)))
+            exit(1);
+    } else if (!(capture = synth_capture_new(source, fragsize, !fast))) {
+        printf("Can't use source %s\n", source);
+        usage(argv[0]);
+        exit(1);
+    }
+
+    realtime_init();
+    if (rt_test_seconds) {
+        // Wakeups as late as this cut into what's left for the network.
+        LatencyTest test;
+        printf("Measuring wakeup latency for %d s...\n", rt_test_seconds);
+        if (realtime_latency_test(RT_SENDER, 5, rt_test_seconds, RT_TEST_INTERVAL_USEC, &test)) {
+            printf("Wakeup latency over %u wakeups: p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n",
+                   test.samples, test.p50_us, test.p99_us, test.p999_us, test.max_us);
+            if (test.max_us / 1000 > margin_ms - MIN_NETWORK_MARGIN_USEC / 1000.0)
+                printf("Warning: this host can't hold the %.0f ms playout offset, raise --playout-offset or use --latency=robust\n",
+                       playout_offset / 1e6);
+        }
+    }
+
+    if (use_uring && zero_copy) {
+        printf("--io=uring sends from the sender thread, it can't be combined with --zero-copy\n");
+        exit(1);
+    }
+
+    make_realtime(RT_CAPTURE, 5);
+
+    if (!session_parse_dest(dest, &default_dest)) {
+        printf("Bad destination %s, expected IP:PORT\n", dest);
+        exit(1);
+    }
+
+    /* set up socket, shared by all sessions */
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         perror("socket");
         exit(1);
     }
-    bzero((char *)&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(6982);
-    addrlen = sizeof(addr);
 
     /* send */
-    addr.sin_addr.s_addr = inet_addr("225.238.76.46");
+    repair_init(REPAIR_HISTORY_SECONDS, HEADER_LEN+buflen, SAMPLE_RATE * FRAME_SIZE / buflen + 1);
+    if (use_uring && !uring_init(sock, HEADER_LEN+buflen)) {
+        printf("Using threads for network I/O instead\n");
+        use_uring = false;
+    }
+    if (use_uring)
+        send_mode = SEND_URING;
+    else {
+        sntp_start(sntp_threads);
+        repair_start();
+    }
+    sender_init(sock, buflen, send_mode);
+    if (record_path)
+        recorder_start(record_path, buflen, playout_offset);
+
+    clockid_t txtime_clock = CLOCK_MONOTONIC;
+    if (txtime && use_uring) {
+        // Launch times go in a control message, which the ring's sends don't have.
+        printf("--io=uring paces from the ring's timeouts rather than SO_TXTIME\n");
+        txtime = false;
+    } else if (txtime && (fast || !txtime_enable(sock, default_dest, &txtime_clock))) {
+        printf("Pacing packets from the sender thread instead of the qdisc\n");
+        txtime = false;
+    }
+    long long launch_lead = playout_offset - (long long) (launch_delay_ms * 1e6);
+    // The end of a fade out has been sent a fragment, the prefill and a
+    // period after it was played into the capture side.
+    stop_delay_usec = fade_usec + (long long) ((launch_delay_ms + packet_ms) * 1000);
+    sender_set_launch(launch_lead, txtime, txtime_clock);
+    if (!zero_copy)
+        sender_start(fast ? PACE_NONE : pacing);
 
     // Define our pulse audio loop and connection variables
     pa_mainloop *pa_ml;
     pa_mainloop_api *pa_mlapi;
+    struct timeval tv;
 
-    // Create a mainloop API and connection to the default server
+    // Create a mainloop API. Every capture backend runs off it, whether
+    // or not it talks to a pulse server.
     pa_ml = pa_mainloop_new();
     pa_mlapi = pa_mainloop_get_api(pa_ml);
-    context = pa_context_new(pa_mlapi, "test");
+    mainloop_api = pa_mlapi;
+
+    // A daemon does all the slow setup (RealtimeKit, sockets, the pulse
+    // connection) right away, but holds capture until told to start.
+    // Otherwise there's just the one session, to --dest, from the start.
+    if (control_path) {
+        capture->set_active(false);
+        control_start(pa_mlapi, control_path, control_command);
+    } else {
+        session_start(DEFAULT_SESSION, default_dest, getnsec());
+        gain.fade_in(usec_frames(fade_usec));
+        streaming = true;
+    }
+    capture->start(pa_mlapi);
+
+    if (verbose && !bench_seconds)
+        pa_mlapi->time_new(pa_mlapi, rtclock_timeval(&tv, pa_rtclock_now() + STATS_INTERVAL_USEC), stats_timer_callback, NULL);
 
-    // This function connects to the pulse server
-    pa_context_connect(context, NULL, (pa_context_flags_t)0, NULL);
+    if (bench_seconds) {
+        wire_probe = wire_probe_start(default_dest, launch_lead);
+        bench_start_nsec = getnsec();
+        bench_start_cpu = process_cpu_nsec();
+        getrusage(RUSAGE_SELF, &bench_start_usage);
+        pa_mlapi->time_new(pa_mlapi, rtclock_timeval(&tv, pa_rtclock_now() + bench_seconds * PA_USEC_PER_SEC), bench_done_callback, NULL);
+    }
 
-    // This function defines a callback so the server will tell us its state.
-    pa_context_set_state_callback(context, state_cb, NULL);
+    // Everything's set up: keep it in RAM from now on.
+    realtime_prefault(carry, sizeof(carry));
+    realtime_lock_memory();
 
     if (pa_mainloop_run(pa_ml, &ret) < 0) {
         printf("pa_mainloop_run() failed.");
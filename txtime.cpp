@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/net_tstamp.h>
+
+#include "txtime.h"
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#endif
+
+// Index of the interface packets to `dest` go out through, or 0.
+static int egress_ifindex(const struct sockaddr_in &dest) {
+    // Connecting a UDP socket does the route lookup without sending
+    // anything, and tells which local address was picked.
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0)
+        return 0;
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    int ok = connect(s, (const struct sockaddr*) &dest, sizeof(dest)) == 0 &&
+             getsockname(s, (struct sockaddr*) &local, &len) == 0;
+    close(s);
+    if (!ok)
+        return 0;
+
+    struct ifaddrs *ifs;
+    if (getifaddrs(&ifs) < 0)
+        return 0;
+    int index = 0;
+    for (struct ifaddrs *i = ifs; i && !index; i = i->ifa_next)
+        if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET &&
+            ((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr)
+            index = if_nametoindex(i->ifa_name);
+    freeifaddrs(ifs);
+    return index;
+}
+
+// Look through the qdiscs of an interface for fq or etf. Returns "fq",
+// "etf", or NULL if there's neither. Multiqueue devices have them as
+// children of mq or mqprio, so every qdisc on the interface counts.
+static const char *pacing_qdisc(int ifindex) {
+    int s = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (s < 0)
+        return NULL;
+
+    struct {
+        struct nlmsghdr nh;
+        struct tcmsg tc;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = sizeof(req);
+    req.nh.nlmsg_type = RTM_GETQDISC;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.tc.tcm_family = AF_UNSPEC;
+    req.tc.tcm_ifindex = ifindex;
+    if (send(s, &req, sizeof(req), 0) < 0) {
+        close(s);
+        return NULL;
+    }
+
+    const char *found = NULL;
+    static char buf[16384];
+    bool done = false;
+    while (!done) {
+        int n = recv(s, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        for (struct nlmsghdr *nh = (struct nlmsghdr*) buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+                done = true;
+                break;
+            }
+            struct tcmsg *tc = (struct tcmsg*) NLMSG_DATA(nh);
+            if (tc->tcm_ifindex != ifindex)
+                continue;
+            int len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+            for (struct rtattr *a = (struct rtattr*) ((char*) tc + NLMSG_ALIGN(sizeof(*tc))); RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+                if (a->rta_type != TCA_KIND)
+                    continue;
+                const char *kind = (const char*) RTA_DATA(a);
+                // etf wins: it wants its own clock, and is only there if
+                // someone set it up on purpose.
+                if (!strcmp(kind, "etf"))
+                    found = "etf";
+                else if (!strcmp(kind, "fq") && !found)
+                    found = "fq";
+            }
+        }
+    }
+    close(s);
+    return found;
+}
+
+bool txtime_enable(int sock, const struct sockaddr_in &dest, clockid_t *clock) {
+    int ifindex = egress_ifindex(dest);
+    char ifname[IF_NAMESIZE] = "?";
+    if (!ifindex) {
+        printf("SO_TXTIME: no route to %s\n", inet_ntoa(dest.sin_addr));
+        return false;
+    }
+    if_indextoname(ifindex, ifname);
+
+    const char *qdisc = pacing_qdisc(ifindex);
+    if (!qdisc) {
+        printf("SO_TXTIME: no fq or etf qdisc on %s, launch times would be ignored\n", ifname);
+        return false;
+    }
+
+    struct sock_txtime cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = !strcmp(qdisc, "etf") ? CLOCK_TAI : CLOCK_MONOTONIC;
+    if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+        printf("SO_TXTIME: %s\n", strerror(errno));
+        return false;
+    }
+
+    printf("SO_TXTIME: pacing through %s on %s\n", qdisc, ifname);
+    *clock = cfg.clockid;
+    return true;
+}
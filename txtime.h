@@ -0,0 +1,19 @@
+#pragma once
+
+#include <time.h>
+#include <netinet/in.h>
+
+/* Kernel side pacing with SO_TXTIME: every packet carries the time it's
+ * meant to leave, and the fq or etf qdisc holds it back until then. That
+ * only works if one of them is set up on the interface the packets leave
+ * through, e.g.
+ *
+ *     tc qdisc replace dev eth0 root fq
+ *
+ * Without one the kernel silently ignores the launch times. */
+
+// Check that the interface `dest` is routed through has an fq or etf
+// qdisc, and enable SO_TXTIME on `sock` for it. On success, sets `clock`
+// to the clock launch times must be given on (CLOCK_MONOTONIC for fq,
+// CLOCK_TAI for etf). Prints why not and returns false otherwise.
+bool txtime_enable(int sock, const struct sockaddr_in &dest, clockid_t *clock);
@@ -0,0 +1,536 @@
+#ifdef HAVE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <liburing.h>
+
+#include "realtime.h"
+#include "repair.h"
+#include "sender.h"
+#include "session.h"
+#include "sntp.h"
+#include "uring.h"
+
+// A batch for every session fits in one go, with room for the requests
+// and replies that come up meanwhile.
+#define URING_ENTRIES 256
+static_assert(URING_ENTRIES >= SENDER_MAX_BATCH * MAX_SESSIONS + 16, "ring too small for a batch");
+
+// Buffers provided for requests. Each holds the recvmsg header, the peer's
+// address, the receive timestamp and the request, and stays taken until
+// the reply is out. Enough for a whole household syncing at once.
+#define SNTP_BUFFERS 64
+#define SNTP_BUFFER_LEN 256
+#define REPAIR_BUFFERS 16
+#define REPAIR_BUFFER_LEN 512
+
+// Packets copied out of the history for repair replies in flight.
+#define REPAIR_SLOTS 64
+
+// Batches the kernel may still be sending from. Each takes a block at least.
+#define MAX_BATCHES 64
+static_assert(MAX_BATCHES >= BlockRing::capacity(), "a batch for every block");
+
+// Errors logged at most, the rest are only counted.
+#define MAX_LOGGED_ERRORS 10
+
+static const long long e9 = 1000000000LL;
+
+// What a completion is for: the low byte of its user_data. The bits above
+// say which one.
+enum {
+    OP_TIMEOUT,
+    OP_SEND,          // packet << 8 | destination << 16 | batch << 24
+    OP_RECV,          // receiver << 8
+    OP_SNTP_REPLY,    // buffer << 8
+    OP_REPAIR_REPLY,  // slot << 8
+};
+
+static_assert(SENDER_MAX_BATCH <= 256 && MAX_SESSIONS <= 256, "packet and destination in a byte each");
+
+static struct io_uring ring;
+static int sock;
+
+/* Buffers provided to the ring for one kind of request, in a buffer ring
+ * with the same id as the index into groups[]. */
+enum { GROUP_SNTP, GROUP_REPAIR, GROUPS };
+
+struct BufferGroup {
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    int count, len;
+    int available;  // in the buffer ring, for the kernel to fill
+};
+
+static BufferGroup groups[GROUPS];
+
+/* A socket with a multishot recvmsg on it. The kernel only looks at the
+ * name and control lengths of `msg`, to lay out the buffers it fills. */
+enum { RECV_SNTP, RECV_REPAIR_1, RECV_REPAIR_2, RECEIVERS };
+
+struct Receiver {
+    int fd;
+    int group;
+    struct msghdr msg;
+    bool armed;
+};
+
+static Receiver receivers[RECEIVERS];
+
+// When each SNTP request came in and its reply was stamped, by buffer.
+static long long sntp_recv_times[SNTP_BUFFERS];
+static long long sntp_send_times[SNTP_BUFFERS];
+
+// Requests answered in place since the last flush, by buffer.
+static int sntp_replies[SNTP_BUFFERS];
+static int nsntp_replies;
+
+/* Repair replies in flight. */
+struct RepairSlot {
+    struct sockaddr_in peer;
+    char *data;
+};
+
+static RepairSlot repair_slots[REPAIR_SLOTS];
+static int free_slots[REPAIR_SLOTS];
+static int nfree_slots;
+
+// The batch uring_send() is waiting for.
+static int *batch_sent, *batch_packet_sent;
+static int batch_failed, batch_errno;
+static int pending_sends, pending_notifs;
+
+/* Sent blocks go back to block_ring in order, each batch once all of its
+ * sends are in and the kernel has notified that it's done with them. */
+struct Batch {
+    int blocks;
+    int unfinished;  // sends and notifications still to come
+};
+
+static Batch batches[MAX_BATCHES];
+static unsigned first_batch, next_batch;
+
+static bool timer_fired;
+
+static int logged_errors = 0;
+
+static void log_error(const char *what, int res) {
+    if (++logged_errors <= MAX_LOGGED_ERRORS)
+        printf("%s: %s\n", what, strerror(-res));
+}
+
+static struct io_uring_sqe *get_sqe() {
+    struct io_uring_sqe *sqe;
+    while (!(sqe = io_uring_get_sqe(&ring)))
+        io_uring_submit(&ring);
+    return sqe;
+}
+
+static void recycle(BufferGroup *g, int bid) {
+    io_uring_buf_ring_add(g->br, g->bufs + bid * g->len, g->len, bid, io_uring_buf_ring_mask(g->count), 0);
+    io_uring_buf_ring_advance(g->br, 1);
+    g->available++;
+}
+
+static bool setup_group(int bgid, int count, int len) {
+    BufferGroup *g = &groups[bgid];
+    int r;
+    g->br = io_uring_setup_buf_ring(&ring, count, bgid, 0, &r);
+    if (!g->br) {
+        printf("Can't provide buffers to io_uring: %s\n", strerror(-r));
+        return false;
+    }
+    g->bufs = (char*) malloc(count * len);
+    if (!g->bufs) {
+        perror("malloc io_uring buffers");
+        exit(1);
+    }
+    realtime_prefault(g->bufs, count * len);
+    g->count = count;
+    g->len = len;
+    g->available = 0;
+    for (int i = 0; i < count; i++)
+        recycle(g, i);
+    return true;
+}
+
+static void setup_receiver(int r, int fd, int group, size_t controllen) {
+    Receiver *rc = &receivers[r];
+    rc->fd = fd;
+    rc->group = group;
+    memset(&rc->msg, 0, sizeof(rc->msg));
+    rc->msg.msg_namelen = sizeof(struct sockaddr_in);
+    rc->msg.msg_controllen = controllen;
+    rc->armed = false;
+}
+
+// A multishot receive stops when it runs out of buffers, or on an error.
+// It's only started again once a buffer has come back.
+static void arm_receivers() {
+    for (int i = 0; i < RECEIVERS; i++) {
+        Receiver *rc = &receivers[i];
+        if (rc->armed || !groups[rc->group].available)
+            continue;
+        struct io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_recvmsg_multishot(sqe, rc->fd, &rc->msg, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = rc->group;
+        io_uring_sqe_set_data64(sqe, OP_RECV | i << 8);
+        rc->armed = true;
+    }
+}
+
+/* Answer in place, the reply goes out from the same buffer. */
+static void sntp_request(struct io_uring_recvmsg_out *out, int bid, int len) {
+    struct msghdr *msg = &receivers[RECV_SNTP].msg;
+    if (io_uring_recvmsg_payload_length(out, len, msg) < SNTP_PACKET_LEN) {
+        recycle(&groups[GROUP_SNTP], bid);
+        return;
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long recv_time = now.tv_sec * e9 + now.tv_nsec;
+    for (struct cmsghdr *cm = io_uring_recvmsg_cmsg_firsthdr(out, msg); cm; cm = io_uring_recvmsg_cmsg_nexthdr(out, msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec rt;
+            memcpy(&rt, CMSG_DATA(cm), sizeof(rt));
+            recv_time = rt.tv_sec * e9 + rt.tv_nsec - sntp_realtime_offset();
+        }
+    }
+
+    sntp_turn_around(io_uring_recvmsg_payload(out, msg), recv_time);
+    sntp_recv_times[bid] = recv_time;
+    sntp_replies[nsntp_replies++] = bid;
+}
+
+// Stamp the replies as late as possible: right before they're submitted,
+// with the next io_uring_enter().
+static void flush_sntp_replies() {
+    BufferGroup *g = &groups[GROUP_SNTP];
+    struct msghdr *msg = &receivers[RECV_SNTP].msg;
+
+    for (int i = 0; i < nsntp_replies; i++) {
+        int bid = sntp_replies[i];
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) (g->bufs + bid * g->len);
+        void *reply = io_uring_recvmsg_payload(out, msg);
+        sntp_send_times[bid] = sntp_stamp(reply);
+
+        struct io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_send(sqe, receivers[RECV_SNTP].fd, reply, SNTP_PACKET_LEN, 0);
+        io_uring_prep_send_set_addr(sqe, (struct sockaddr*) io_uring_recvmsg_name(out), out->namelen);
+        io_uring_sqe_set_data64(sqe, OP_SNTP_REPLY | bid << 8);
+    }
+    nsntp_replies = 0;
+}
+
+static void sntp_replied(int bid, int res) {
+    BufferGroup *g = &groups[GROUP_SNTP];
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) (g->bufs + bid * g->len);
+    if (res < 0) {
+        sntp_stats.errors.fetch_add(1, std::memory_order_relaxed);
+        log_error("SNTP reply", res);
+    } else {
+        struct sockaddr_in *peer = (struct sockaddr_in*) io_uring_recvmsg_name(out);
+        sntp_served(0, peer->sin_addr.s_addr, sntp_recv_times[bid], sntp_send_times[bid]);
+    }
+    recycle(g, bid);
+}
+
+/* Requests are big-endian packet counters, see repair.h. Each packet asked
+ * for is copied out of the history into a slot of its own. Once they're
+ * all taken, the rest of the request is dropped and will be asked for
+ * again. */
+static void repair_request(int fd, struct io_uring_recvmsg_out *out, int len, struct msghdr *msg) {
+    const char *counters = (const char*) io_uring_recvmsg_payload(out, msg);
+    int count = io_uring_recvmsg_payload_length(out, len, msg) / 4;
+    if (count > REPAIR_MAX_PER_REQUEST)
+        count = REPAIR_MAX_PER_REQUEST;
+
+    for (int j = 0; j < count && nfree_slots; j++) {
+        int slot = free_slots[nfree_slots - 1];
+        RepairSlot *s = &repair_slots[slot];
+        int plen = repair_load(load_be32(counters + 4 * j), s->data);
+        if (!plen)
+            continue;
+        nfree_slots--;
+
+        memcpy(&s->peer, io_uring_recvmsg_name(out), sizeof(s->peer));
+        struct io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_send(sqe, fd, s->data, plen, 0);
+        io_uring_prep_send_set_addr(sqe, (struct sockaddr*) &s->peer, sizeof(s->peer));
+        io_uring_sqe_set_data64(sqe, OP_REPAIR_REPLY | slot << 8);
+    }
+}
+
+static void repair_replied(int slot, int res) {
+    if (res < 0)
+        log_error("repair reply", res);
+    else
+        repair_count_resent(1);
+    free_slots[nfree_slots++] = slot;
+}
+
+static void received(int r, struct io_uring_cqe *cqe) {
+    Receiver *rc = &receivers[r];
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        rc->armed = false;
+    if (cqe->res < 0) {
+        // Out of buffers is expected under load, the socket keeps the
+        // requests until they're back.
+        if (cqe->res != -ENOBUFS) {
+            if (r == RECV_SNTP)
+                sntp_stats.errors.fetch_add(1, std::memory_order_relaxed);
+            log_error(r == RECV_SNTP ? "SNTP recvmsg" : "repair recvmsg", cqe->res);
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+        return;
+
+    BufferGroup *g = &groups[rc->group];
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    g->available--;
+
+    struct io_uring_recvmsg_out *out = io_uring_recvmsg_validate(g->bufs + bid * g->len, cqe->res, &rc->msg);
+    if (!out || (out->flags & MSG_TRUNC) || out->namelen != sizeof(struct sockaddr_in)) {
+        recycle(g, bid);
+        return;
+    }
+    if (r == RECV_SNTP)
+        sntp_request(out, bid, cqe->res);
+    else {
+        repair_request(rc->fd, out, cqe->res, &rc->msg);
+        recycle(g, bid);
+    }
+}
+
+static void release_batches() {
+    while (first_batch != next_batch && !batches[first_batch % MAX_BATCHES].unfinished) {
+        block_ring.release(batches[first_batch % MAX_BATCHES].blocks);
+        first_batch++;
+    }
+}
+
+// The send's result comes first, and then, if it went out, a notification
+// with the same user_data once the kernel no longer needs the buffer.
+static void sent(int packet, int dest, int batch, struct io_uring_cqe *cqe) {
+    Batch *b = &batches[batch];
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        pending_notifs--;
+        b->unfinished--;
+        release_batches();
+        return;
+    }
+
+    pending_sends--;
+    if (cqe->flags & IORING_CQE_F_MORE)
+        pending_notifs++;
+    else
+        b->unfinished--;
+    if (cqe->res < 0) {
+        batch_failed++;
+        batch_errno = -cqe->res;
+    } else {
+        batch_sent[dest]++;
+        batch_packet_sent[packet]++;
+    }
+    release_batches();
+}
+
+// Submit what's queued, wait for at least `wait_nr` completions and handle
+// all that are there.
+static void run(unsigned wait_nr) {
+    int r = io_uring_submit_and_wait(&ring, wait_nr);
+    if (r < 0 && r != -EINTR && r != -ETIME && r != -EBUSY)
+        log_error("io_uring_enter", r);
+
+    unsigned head, n = 0;
+    struct io_uring_cqe *cqe;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+        unsigned long long data = io_uring_cqe_get_data64(cqe);
+        int index = data >> 8 & 0xff;
+        switch (data & 0xff) {
+            case OP_TIMEOUT:
+                timer_fired = true;
+                break;
+            case OP_SEND:
+                sent(index, data >> 16 & 0xff, data >> 24 & 0xff, cqe);
+                break;
+            case OP_RECV:
+                received(index, cqe);
+                break;
+            case OP_SNTP_REPLY:
+                sntp_replied(index, cqe->res);
+                break;
+            case OP_REPAIR_REPLY:
+                repair_replied(index, cqe->res);
+                break;
+        }
+        n++;
+    }
+    io_uring_cq_advance(&ring, n);
+
+    flush_sntp_replies();
+    arm_receivers();
+}
+
+// On the sender thread's first call, which then owns the ring.
+static void enable() {
+    static bool enabled = false;
+    if (enabled)
+        return;
+    int r = io_uring_enable_rings(&ring);
+    if (r < 0) {
+        printf("Can't enable io_uring: %s\n", strerror(-r));
+        exit(1);
+    }
+    enabled = true;
+}
+
+void uring_wait_until(long long t) {
+    enable();
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = t / e9;
+    ts.tv_nsec = t % e9;
+
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &ts, 0, IORING_TIMEOUT_ABS);
+    io_uring_sqe_set_data64(sqe, OP_TIMEOUT);
+
+    // Any completion ends a wait, so a notification that's held back
+    // never keeps the thread past the timeout or from requests.
+    timer_fired = false;
+    while (!timer_fired)
+        run(1);
+}
+
+int uring_send(const char *const *packets, int n, int len, const struct sockaddr_in *dests, int ndests,
+               int *sent, int *packet_sent) {
+    enable();
+    batch_sent = sent;
+    batch_packet_sent = packet_sent;
+    batch_failed = 0;
+
+    unsigned batch = next_batch++ % MAX_BATCHES;
+    batches[batch].blocks = n;
+    batches[batch].unfinished = n * ndests;
+
+    for (int d = 0; d < ndests; d++) {
+        for (int i = 0; i < n; i++) {
+            struct io_uring_sqe *sqe = get_sqe();
+            io_uring_prep_send_zc_fixed(sqe, sock, packets[i], len, 0, 0, 0);
+            io_uring_prep_send_set_addr(sqe, (const struct sockaddr*) &dests[d], sizeof(dests[d]));
+            io_uring_sqe_set_data64(sqe, OP_SEND | i << 8 | d << 16 | (unsigned long long) batch << 24);
+            pending_sends++;
+        }
+    }
+    if (!ndests)
+        release_batches();
+
+    // UDP sends normally complete right away, so this doesn't sleep. The
+    // notifications come in while waiting for the next packet.
+    while (pending_sends) {
+        run(pending_sends);
+        sender_stats.syscalls++;
+    }
+
+    if (batch_failed)
+        errno = batch_errno;
+    return batch_failed;
+}
+
+bool uring_init(int s, int packet_len) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Completions are only ever reaped by the sender thread from within
+    // io_uring_enter(), so they can wait until it's in there. The ring is
+    // the thread's that enables it, see enable().
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    int r = io_uring_queue_init_params(URING_ENTRIES, &ring, &params);
+    if (r == -EINVAL) {
+        printf("io_uring needs Linux 6.1 or later\n");
+        return false;
+    }
+    if (r < 0) {
+        printf("Can't set up io_uring: %s\n", strerror(-r));
+        return false;
+    }
+
+    struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    bool supported = probe && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+    if (probe)
+        io_uring_free_probe(probe);
+    if (!supported) {
+        printf("io_uring needs Linux 6.1 or later, for zero-copy sends and multishot receives\n");
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+
+    // block_ring never moves, so it's registered once and for all.
+    struct iovec iov;
+    iov.iov_base = &block_ring;
+    iov.iov_len = sizeof(block_ring);
+    r = io_uring_register_buffers(&ring, &iov, 1);
+    if (r < 0) {
+        printf("Can't register buffers with io_uring: %s%s\n", strerror(-r),
+               r == -ENOMEM ? ", raise the memlock limit (ulimit -l)" : "");
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+
+    if (!setup_group(GROUP_SNTP, SNTP_BUFFERS, SNTP_BUFFER_LEN) ||
+        !setup_group(GROUP_REPAIR, REPAIR_BUFFERS, REPAIR_BUFFER_LEN)) {
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+
+    char *data = (char*) malloc(REPAIR_SLOTS * packet_len);
+    if (!data) {
+        perror("malloc repair slots");
+        exit(1);
+    }
+    realtime_prefault(data, REPAIR_SLOTS * packet_len);
+    for (int i = 0; i < REPAIR_SLOTS; i++) {
+        repair_slots[i].data = data + i * packet_len;
+        free_slots[i] = i;
+    }
+    nfree_slots = REPAIR_SLOTS;
+
+    sock = s;
+    setup_receiver(RECV_SNTP, sntp_open(), GROUP_SNTP, CMSG_SPACE(sizeof(timespec)));
+    setup_receiver(RECV_REPAIR_1, repair_open_socket(REPAIR_PORT_1), GROUP_REPAIR, 0);
+    setup_receiver(RECV_REPAIR_2, repair_open_socket(REPAIR_PORT_2), GROUP_REPAIR, 0);
+    // Submitted with the sender thread's first wait.
+    arm_receivers();
+
+    printf("Sending, SNTP and repairs from one io_uring of %d entries\n", URING_ENTRIES);
+    return true;
+}
+
+#else
+
+#include <stdio.h>
+
+#include "uring.h"
+
+bool uring_init(int, int) {
+    printf("This stream binary was built without io_uring support (make IO_URING=1)\n");
+    return false;
+}
+
+// Never called, there's no SEND_URING without uring_init().
+void uring_wait_until(long long) {
+}
+
+int uring_send(const char *const *, int, int, const struct sockaddr_in *, int, int *, int *) {
+    return 0;
+}
+
+#endif
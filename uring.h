@@ -0,0 +1,42 @@
+#pragma once
+
+#include <netinet/in.h>
+
+/* io_uring I/O engine (--io=uring, build with make IO_URING=1).
+ *
+ * The sender thread does all of the network I/O from one ring, and there
+ * are no SNTP or repair threads:
+ *
+ *  - packets go out with IORING_OP_SEND_ZC straight from block_ring, which
+ *    is registered with the ring once at startup, each packet's header and
+ *    payload as one buffer;
+ *  - the SNTP and repair ports each have a multishot recvmsg outstanding,
+ *    into buffers provided to the ring, and the replies go out through it;
+ *  - the sender's pacing sleeps are IORING_OP_TIMEOUTs on CLOCK_MONOTONIC,
+ *    and requests get served while it waits for them.
+ *
+ * So the thread only ever blocks in io_uring_enter(): once per packet
+ * period, and once per burst of requests or of the kernel's zero-copy
+ * notifications, which hand sent blocks back to capture. Handing over a
+ * batch for all destinations takes one more that doesn't block. The control
+ * socket stays on the mainloop, since its commands act on the capture state
+ * that lives there. */
+
+// Set up the ring on `sock`, for packets, and bind the SNTP and repair
+// ports to it. Repair replies are at most `packet_len` bytes. Says why and
+// returns false, without binding anything, if io_uring can't be used.
+bool uring_init(int sock, int packet_len);
+
+// Serve SNTP and repair requests until CLOCK_MONOTONIC time `t`. Sender
+// thread only, like uring_send().
+void uring_wait_until(long long t);
+
+// Send each of the n packets of `len` bytes, which must lie in the n blocks
+// at the front of block_ring, to every destination. The caller consume()s
+// those blocks, and they're release()d once the kernel is done with them.
+// Adds what made it to each destination's entry in `sent` and to each
+// packet's in `packet_sent`, and the io_uring_enter() calls it took to
+// sender_stats.syscalls. Returns how many sends failed, with errno set to
+// why the last one did.
+int uring_send(const char *const *packets, int n, int len, const struct sockaddr_in *dests, int ndests,
+               int *sent, int *packet_sent);